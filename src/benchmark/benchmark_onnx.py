@@ -22,6 +22,10 @@ def main() -> None:
         "-m", "--model", required=True, help="Path to Onnx model file (.onnx)"
     )
     parser.add_argument("-c", "--config", help="Path to model config file (.json)")
+    parser.add_argument(
+        "--reference-model",
+        help="Path to fp32 model (.onnx) for comparing a quantized variant",
+    )
     args = parser.parse_args()
     logging.basicConfig(level=logging.DEBUG)
 
@@ -70,15 +74,26 @@ def main() -> None:
             )
         )
 
-    json.dump(
-        {
-            "load_sec": load_sec,
-            "rtf_mean": statistics.mean(synthesize_rtf),
-            "rtf_stdev": statistics.stdev(synthesize_rtf),
-            "rtfs": synthesize_rtf,
-        },
-        sys.stdout,
-    )
+    results = {
+        "load_sec": load_sec,
+        "rtf_mean": statistics.mean(synthesize_rtf),
+        "rtf_stdev": statistics.stdev(synthesize_rtf),
+        "rtfs": synthesize_rtf,
+    }
+
+    if args.reference_model:
+        results.update(
+            compare_reference(
+                session,
+                onnxruntime.InferenceSession(
+                    args.reference_model, sess_options=session_options
+                ),
+                utterances,
+                sample_rate,
+            )
+        )
+
+    json.dump(results, sys.stdout)
 
 
 def synthesize(session, phoneme_ids, speaker_id, sample_rate) -> float:
@@ -121,5 +136,34 @@ def synthesize(session, phoneme_ids, speaker_id, sample_rate) -> float:
     return rtf
 
 
+def compare_reference(session, reference_session, utterances, sample_rate) -> dict:
+    """RTF and mel-cepstral distance of a quantized model relative to fp32"""
+    from piper_train.quantize_onnx import make_inputs, mel_cepstral_distance
+
+    reference_rtf = []
+    distances = []
+    for utterance in utterances:
+        phoneme_ids = utterance["phoneme_ids"]
+        speaker_id = utterance.get("speaker_id")
+        reference_rtf.append(
+            synthesize(reference_session, phoneme_ids, speaker_id, sample_rate)
+        )
+
+        # Deterministic scales so both outputs can be compared frame by frame
+        num_speakers = 1 if speaker_id is None else 2
+        inputs = make_inputs(phoneme_ids, speaker_id or 0, num_speakers)
+        audio = session.run(None, inputs)[0].squeeze()
+        reference_audio = reference_session.run(None, inputs)[0].squeeze()
+        distances.append(
+            mel_cepstral_distance(reference_audio, audio, sample_rate)
+        )
+
+    return {
+        "reference_rtf_mean": statistics.mean(reference_rtf),
+        "mcd_mean": statistics.mean(distances),
+        "mcd_max": max(distances),
+    }
+
+
 if __name__ == "__main__":
     main()
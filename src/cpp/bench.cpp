@@ -0,0 +1,449 @@
+// Replays test sentences through the C++ runtime and reports per-stage
+// latency distributions as JSON.
+//
+// bench_piper -m voice.onnx --espeak_data DIR --sentences_dir DIR > bench.json
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+
+#include "json.hpp"
+#include "piper.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+
+// ----------------------------------------------------------------------------
+// Allocation counting
+
+static atomic<uint64_t> allocationCount{0};
+static atomic<uint64_t> allocationBytes{0};
+
+void *operator new(size_t size) {
+  allocationCount.fetch_add(1, memory_order_relaxed);
+  allocationBytes.fetch_add(size, memory_order_relaxed);
+  if (void *ptr = malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+
+  throw bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+// Peak resident set size in bytes
+static uint64_t getPeakRss() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return counters.PeakWorkingSetSize;
+  }
+  return 0;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return (uint64_t)usage.ru_maxrss;
+#else
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+struct BenchConfig {
+  filesystem::path modelPath;
+  filesystem::path modelConfigPath;
+  optional<string> eSpeakDataPath;
+  optional<string> tashkeelModelPath;
+
+  // Directory with <lang>.txt and test_<lang>.jsonl files
+  filesystem::path sentencesDir = "etc/test_sentences";
+
+  // Explicit sentence files (overrides sentencesDir)
+  vector<filesystem::path> sentenceFiles;
+
+  int warmup = 1;
+  int iterations = 3;
+  bool useCuda = false;
+  bool useQuantizedModel = true;
+  piper::AudioEffects effects;
+};
+
+// Sentence files for a voice, e.g. en-us -> en-us.txt, en.txt, test_en-us.jsonl
+static vector<filesystem::path> findSentenceFiles(const filesystem::path &dir,
+                                                  const string &voiceName) {
+  vector<filesystem::path> files;
+  vector<string> names{voiceName};
+  auto dashIndex = voiceName.find('-');
+  if (dashIndex != string::npos) {
+    names.push_back(voiceName.substr(0, dashIndex));
+  }
+
+  for (auto &name : names) {
+    for (auto fileName : {name + ".txt", "test_" + name + ".jsonl"}) {
+      auto path = dir / fileName;
+      if (filesystem::exists(path)) {
+        files.push_back(path);
+      }
+    }
+
+    if (!files.empty()) {
+      break;
+    }
+  }
+
+  return files;
+}
+
+// Lines of text (.txt) or "text" fields (.jsonl)
+static vector<string> loadSentences(const vector<filesystem::path> &files) {
+  vector<string> sentences;
+  for (auto &path : files) {
+    ifstream file(path);
+    string line;
+    bool isJson = (path.extension() == ".jsonl");
+    while (getline(file, line)) {
+      if (line.empty()) {
+        continue;
+      }
+
+      if (isJson) {
+        auto lineJson = json::parse(line);
+        if (lineJson.contains("text")) {
+          sentences.push_back(lineJson["text"].get<string>());
+        }
+      } else {
+        sentences.push_back(line);
+      }
+    }
+  }
+
+  return sentences;
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+
+  size_t rank = (size_t)((p / 100.0) * (double)sorted.size());
+  return sorted[min(rank, sorted.size() - 1)];
+}
+
+static json summarize(vector<double> values) {
+  sort(values.begin(), values.end());
+  double sum = 0;
+  for (auto value : values) {
+    sum += value;
+  }
+
+  return json{{"count", values.size()},
+              {"mean", values.empty() ? 0 : sum / values.size()},
+              {"p50", percentile(values, 50)},
+              {"p95", percentile(values, 95)},
+              {"p99", percentile(values, 99)},
+              {"max", values.empty() ? 0 : values.back()}};
+}
+
+void parseArgs(int argc, char *argv[], BenchConfig &benchConfig);
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  spdlog::set_default_logger(spdlog::stderr_color_st("bench_piper"));
+
+  BenchConfig benchConfig;
+  parseArgs(argc, argv, benchConfig);
+
+  piper::PiperConfig piperConfig;
+  piper::Voice voice;
+  optional<piper::SpeakerId> speakerId;
+
+  piperConfig.useQuantizedModel = benchConfig.useQuantizedModel;
+
+  auto loadStartTime = chrono::steady_clock::now();
+  loadVoice(piperConfig, benchConfig.modelPath.string(),
+            benchConfig.modelConfigPath.string(), voice, speakerId,
+            benchConfig.useCuda);
+  double loadSeconds =
+      chrono::duration<double>(chrono::steady_clock::now() - loadStartTime)
+          .count();
+
+  if (voice.phonemizeConfig.phonemeType == piper::eSpeakPhonemes) {
+    piperConfig.eSpeakDataPath = benchConfig.eSpeakDataPath.value_or(
+        (benchConfig.modelPath.parent_path() / "espeak-ng-data").string());
+  } else {
+    piperConfig.useESpeak = false;
+  }
+
+  if (voice.phonemizeConfig.eSpeak.voice == "ar") {
+    piperConfig.useTashkeel = true;
+    piperConfig.tashkeelModelPath = benchConfig.tashkeelModelPath;
+  }
+
+  piper::initialize(piperConfig);
+
+  auto sentenceFiles = benchConfig.sentenceFiles;
+  if (sentenceFiles.empty()) {
+    sentenceFiles = findSentenceFiles(benchConfig.sentencesDir,
+                                      voice.phonemizeConfig.eSpeak.voice);
+  }
+
+  auto sentences = loadSentences(sentenceFiles);
+  if (sentences.empty()) {
+    throw runtime_error("No test sentences found");
+  }
+
+  for (auto &path : sentenceFiles) {
+    spdlog::info("Using sentences from {}", path.string());
+  }
+
+  // Warm up (first runs include ORT/eSpeak initialization)
+  for (int i = 0; i < benchConfig.warmup; i++) {
+    for (auto &sentence : sentences) {
+      piper::SynthesisResult result;
+      auto encoder = piper::createEncoder(piper::OUTPUT_FORMAT_WAV);
+      stringstream audioStream;
+      piper::textToEncodedAudio(piperConfig, voice, sentence,
+                                benchConfig.effects, *encoder, audioStream,
+                                result);
+    }
+  }
+
+  // Per-utterance samples for each stage (seconds)
+  map<string, vector<double>> stageSeconds;
+  vector<double> rtfs;
+  vector<double> allocations;
+  vector<double> allocatedBytes;
+  double totalAudioSeconds = 0;
+  double totalSeconds = 0;
+
+  for (int i = 0; i < benchConfig.iterations; i++) {
+    for (auto &sentence : sentences) {
+      piper::SynthesisResult result;
+      auto encoder = piper::createEncoder(piper::OUTPUT_FORMAT_WAV);
+      stringstream audioStream;
+
+      uint64_t startAllocations = allocationCount.load();
+      uint64_t startBytes = allocationBytes.load();
+      auto startTime = chrono::steady_clock::now();
+      piper::textToEncodedAudio(piperConfig, voice, sentence,
+                                benchConfig.effects, *encoder, audioStream,
+                                result);
+      double seconds =
+          chrono::duration<double>(chrono::steady_clock::now() - startTime)
+              .count();
+      allocations.push_back(
+          (double)(allocationCount.load() - startAllocations));
+      allocatedBytes.push_back((double)(allocationBytes.load() - startBytes));
+
+      stageSeconds["tashkeel"].push_back(result.tashkeelSeconds);
+      stageSeconds["phonemize"].push_back(result.phonemizeSeconds);
+      stageSeconds["phoneme_ids"].push_back(result.phonemeIdSeconds);
+      stageSeconds["infer"].push_back(result.inferSeconds);
+      stageSeconds["quantize"].push_back(result.quantizeSeconds);
+      stageSeconds["effects"].push_back(result.effectsSeconds);
+      stageSeconds["wav_write"].push_back(result.encodeSeconds);
+      stageSeconds["total"].push_back(seconds);
+      for (auto &[effectName, effectSeconds] : result.effectSeconds) {
+        stageSeconds["effect_" + effectName].push_back(effectSeconds);
+      }
+
+      if (result.audioSeconds > 0) {
+        rtfs.push_back(seconds / result.audioSeconds);
+      }
+
+      totalAudioSeconds += result.audioSeconds;
+      totalSeconds += seconds;
+    }
+  }
+
+  piper::terminate(piperConfig);
+
+  json stagesJson = json::object();
+  for (auto &[stageName, values] : stageSeconds) {
+    stagesJson[stageName] = summarize(values);
+  }
+
+  json resultJson{
+      {"model", benchConfig.modelPath.string()},
+      {"version", piper::getVersion()},
+      {"utterances", sentences.size()},
+      {"iterations", benchConfig.iterations},
+      {"load_seconds", loadSeconds},
+      {"stage_seconds", stagesJson},
+      {"rtf", summarize(rtfs)},
+      {"rtf_overall",
+       totalAudioSeconds > 0 ? totalSeconds / totalAudioSeconds : 0},
+      {"allocations", summarize(allocations)},
+      {"allocated_bytes", summarize(allocatedBytes)},
+      {"peak_rss_bytes", getPeakRss()},
+  };
+
+  cout << resultJson.dump(2) << endl;
+
+  return EXIT_SUCCESS;
+}
+
+// ----------------------------------------------------------------------------
+
+void printUsage(char *argv[]) {
+  cerr << endl;
+  cerr << "usage: " << argv[0] << " [options]" << endl;
+  cerr << endl;
+  cerr << "options:" << endl;
+  cerr << "   -h        --help              show this message and exit" << endl;
+  cerr << "   -m  FILE  --model       FILE  path to onnx model file" << endl;
+  cerr << "   -c  FILE  --config      FILE  path to model config file "
+          "(default: model path + .json)"
+       << endl;
+  cerr << "   --sentences_dir         DIR   directory with test sentences "
+          "(default: etc/test_sentences)"
+       << endl;
+  cerr << "   --sentences             FILE  .txt or .jsonl sentence file "
+          "(may be repeated)"
+       << endl;
+  cerr << "   --iterations            NUM   timed passes over the sentences "
+          "(default: 3)"
+       << endl;
+  cerr << "   --warmup                NUM   untimed passes (default: 1)" << endl;
+  cerr << "   --espeak_data           DIR   path to espeak-ng data directory"
+       << endl;
+  cerr << "   --tashkeel_model        FILE  path to libtashkeel onnx model "
+          "(arabic)"
+       << endl;
+  cerr << "   --speed                 NUM   speed effect factor" << endl;
+  cerr << "   --volume                NUM   volume effect factor" << endl;
+  cerr << "   --semitones             NUM   pitch effect in semitones" << endl;
+  cerr << "   --channels              NUM   number of output channels" << endl;
+  cerr << "   --effect                NAME  telephone, cave, smallCave, "
+          "gasMask, badReception, nextRoom, alien, alien2"
+       << endl;
+  cerr << "   --use-cuda                    use CUDA execution provider"
+       << endl;
+  cerr << "   --no-quantized                ignore .int8.onnx/.fp16.onnx model "
+          "variants"
+       << endl;
+  cerr << endl;
+}
+
+void ensureArg(int argc, char *argv[], int argi) {
+  if ((argi + 1) >= argc) {
+    printUsage(argv);
+    exit(0);
+  }
+}
+
+void parseArgs(int argc, char *argv[], BenchConfig &benchConfig) {
+  optional<filesystem::path> modelConfigPath;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-m" || arg == "--model") {
+      ensureArg(argc, argv, i);
+      benchConfig.modelPath = filesystem::path(argv[++i]);
+    } else if (arg == "-c" || arg == "--config") {
+      ensureArg(argc, argv, i);
+      modelConfigPath = filesystem::path(argv[++i]);
+    } else if (arg == "--sentences_dir" || arg == "--sentences-dir") {
+      ensureArg(argc, argv, i);
+      benchConfig.sentencesDir = filesystem::path(argv[++i]);
+    } else if (arg == "--sentences") {
+      ensureArg(argc, argv, i);
+      benchConfig.sentenceFiles.push_back(filesystem::path(argv[++i]));
+    } else if (arg == "--iterations") {
+      ensureArg(argc, argv, i);
+      benchConfig.iterations = stoi(argv[++i]);
+    } else if (arg == "--warmup") {
+      ensureArg(argc, argv, i);
+      benchConfig.warmup = stoi(argv[++i]);
+    } else if (arg == "--espeak_data" || arg == "--espeak-data") {
+      ensureArg(argc, argv, i);
+      benchConfig.eSpeakDataPath = argv[++i];
+    } else if (arg == "--tashkeel_model" || arg == "--tashkeel-model") {
+      ensureArg(argc, argv, i);
+      benchConfig.tashkeelModelPath = argv[++i];
+    } else if (arg == "--speed") {
+      ensureArg(argc, argv, i);
+      benchConfig.effects.speed = stof(argv[++i]);
+    } else if (arg == "--volume") {
+      ensureArg(argc, argv, i);
+      benchConfig.effects.volume = stof(argv[++i]);
+    } else if (arg == "--semitones") {
+      ensureArg(argc, argv, i);
+      benchConfig.effects.semitones = stof(argv[++i]);
+    } else if (arg == "--channels") {
+      ensureArg(argc, argv, i);
+      benchConfig.effects.channels = stoi(argv[++i]);
+    } else if (arg == "--effect") {
+      ensureArg(argc, argv, i);
+      std::string effectName = argv[++i];
+      auto &effects = benchConfig.effects;
+      if (effectName == "telephone") {
+        effects.telephone = true;
+      } else if (effectName == "cave") {
+        effects.cave = true;
+      } else if (effectName == "smallCave") {
+        effects.smallCave = true;
+      } else if (effectName == "gasMask") {
+        effects.gasMask = true;
+      } else if (effectName == "badReception") {
+        effects.badReception = true;
+      } else if (effectName == "nextRoom") {
+        effects.nextRoom = true;
+      } else if (effectName == "alien") {
+        effects.alien = true;
+      } else if (effectName == "alien2") {
+        effects.alien2 = true;
+      } else {
+        throw invalid_argument("Unknown effect: " + effectName);
+      }
+    } else if (arg == "--use_cuda" || arg == "--use-cuda") {
+      benchConfig.useCuda = true;
+    } else if (arg == "--no_quantized" || arg == "--no-quantized") {
+      benchConfig.useQuantizedModel = false;
+    } else if (arg == "--debug") {
+      spdlog::set_level(spdlog::level::debug);
+    } else if (arg == "-h" || arg == "--help") {
+      printUsage(argv);
+      exit(0);
+    }
+  }
+
+  if (benchConfig.modelPath.empty()) {
+    printUsage(argv);
+    exit(1);
+  }
+
+  benchConfig.modelConfigPath = modelConfigPath.value_or(
+      filesystem::path(benchConfig.modelPath.string() + ".json"));
+}
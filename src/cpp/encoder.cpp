@@ -0,0 +1,897 @@
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <ogg/ogg.h>
+#include <opus/opus.h>
+
+#include "encoder.hpp"
+#include "wavfile.hpp"
+
+namespace piper
+{
+
+  // ----------------------------------------------------------------------------
+  // WAV (PCM, mu-law, A-law)
+  // ----------------------------------------------------------------------------
+
+  // WAV format tags
+  const uint16_t WAVE_FORMAT_PCM = 1;
+  const uint16_t WAVE_FORMAT_ALAW = 6;
+  const uint16_t WAVE_FORMAT_MULAW = 7;
+
+  // G.711 mu-law (see Sun Microsystems g711.c)
+  uint8_t linearToMuLaw(int16_t pcmValue)
+  {
+    const int BIAS = 0x84;
+    const int CLIP = 8159;
+
+    int sample = pcmValue >> 2;
+    int mask = 0xFF;
+    if (sample < 0)
+    {
+      mask = 0x7F;
+      sample = -sample;
+    }
+
+    sample = std::min(sample, CLIP) + (BIAS >> 2);
+
+    int segment = 0;
+    while ((segment < 8) && (sample > ((0x40 << segment) - 1)))
+    {
+      segment++;
+    }
+
+    if (segment >= 8)
+    {
+      return static_cast<uint8_t>(0x7F ^ mask);
+    }
+
+    int value = (segment << 4) | ((sample >> (segment + 1)) & 0x0F);
+    return static_cast<uint8_t>(value ^ mask);
+  }
+
+  // G.711 A-law (see Sun Microsystems g711.c)
+  uint8_t linearToALaw(int16_t pcmValue)
+  {
+    int sample = pcmValue >> 3;
+    int mask = 0xD5;
+    if (sample < 0)
+    {
+      mask = 0x55;
+      sample = -sample - 1;
+    }
+
+    int segment = 0;
+    while ((segment < 8) && (sample > ((0x20 << segment) - 1)))
+    {
+      segment++;
+    }
+
+    if (segment >= 8)
+    {
+      return static_cast<uint8_t>(0x7F ^ mask);
+    }
+
+    int value = segment << 4;
+    if (segment < 2)
+    {
+      value |= (sample >> 1) & 0x0F;
+    }
+    else
+    {
+      value |= (sample >> segment) & 0x0F;
+    }
+
+    return static_cast<uint8_t>(value ^ mask);
+  }
+
+  class WavEncoder : public AudioEncoder
+  {
+  public:
+    WavEncoder(uint16_t audioFormat) : audioFormat(audioFormat) {}
+
+    std::string contentType() const override
+    {
+      if (audioFormat == WAVE_FORMAT_MULAW)
+      {
+        return "audio/wav; codecs=7";
+      }
+
+      if (audioFormat == WAVE_FORMAT_ALAW)
+      {
+        return "audio/wav; codecs=6";
+      }
+
+      return "audio/wav";
+    }
+
+    std::string fileExtension() const override { return "wav"; }
+
+    std::size_t estimateSize(std::size_t numSamples, int, int) const override
+    {
+      if (audioFormat == WAVE_FORMAT_PCM)
+      {
+        return sizeof(WavHeader) + (numSamples * sizeof(int16_t));
+      }
+
+      return sizeof(WavNonPcmHeader) + numSamples;
+    }
+
+    void begin(int sampleRate, int channels, std::ostream &out) override
+    {
+      int sampleWidth = (audioFormat == WAVE_FORMAT_PCM) ? 2 : 1;
+      writer = std::make_unique<WavWriter>(out, sampleRate, sampleWidth,
+                                           channels, audioFormat);
+    }
+
+    void encode(const int16_t *samples, std::size_t numSamples,
+                std::ostream &) override
+    {
+      if (audioFormat == WAVE_FORMAT_PCM)
+      {
+        writer->writeSamples(samples, numSamples);
+        return;
+      }
+
+      companded.resize(numSamples);
+      for (std::size_t i = 0; i < numSamples; i++)
+      {
+        companded[i] = (audioFormat == WAVE_FORMAT_MULAW)
+                           ? linearToMuLaw(samples[i])
+                           : linearToALaw(samples[i]);
+      }
+
+      writer->writeBytes(reinterpret_cast<const char *>(companded.data()),
+                         companded.size());
+    }
+
+    void end(std::ostream &) override
+    {
+      writer->close();
+      writer.reset();
+    }
+
+  private:
+    uint16_t audioFormat;
+    std::unique_ptr<WavWriter> writer;
+    std::vector<uint8_t> companded;
+  };
+
+  // ----------------------------------------------------------------------------
+  // FLAC
+  // ----------------------------------------------------------------------------
+
+  // Samples per channel in each FLAC frame
+  const uint32_t FLAC_BLOCK_SIZE = 4096;
+
+  // Highest fixed predictor order in FLAC
+  const uint32_t FLAC_MAX_FIXED_ORDER = 4;
+
+  // Rice parameter 15 is reserved as an escape code
+  const uint32_t FLAC_MAX_RICE_PARAMETER = 14;
+
+  // "fLaC" marker and STREAMINFO block
+  const std::size_t FLAC_HEADER_SIZE = 42;
+
+  // Writes bits MSB first
+  class BitWriter
+  {
+  public:
+    std::vector<uint8_t> bytes;
+
+    void writeBits(uint32_t value, int numBits)
+    {
+      if (numBits <= 0)
+      {
+        return;
+      }
+
+      uint64_t mask = (numBits >= 32) ? 0xFFFFFFFFull : ((1ull << numBits) - 1);
+      accumulator = (accumulator << numBits) | (value & mask);
+      accumulatedBits += numBits;
+
+      while (accumulatedBits >= 8)
+      {
+        accumulatedBits -= 8;
+        bytes.push_back(static_cast<uint8_t>(accumulator >> accumulatedBits));
+      }
+
+      accumulator &= (1ull << accumulatedBits) - 1;
+    }
+
+    void writeSigned(int32_t value, int numBits)
+    {
+      writeBits(static_cast<uint32_t>(value), numBits);
+    }
+
+    // Unary code: zeros followed by a one
+    void writeUnary(uint32_t value)
+    {
+      while (value >= 32)
+      {
+        writeBits(0, 32);
+        value -= 32;
+      }
+
+      writeBits(1, value + 1);
+    }
+
+    void alignToByte()
+    {
+      if (accumulatedBits > 0)
+      {
+        writeBits(0, 8 - accumulatedBits);
+      }
+    }
+
+    void clear()
+    {
+      bytes.clear();
+      accumulator = 0;
+      accumulatedBits = 0;
+    }
+
+  private:
+    uint64_t accumulator = 0;
+    int accumulatedBits = 0;
+  };
+
+  uint8_t flacCrc8(const uint8_t *data, std::size_t length)
+  {
+    uint8_t crc = 0;
+    for (std::size_t i = 0; i < length; i++)
+    {
+      crc ^= data[i];
+      for (int bit = 0; bit < 8; bit++)
+      {
+        crc = (crc & 0x80) ? static_cast<uint8_t>((crc << 1) ^ 0x07)
+                           : static_cast<uint8_t>(crc << 1);
+      }
+    }
+
+    return crc;
+  }
+
+  uint16_t flacCrc16(const uint8_t *data, std::size_t length)
+  {
+    uint16_t crc = 0;
+    for (std::size_t i = 0; i < length; i++)
+    {
+      crc ^= static_cast<uint16_t>(data[i] << 8);
+      for (int bit = 0; bit < 8; bit++)
+      {
+        crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x8005)
+                             : static_cast<uint16_t>(crc << 1);
+      }
+    }
+
+    return crc;
+  }
+
+  // Residual of fixed polynomial predictor
+  int32_t fixedResidual(const int32_t *signal, uint32_t i, uint32_t order)
+  {
+    switch (order)
+    {
+    case 0:
+      return signal[i];
+    case 1:
+      return signal[i] - signal[i - 1];
+    case 2:
+      return signal[i] - 2 * signal[i - 1] + signal[i - 2];
+    case 3:
+      return signal[i] - 3 * signal[i - 1] + 3 * signal[i - 2] - signal[i - 3];
+    default:
+      return signal[i] - 4 * signal[i - 1] + 6 * signal[i - 2] -
+             4 * signal[i - 3] + signal[i - 4];
+    }
+  }
+
+  uint32_t zigzag(int32_t value)
+  {
+    return (static_cast<uint32_t>(value) << 1) ^
+           static_cast<uint32_t>(value >> 31);
+  }
+
+  // Lossless encoder using fixed predictors and Rice-coded residuals
+  class FlacEncoder : public AudioEncoder
+  {
+  public:
+    std::string contentType() const override { return "audio/flac"; }
+
+    std::string fileExtension() const override { return "flac"; }
+
+    // Upper bound for speech: the size of the PCM audio plus STREAMINFO
+    std::size_t estimateSize(std::size_t numSamples, int, int) const override
+    {
+      return FLAC_HEADER_SIZE + (numSamples * sizeof(int16_t));
+    }
+
+    void begin(int sampleRate, int channels, std::ostream &out) override
+    {
+      this->sampleRate = sampleRate;
+      this->channels = channels;
+      totalFrames = 0;
+      frameNumber = 0;
+      minFrameSize = std::numeric_limits<uint32_t>::max();
+      maxFrameSize = 0;
+      pending.clear();
+      pending.reserve(FLAC_BLOCK_SIZE * channels);
+
+      headerPos = out.tellp();
+      writeHeader(out);
+    }
+
+    void encode(const int16_t *samples, std::size_t numSamples,
+                std::ostream &out) override
+    {
+      const std::size_t blockSamples = FLAC_BLOCK_SIZE * channels;
+      for (std::size_t i = 0; i < numSamples; i++)
+      {
+        pending.push_back(samples[i]);
+        if (pending.size() >= blockSamples)
+        {
+          encodeFrame(FLAC_BLOCK_SIZE, out);
+          pending.clear();
+        }
+      }
+    }
+
+    void end(std::ostream &out) override
+    {
+      if (!pending.empty())
+      {
+        encodeFrame(pending.size() / channels, out);
+        pending.clear();
+      }
+
+      if (headerPos == std::streampos(-1))
+      {
+        // Not seekable, total samples stays unknown (0)
+        return;
+      }
+
+      auto endPos = out.tellp();
+      out.seekp(headerPos);
+      writeHeader(out);
+      out.seekp(endPos);
+    }
+
+  private:
+    int sampleRate = 22050;
+    int channels = 1;
+    uint64_t totalFrames = 0;
+    uint32_t frameNumber = 0;
+    uint32_t minFrameSize = 0;
+    uint32_t maxFrameSize = 0;
+    std::streampos headerPos = -1;
+    std::vector<int16_t> pending;
+    std::vector<int32_t> channelSignal;
+    BitWriter bits;
+
+    // "fLaC" marker and STREAMINFO
+    void writeHeader(std::ostream &out)
+    {
+      bits.clear();
+      bits.writeBits('f', 8);
+      bits.writeBits('L', 8);
+      bits.writeBits('a', 8);
+      bits.writeBits('C', 8);
+
+      // Last metadata block, type STREAMINFO, 34 bytes
+      bits.writeBits(1, 1);
+      bits.writeBits(0, 7);
+      bits.writeBits(34, 24);
+
+      bits.writeBits(FLAC_BLOCK_SIZE, 16);
+      bits.writeBits(FLAC_BLOCK_SIZE, 16);
+      bits.writeBits((maxFrameSize > 0) ? minFrameSize : 0, 24);
+      bits.writeBits(maxFrameSize, 24);
+      bits.writeBits(sampleRate, 20);
+      bits.writeBits(channels - 1, 3);
+      bits.writeBits(16 - 1, 5);
+      bits.writeBits(static_cast<uint32_t>(totalFrames >> 32), 4);
+      bits.writeBits(static_cast<uint32_t>(totalFrames), 32);
+
+      // No MD5 signature
+      for (int i = 0; i < 4; i++)
+      {
+        bits.writeBits(0, 32);
+      }
+
+      out.write(reinterpret_cast<const char *>(bits.bytes.data()),
+                bits.bytes.size());
+    }
+
+    // Frame number as UTF-8-like variable length integer
+    void writeFrameNumber(uint32_t value)
+    {
+      if (value < 0x80)
+      {
+        bits.writeBits(value, 8);
+        return;
+      }
+
+      int extraBytes = 1;
+      while ((extraBytes < 5) && (value >= (1u << (6 + (5 * extraBytes)))))
+      {
+        extraBytes++;
+      }
+
+      uint32_t leadingOnes = (0xFF00u >> (extraBytes + 1)) & 0xFF;
+      bits.writeBits(leadingOnes | (value >> (6 * extraBytes)), 8);
+      for (int i = extraBytes - 1; i >= 0; i--)
+      {
+        bits.writeBits(0x80 | ((value >> (6 * i)) & 0x3F), 8);
+      }
+    }
+
+    void encodeFrame(uint32_t blockSize, std::ostream &out)
+    {
+      bits.clear();
+
+      // Frame header
+      bits.writeBits(0x3FFE, 14); // sync code
+      bits.writeBits(0, 1);
+      bits.writeBits(0, 1); // fixed block size
+      bool fullBlock = (blockSize == FLAC_BLOCK_SIZE);
+      bits.writeBits(fullBlock ? 12 : 7, 4); // 4096 or 16-bit size at end
+      bits.writeBits(0, 4);                  // sample rate from STREAMINFO
+      bits.writeBits(channels - 1, 4);       // independent channels
+      bits.writeBits(4, 3);                  // 16 bits per sample
+      bits.writeBits(0, 1);
+      writeFrameNumber(frameNumber);
+      if (!fullBlock)
+      {
+        bits.writeBits(blockSize - 1, 16);
+      }
+      bits.writeBits(flacCrc8(bits.bytes.data(), bits.bytes.size()), 8);
+
+      // One subframe per channel
+      channelSignal.resize(blockSize);
+      for (int channel = 0; channel < channels; channel++)
+      {
+        for (uint32_t i = 0; i < blockSize; i++)
+        {
+          channelSignal[i] = pending[(i * channels) + channel];
+        }
+
+        encodeSubframe(channelSignal.data(), blockSize);
+      }
+
+      bits.alignToByte();
+      bits.writeBits(flacCrc16(bits.bytes.data(), bits.bytes.size()), 16);
+
+      out.write(reinterpret_cast<const char *>(bits.bytes.data()),
+                bits.bytes.size());
+
+      uint32_t frameSize = static_cast<uint32_t>(bits.bytes.size());
+      minFrameSize = std::min(minFrameSize, frameSize);
+      maxFrameSize = std::max(maxFrameSize, frameSize);
+      totalFrames += blockSize;
+      frameNumber++;
+    }
+
+    void encodeSubframe(const int32_t *signal, uint32_t blockSize)
+    {
+      if (std::all_of(signal, signal + blockSize,
+                      [signal](int32_t s) { return s == signal[0]; }))
+      {
+        // CONSTANT subframe
+        bits.writeBits(0, 8);
+        bits.writeSigned(signal[0], 16);
+        return;
+      }
+
+      // Pick the fixed predictor with the smallest residual
+      uint32_t maxOrder = std::min(FLAC_MAX_FIXED_ORDER, blockSize - 1);
+      uint32_t bestOrder = 0;
+      uint64_t bestSum = std::numeric_limits<uint64_t>::max();
+      for (uint32_t order = 0; order <= maxOrder; order++)
+      {
+        uint64_t sum = 0;
+        for (uint32_t i = order; i < blockSize; i++)
+        {
+          sum += zigzag(fixedResidual(signal, i, order));
+        }
+
+        if (sum < bestSum)
+        {
+          bestSum = sum;
+          bestOrder = order;
+        }
+      }
+
+      // FIXED subframe header and warm-up samples
+      bits.writeBits(0, 1);
+      bits.writeBits(0x08 | bestOrder, 6);
+      bits.writeBits(0, 1);
+      for (uint32_t i = 0; i < bestOrder; i++)
+      {
+        bits.writeSigned(signal[i], 16);
+      }
+
+      // Rice parameter from mean residual magnitude
+      uint64_t numResiduals = blockSize - bestOrder;
+      uint32_t riceParameter = 0;
+      while ((riceParameter < FLAC_MAX_RICE_PARAMETER) &&
+             ((numResiduals << (riceParameter + 1)) < bestSum))
+      {
+        riceParameter++;
+      }
+
+      // Rice coding with 4-bit parameter, single partition
+      bits.writeBits(0, 2);
+      bits.writeBits(0, 4);
+      bits.writeBits(riceParameter, 4);
+      for (uint32_t i = bestOrder; i < blockSize; i++)
+      {
+        uint32_t value = zigzag(fixedResidual(signal, i, bestOrder));
+        bits.writeUnary(value >> riceParameter);
+        bits.writeBits(value, riceParameter);
+      }
+    }
+  };
+
+  // ----------------------------------------------------------------------------
+  // Ogg/Opus (RFC 7845)
+  // ----------------------------------------------------------------------------
+
+  // Opus granule positions always count samples at 48 kHz
+  const uint32_t OPUS_GRANULE_RATE = 48000;
+
+  // Duration of each Opus packet
+  const uint32_t OPUS_FRAME_MS = 20;
+
+  // Recommended upper bound for a single Opus packet
+  const int OPUS_MAX_PACKET_SIZE = 4000;
+
+  // Typical encoded size of speech per channel (about 48 kbps), and of the
+  // identification and comment header pages
+  const std::size_t OPUS_ESTIMATED_BYTES_PER_SECOND = 6000;
+  const std::size_t OPUS_HEADERS_SIZE = 128;
+
+  // Append a little-endian integer
+  void appendLittleEndian(std::vector<uint8_t> &bytes, uint32_t value,
+                          int numBytes)
+  {
+    for (int i = 0; i < numBytes; i++)
+    {
+      bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+
+  // Opus at the lowest supported rate that does not lose bandwidth. Voices
+  // whose rate Opus does not support (e.g., 22050 Hz) are linearly resampled
+  // up to the next one.
+  class OggOpusEncoder : public AudioEncoder
+  {
+  public:
+    ~OggOpusEncoder() override { release(); }
+
+    std::string contentType() const override
+    {
+      return "audio/ogg; codecs=opus";
+    }
+
+    std::string fileExtension() const override { return "opus"; }
+
+    std::size_t estimateSize(std::size_t numSamples, int sampleRate,
+                             int) const override
+    {
+      return OPUS_HEADERS_SIZE +
+             (numSamples * OPUS_ESTIMATED_BYTES_PER_SECOND) / sampleRate;
+    }
+
+    void begin(int sampleRate, int channels, std::ostream &out) override
+    {
+      if ((channels < 1) || (channels > 2))
+      {
+        throw std::runtime_error("Opus output supports mono or stereo only");
+      }
+
+      release();
+
+      this->inputRate = static_cast<uint32_t>(sampleRate);
+      this->channels = channels;
+
+      encoderRate = OPUS_GRANULE_RATE;
+      for (uint32_t opusRate : {8000, 12000, 16000, 24000})
+      {
+        if (inputRate <= opusRate)
+        {
+          encoderRate = opusRate;
+          break;
+        }
+      }
+
+      int error = OPUS_OK;
+      encoder = opus_encoder_create(encoderRate, channels,
+                                    OPUS_APPLICATION_AUDIO, &error);
+      if (error != OPUS_OK)
+      {
+        encoder = nullptr;
+        throw std::runtime_error(std::string("Failed to create Opus encoder: ") +
+                                 opus_strerror(error));
+      }
+
+      opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+
+      opus_int32 lookahead = 0;
+      opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+      granuleScale = OPUS_GRANULE_RATE / encoderRate;
+      preSkip = static_cast<uint32_t>(lookahead) * granuleScale;
+      frameSize = (encoderRate * OPUS_FRAME_MS) / 1000;
+
+      std::random_device randomDevice;
+      ogg_stream_init(&stream, static_cast<int>(randomDevice()));
+      streamOpen = true;
+
+      inputFrames = 0;
+      outputFrames = 0;
+      encodedFrames = 0;
+      packetNumber = 0;
+      previousFrame.assign(channels, 0);
+      pending.clear();
+      packet.resize(OPUS_MAX_PACKET_SIZE);
+
+      // Identification header, alone on the first page
+      std::vector<uint8_t> header = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd'};
+      header.push_back(1); // version
+      header.push_back(static_cast<uint8_t>(channels));
+      appendLittleEndian(header, preSkip, 2);
+      appendLittleEndian(header, inputRate, 4);
+      appendLittleEndian(header, 0, 2); // output gain
+      header.push_back(0);              // mono/stereo channel mapping
+      writePacket(header.data(), header.size(), 0, false);
+      flushPages(out);
+
+      // Comment header, ends on its own page
+      std::vector<uint8_t> tags = {'O', 'p', 'u', 's', 'T', 'a', 'g', 's'};
+      std::string vendor = opus_get_version_string();
+      appendLittleEndian(tags, static_cast<uint32_t>(vendor.size()), 4);
+      tags.insert(tags.end(), vendor.begin(), vendor.end());
+      appendLittleEndian(tags, 0, 4); // no user comments
+      writePacket(tags.data(), tags.size(), 0, false);
+      flushPages(out);
+    }
+
+    void encode(const int16_t *samples, std::size_t numSamples,
+                std::ostream &out) override
+    {
+      std::size_t numFrames = numSamples / channels;
+      if (encoderRate == inputRate)
+      {
+        pending.insert(pending.end(), samples, samples + numSamples);
+        outputFrames += numFrames;
+      }
+      else
+      {
+        resample(samples, numFrames);
+      }
+
+      inputFrames += numFrames;
+
+      const std::size_t packetSamples = frameSize * channels;
+      std::size_t offset = 0;
+      while ((pending.size() - offset) >= packetSamples)
+      {
+        encodePacket(pending.data() + offset, false, out);
+        offset += packetSamples;
+      }
+
+      pending.erase(pending.begin(), pending.begin() + offset);
+
+      // Flush so streamed sentences are not held back in a partial page
+      flushPages(out);
+    }
+
+    void end(std::ostream &out) override
+    {
+      // Keep encoding silence until the lookahead has pushed every real
+      // sample out of the encoder, then trim the padding with the final
+      // granule position.
+      const std::size_t packetSamples = frameSize * channels;
+      const uint64_t endGranule = preSkip + (outputFrames * granuleScale);
+      do
+      {
+        pending.resize(packetSamples, 0);
+        bool lastPacket =
+            ((encodedFrames + frameSize) * granuleScale) >= endGranule;
+        encodePacket(pending.data(), lastPacket, out, endGranule);
+        pending.clear();
+      } while ((encodedFrames * granuleScale) < endGranule);
+
+      flushPages(out);
+      release();
+    }
+
+  private:
+    OpusEncoder *encoder = nullptr;
+    ogg_stream_state stream;
+    bool streamOpen = false;
+    uint32_t inputRate = 22050;
+    uint32_t encoderRate = OPUS_GRANULE_RATE;
+    uint32_t granuleScale = 1;
+    uint32_t preSkip = 0;
+    uint32_t frameSize = 960;
+    int channels = 1;
+
+    // Frames received, frames after resampling, and frames given to Opus
+    uint64_t inputFrames = 0;
+    uint64_t outputFrames = 0;
+    uint64_t encodedFrames = 0;
+
+    int64_t packetNumber = 0;
+    std::vector<int16_t> previousFrame;
+    std::vector<int16_t> pending;
+    std::vector<uint8_t> packet;
+
+    // Linear interpolation, continuous across calls. Output frame k lies at
+    // input position k * inputRate / encoderRate; the last frame of the
+    // previous call stands in for input position inputFrames - 1.
+    void resample(const int16_t *samples, std::size_t numFrames)
+    {
+      if (numFrames == 0)
+      {
+        return;
+      }
+
+      auto inputSample = [&](uint64_t frame, int channel) -> int32_t
+      {
+        if (frame < inputFrames)
+        {
+          return previousFrame[channel];
+        }
+
+        return samples[((frame - inputFrames) * channels) + channel];
+      };
+
+      const uint64_t endFrame = inputFrames + numFrames;
+      while (true)
+      {
+        uint64_t position = outputFrames * inputRate;
+        uint64_t index = position / encoderRate;
+        if ((index + 1) >= endFrame)
+        {
+          break;
+        }
+
+        int32_t fraction = static_cast<int32_t>(position % encoderRate);
+        for (int channel = 0; channel < channels; channel++)
+        {
+          int32_t first = inputSample(index, channel);
+          int32_t second = inputSample(index + 1, channel);
+          pending.push_back(static_cast<int16_t>(
+              first + (((second - first) * static_cast<int64_t>(fraction)) /
+                       static_cast<int32_t>(encoderRate))));
+        }
+
+        outputFrames++;
+      }
+
+      std::copy(samples + ((numFrames - 1) * channels),
+                samples + (numFrames * channels), previousFrame.begin());
+    }
+
+    void encodePacket(const int16_t *pcm, bool lastPacket, std::ostream &out,
+                      uint64_t endGranule = 0)
+    {
+      opus_int32 numBytes =
+          opus_encode(encoder, pcm, static_cast<int>(frameSize), packet.data(),
+                      static_cast<opus_int32>(packet.size()));
+      if (numBytes < 0)
+      {
+        throw std::runtime_error(std::string("Opus encoding failed: ") +
+                                 opus_strerror(numBytes));
+      }
+
+      encodedFrames += frameSize;
+      uint64_t granule = lastPacket ? endGranule : encodedFrames * granuleScale;
+      writePacket(packet.data(), static_cast<std::size_t>(numBytes), granule,
+                  lastPacket);
+
+      ogg_page page;
+      while (ogg_stream_pageout(&stream, &page) != 0)
+      {
+        writePage(page, out);
+      }
+    }
+
+    void writePacket(uint8_t *data, std::size_t numBytes, uint64_t granule,
+                     bool lastPacket)
+    {
+      ogg_packet oggPacket;
+      oggPacket.packet = data;
+      oggPacket.bytes = static_cast<long>(numBytes);
+      oggPacket.b_o_s = (packetNumber == 0) ? 1 : 0;
+      oggPacket.e_o_s = lastPacket ? 1 : 0;
+      oggPacket.granulepos = static_cast<ogg_int64_t>(granule);
+      oggPacket.packetno = packetNumber++;
+      ogg_stream_packetin(&stream, &oggPacket);
+    }
+
+    void flushPages(std::ostream &out)
+    {
+      ogg_page page;
+      while (ogg_stream_flush(&stream, &page) != 0)
+      {
+        writePage(page, out);
+      }
+    }
+
+    void writePage(const ogg_page &page, std::ostream &out)
+    {
+      out.write(reinterpret_cast<const char *>(page.header), page.header_len);
+      out.write(reinterpret_cast<const char *>(page.body), page.body_len);
+    }
+
+    void release()
+    {
+      if (encoder)
+      {
+        opus_encoder_destroy(encoder);
+        encoder = nullptr;
+      }
+
+      if (streamOpen)
+      {
+        ogg_stream_clear(&stream);
+        streamOpen = false;
+      }
+    }
+  };
+
+  // ----------------------------------------------------------------------------
+
+  OutputFormat parseOutputFormat(const std::string &formatName)
+  {
+    if (formatName == "wav")
+    {
+      return OUTPUT_FORMAT_WAV;
+    }
+
+    if (formatName == "flac")
+    {
+      return OUTPUT_FORMAT_FLAC;
+    }
+
+    if ((formatName == "mulaw") || (formatName == "ulaw"))
+    {
+      return OUTPUT_FORMAT_MULAW;
+    }
+
+    if (formatName == "alaw")
+    {
+      return OUTPUT_FORMAT_ALAW;
+    }
+
+    if ((formatName == "opus") || (formatName == "ogg"))
+    {
+      return OUTPUT_FORMAT_OPUS;
+    }
+
+    throw std::runtime_error("Unsupported output format: " + formatName);
+  }
+
+  std::unique_ptr<AudioEncoder> createEncoder(OutputFormat format)
+  {
+    switch (format)
+    {
+    case OUTPUT_FORMAT_FLAC:
+      return std::make_unique<FlacEncoder>();
+    case OUTPUT_FORMAT_MULAW:
+      return std::make_unique<WavEncoder>(WAVE_FORMAT_MULAW);
+    case OUTPUT_FORMAT_ALAW:
+      return std::make_unique<WavEncoder>(WAVE_FORMAT_ALAW);
+    case OUTPUT_FORMAT_OPUS:
+      return std::make_unique<OggOpusEncoder>();
+    default:
+      return std::make_unique<WavEncoder>(WAVE_FORMAT_PCM);
+    }
+  }
+
+} // namespace piper
@@ -0,0 +1,55 @@
+#ifndef ENCODER_H_
+#define ENCODER_H_
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+namespace piper {
+
+enum OutputFormat {
+  OUTPUT_FORMAT_WAV,   // 16-bit PCM WAV
+  OUTPUT_FORMAT_FLAC,  // FLAC (lossless)
+  OUTPUT_FORMAT_MULAW, // 8-bit G.711 mu-law WAV
+  OUTPUT_FORMAT_ALAW,  // 8-bit G.711 A-law WAV
+  OUTPUT_FORMAT_OPUS   // Opus in Ogg (lossy)
+};
+
+// Encodes 16-bit interleaved samples incrementally.
+// Samples may be passed in chunks of any size (e.g., one sentence at a time).
+class AudioEncoder {
+public:
+  virtual ~AudioEncoder() = default;
+
+  // MIME type of the encoded audio
+  virtual std::string contentType() const = 0;
+
+  // File extension of the encoded audio (without dot)
+  virtual std::string fileExtension() const = 0;
+
+  // Rough size in bytes of the encoded stream for a number of samples (all
+  // channels), used to pre-size output buffers
+  virtual std::size_t estimateSize(std::size_t numSamples, int sampleRate,
+                                   int channels) const = 0;
+
+  // Write stream header
+  virtual void begin(int sampleRate, int channels, std::ostream &out) = 0;
+
+  // Encode interleaved samples (numSamples includes all channels)
+  virtual void encode(const int16_t *samples, std::size_t numSamples,
+                      std::ostream &out) = 0;
+
+  // Flush remaining audio and patch header if the stream is seekable
+  virtual void end(std::ostream &out) = 0;
+};
+
+// Parse format name (wav, flac, mulaw, alaw, opus)
+OutputFormat parseOutputFormat(const std::string &formatName);
+
+// Create encoder for an output format
+std::unique_ptr<AudioEncoder> createEncoder(OutputFormat format);
+
+} // namespace piper
+
+#endif // ENCODER_H_
@@ -10,6 +10,11 @@
 
 #define CPPHTTPLIB_VERSION "0.18.3"
 
+// Piper local delta (not part of upstream 0.18.3): Request::is_connection_closed
+// is backported from newer upstream cpp-httplib, which sets it the same way in
+// Server::process_request. Both places are marked "Piper local delta". Drop
+// this patch when updating to an upstream release that has it.
+
 /*
  * Configuration
  */
@@ -628,6 +633,8 @@ struct Request {
   Ranges ranges;
   Match matches;
   std::unordered_map<std::string, std::string> path_params;
+  // Piper local delta: backported from newer cpp-httplib
+  std::function<bool()> is_connection_closed = []() { return true; };
 
   // for client
   ResponseHandler response_handler;
@@ -7103,6 +7110,11 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
   req.set_header("LOCAL_ADDR", req.local_addr);
   req.set_header("LOCAL_PORT", std::to_string(req.local_port));
 
+  // Piper local delta: backported from newer cpp-httplib
+  req.is_connection_closed = [&]() {
+    return !detail::is_socket_alive(strm.socket());
+  };
+
   if (req.has_header("Range")) {
     const auto &range_header_value = req.get_header_value("Range");
     if (!detail::parse_range_header(range_header_value, req.ranges)) {
@@ -0,0 +1,582 @@
+// HTTP load generator for piper_server.
+// Sends /tts requests with a mix of voices and test sentences and reports
+// throughput, time to first byte, total latency and error rate as JSON.
+//
+// piper_loadgen --voice voice.onnx --concurrency 4 --requests 200 > load.json
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "httplib.h"
+#include "json.hpp"
+
+using namespace std;
+using json = nlohmann::json;
+using Clock = chrono::steady_clock;
+
+struct VoiceWeight {
+  string modelPath;
+  double weight = 1.0;
+};
+
+struct LoadConfig {
+  string host = "localhost";
+  int port = 8080;
+
+  // Voices to request, picked at random by weight
+  vector<VoiceWeight> voices;
+
+  // Directory with <lang>.txt and test_<lang>.jsonl files
+  filesystem::path sentencesDir = "etc/test_sentences";
+
+  // Language of sentences taken from sentencesDir
+  string language = "en";
+
+  // Explicit sentence files (overrides sentencesDir)
+  vector<filesystem::path> sentenceFiles;
+
+  // Number of sentences joined into one request is uniform in [1, max]
+  int maxSentences = 1;
+
+  // Number of connections sending requests
+  int concurrency = 1;
+
+  // Requests/second for open-loop arrivals (Poisson).
+  // Closed loop (send as soon as a response arrives) if not set.
+  optional<double> rate;
+
+  // Stop after this many requests, or after duration seconds
+  int requests = 100;
+  optional<double> durationSeconds;
+
+  // Untimed requests per voice (first request loads the model)
+  int warmup = 1;
+
+  // Ask server to stream audio as it is synthesized
+  bool stream = false;
+
+  unsigned int seed = 1234;
+};
+
+struct RequestSample {
+  double ttfbSeconds = 0;
+  double totalSeconds = 0;
+  double audioSeconds = 0;
+  bool ok = false;
+
+  // From the server's Server-Timing header (or trailer when streaming)
+  optional<double> serverSeconds;
+  optional<double> serverQueueSeconds;
+};
+
+// One request to send.
+// Open loop requests carry their scheduled time so queueing is included in
+// latency (avoids coordinated omission).
+struct RequestJob {
+  string body;
+  Clock::time_point scheduledTime;
+};
+
+// ----------------------------------------------------------------------------
+
+// Lines of text (.txt) or "text" fields (.jsonl)
+static vector<string> loadSentences(const vector<filesystem::path> &files) {
+  vector<string> sentences;
+  for (auto &path : files) {
+    ifstream file(path);
+    string line;
+    bool isJson = (path.extension() == ".jsonl");
+    while (getline(file, line)) {
+      if (line.empty()) {
+        continue;
+      }
+
+      if (isJson) {
+        auto lineJson = json::parse(line);
+        if (lineJson.contains("text")) {
+          sentences.push_back(lineJson["text"].get<string>());
+        }
+      } else {
+        sentences.push_back(line);
+      }
+    }
+  }
+
+  return sentences;
+}
+
+// Sentence files for a language, e.g. en -> en.txt, test_en-us.jsonl
+static vector<filesystem::path> findSentenceFiles(const filesystem::path &dir,
+                                                  const string &language) {
+  vector<filesystem::path> files;
+  if (!filesystem::is_directory(dir)) {
+    return files;
+  }
+
+  auto matches = [&language](const string &name) {
+    return (name == language) || (name.rfind(language + "-", 0) == 0) ||
+           (name.rfind(language + "_", 0) == 0);
+  };
+
+  for (auto &entry : filesystem::directory_iterator(dir)) {
+    auto extension = entry.path().extension();
+    auto stem = entry.path().stem().string();
+    if (stem.rfind("test_", 0) == 0) {
+      stem = stem.substr(5);
+    }
+
+    if (((extension == ".txt") || (extension == ".jsonl")) && matches(stem)) {
+      files.push_back(entry.path());
+    }
+  }
+
+  sort(files.begin(), files.end());
+  return files;
+}
+
+// Seconds of audio in a 16-bit WAV response of a given total size
+static double getWavSeconds(const string &header, size_t totalBytes) {
+  if ((header.size() < 44) || (header.compare(0, 4, "RIFF") != 0)) {
+    return 0;
+  }
+
+  uint16_t channels = 0;
+  uint32_t sampleRate = 0;
+  memcpy(&channels, header.data() + 22, sizeof(channels));
+  memcpy(&sampleRate, header.data() + 24, sizeof(sampleRate));
+  if ((channels == 0) || (sampleRate == 0)) {
+    return 0;
+  }
+
+  return (double)(totalBytes - 44) / (2.0 * channels * sampleRate);
+}
+
+// Duration in seconds of a metric in a Server-Timing value, e.g.
+// "queue;dur=0.100, infer;dur=250.000"
+static optional<double> getServerTimingSeconds(const string &serverTiming,
+                                               const string &name) {
+  auto nameIndex = serverTiming.find(name + ";dur=");
+  if ((nameIndex == string::npos) ||
+      ((nameIndex > 0) && (serverTiming[nameIndex - 1] != ' ') &&
+       (serverTiming[nameIndex - 1] != ','))) {
+    return nullopt;
+  }
+
+  return stod(serverTiming.substr(nameIndex + name.size() + 5)) / 1000.0;
+}
+
+static double percentile(const vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+
+  size_t rank = (size_t)((p / 100.0) * (double)sorted.size());
+  return sorted[min(rank, sorted.size() - 1)];
+}
+
+static json summarize(vector<double> values) {
+  sort(values.begin(), values.end());
+  double sum = 0;
+  for (auto value : values) {
+    sum += value;
+  }
+
+  return json{{"count", values.size()},
+              {"mean", values.empty() ? 0 : sum / values.size()},
+              {"p50", percentile(values, 50)},
+              {"p95", percentile(values, 95)},
+              {"p99", percentile(values, 99)},
+              {"max", values.empty() ? 0 : values.back()}};
+}
+
+// Send one /tts request and time it
+static RequestSample sendRequest(httplib::Client &client, const RequestJob &job) {
+  RequestSample sample;
+  optional<Clock::time_point> firstByteTime;
+  string header;
+  size_t totalBytes = 0;
+
+  httplib::Request req;
+  req.method = "POST";
+  req.path = "/tts";
+  req.body = job.body;
+  req.set_header("Content-Type", "application/json");
+  req.content_receiver = [&](const char *data, size_t length, uint64_t,
+                             uint64_t) {
+    if (!firstByteTime) {
+      firstByteTime = Clock::now();
+    }
+
+    if (header.size() < 44) {
+      header.append(data, min(length, 44 - header.size()));
+    }
+
+    totalBytes += length;
+    return true;
+  };
+
+  auto result = client.send(req);
+  auto endTime = Clock::now();
+
+  sample.totalSeconds =
+      chrono::duration<double>(endTime - job.scheduledTime).count();
+  sample.ttfbSeconds =
+      chrono::duration<double>(firstByteTime.value_or(endTime) -
+                               job.scheduledTime)
+          .count();
+  sample.ok = result && (result->status == 200);
+  if (sample.ok) {
+    sample.audioSeconds = getWavSeconds(header, totalBytes);
+
+    auto serverTiming = result->get_header_value("Server-Timing");
+    sample.serverSeconds = getServerTimingSeconds(serverTiming, "total");
+    sample.serverQueueSeconds = getServerTimingSeconds(serverTiming, "queue");
+  }
+
+  return sample;
+}
+
+void parseArgs(int argc, char *argv[], LoadConfig &loadConfig);
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  LoadConfig loadConfig;
+  parseArgs(argc, argv, loadConfig);
+
+  auto sentenceFiles = loadConfig.sentenceFiles;
+  if (sentenceFiles.empty()) {
+    sentenceFiles =
+        findSentenceFiles(loadConfig.sentencesDir, loadConfig.language);
+  }
+
+  auto sentences = loadSentences(sentenceFiles);
+  if (sentences.empty()) {
+    cerr << "No test sentences found" << endl;
+    return EXIT_FAILURE;
+  }
+
+  mt19937 rng(loadConfig.seed);
+  vector<double> voiceWeights;
+  for (auto &voice : loadConfig.voices) {
+    voiceWeights.push_back(voice.weight);
+  }
+
+  discrete_distribution<size_t> voiceDist(voiceWeights.begin(),
+                                          voiceWeights.end());
+  uniform_int_distribution<size_t> sentenceDist(0, sentences.size() - 1);
+  uniform_int_distribution<int> numSentencesDist(1, loadConfig.maxSentences);
+
+  auto makeBody = [&](const string &modelPath) {
+    string text;
+    int numSentences = numSentencesDist(rng);
+    for (int i = 0; i < numSentences; i++) {
+      if (!text.empty()) {
+        text += " ";
+      }
+      text += sentences[sentenceDist(rng)];
+    }
+
+    json bodyJson{{"sentence", text},
+                  {"modelPath", modelPath},
+                  {"outputType", "OUTPUT_RAW"},
+                  {"stream", loadConfig.stream}};
+    return bodyJson.dump();
+  };
+
+  // Warm up each voice (model load is not part of the measurement)
+  {
+    httplib::Client client(loadConfig.host, loadConfig.port);
+    client.set_read_timeout(600);
+    for (auto &voice : loadConfig.voices) {
+      for (int i = 0; i < loadConfig.warmup; i++) {
+        RequestJob job{makeBody(voice.modelPath), Clock::now()};
+        if (!sendRequest(client, job).ok) {
+          cerr << "Warmup request failed for " << voice.modelPath << endl;
+          return EXIT_FAILURE;
+        }
+      }
+    }
+  }
+
+  // Jobs are produced by this thread and consumed by workers
+  mutex jobsMutex;
+  condition_variable jobsCv;
+  deque<RequestJob> jobs;
+  bool producerDone = false;
+
+  mutex samplesMutex;
+  vector<RequestSample> samples;
+
+  vector<thread> workers;
+  for (int i = 0; i < loadConfig.concurrency; i++) {
+    workers.emplace_back([&]() {
+      httplib::Client client(loadConfig.host, loadConfig.port);
+      client.set_keep_alive(true);
+      client.set_read_timeout(600);
+
+      while (true) {
+        RequestJob job;
+        {
+          unique_lock lock(jobsMutex);
+          jobsCv.wait(lock, [&]() { return producerDone || !jobs.empty(); });
+          if (jobs.empty()) {
+            break;
+          }
+
+          job = std::move(jobs.front());
+          jobs.pop_front();
+        }
+        jobsCv.notify_all();
+
+        if (!loadConfig.rate) {
+          // Closed loop: latency starts when the request is sent
+          job.scheduledTime = Clock::now();
+        }
+
+        auto sample = sendRequest(client, job);
+        lock_guard lock(samplesMutex);
+        samples.push_back(sample);
+      }
+    });
+  }
+
+  auto startTime = Clock::now();
+  auto shouldStop = [&](int numProduced) {
+    if (loadConfig.durationSeconds) {
+      return chrono::duration<double>(Clock::now() - startTime).count() >=
+             *loadConfig.durationSeconds;
+    }
+
+    return numProduced >= loadConfig.requests;
+  };
+
+  exponential_distribution<double> arrivalDist(loadConfig.rate.value_or(1.0));
+  auto nextArrival = startTime;
+  for (int numProduced = 0; !shouldStop(numProduced); numProduced++) {
+    RequestJob job;
+    job.body = makeBody(loadConfig.voices[voiceDist(rng)].modelPath);
+
+    if (loadConfig.rate) {
+      // Open loop: enqueue at Poisson arrival times regardless of responses
+      nextArrival += chrono::duration_cast<Clock::duration>(
+          chrono::duration<double>(arrivalDist(rng)));
+      this_thread::sleep_until(nextArrival);
+      job.scheduledTime = nextArrival;
+    } else {
+      // Closed loop: keep one request ready per worker
+      unique_lock lock(jobsMutex);
+      jobsCv.wait(lock, [&]() {
+        return jobs.size() < (size_t)loadConfig.concurrency;
+      });
+    }
+
+    {
+      lock_guard lock(jobsMutex);
+      jobs.push_back(std::move(job));
+    }
+    jobsCv.notify_all();
+  }
+
+  {
+    lock_guard lock(jobsMutex);
+    producerDone = true;
+  }
+  jobsCv.notify_all();
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  double wallSeconds = chrono::duration<double>(Clock::now() - startTime).count();
+
+  vector<double> ttfbs;
+  vector<double> latencies;
+  vector<double> rtfs;
+  vector<double> serverRtfs;
+  vector<double> serverQueueSeconds;
+  size_t numErrors = 0;
+  double totalAudioSeconds = 0;
+  for (auto &sample : samples) {
+    if (!sample.ok) {
+      numErrors++;
+      continue;
+    }
+
+    ttfbs.push_back(sample.ttfbSeconds);
+    latencies.push_back(sample.totalSeconds);
+    totalAudioSeconds += sample.audioSeconds;
+    if (sample.audioSeconds > 0) {
+      rtfs.push_back(sample.totalSeconds / sample.audioSeconds);
+      if (sample.serverSeconds) {
+        serverRtfs.push_back(*sample.serverSeconds / sample.audioSeconds);
+      }
+    }
+
+    if (sample.serverQueueSeconds) {
+      serverQueueSeconds.push_back(*sample.serverQueueSeconds);
+    }
+  }
+
+  json resultJson{
+      {"requests", samples.size()},
+      {"errors", numErrors},
+      {"error_rate",
+       samples.empty() ? 0 : (double)numErrors / (double)samples.size()},
+      {"wall_seconds", wallSeconds},
+      {"requests_per_second",
+       wallSeconds > 0 ? (samples.size() - numErrors) / wallSeconds : 0},
+      {"audio_seconds_per_second",
+       wallSeconds > 0 ? totalAudioSeconds / wallSeconds : 0},
+      {"concurrency", loadConfig.concurrency},
+      {"mode", loadConfig.rate ? "open" : "closed"},
+      {"ttfb_seconds", summarize(ttfbs)},
+      {"latency_seconds", summarize(latencies)},
+      {"rtf", summarize(rtfs)},
+      {"server_rtf", summarize(serverRtfs)},
+      {"server_queue_seconds", summarize(serverQueueSeconds)},
+  };
+
+  if (loadConfig.rate) {
+    resultJson["rate"] = *loadConfig.rate;
+  }
+
+  cout << resultJson.dump(2) << endl;
+
+  return EXIT_SUCCESS;
+}
+
+// ----------------------------------------------------------------------------
+
+void printUsage(char *argv[]) {
+  cerr << endl;
+  cerr << "usage: " << argv[0] << " [options]" << endl;
+  cerr << endl;
+  cerr << "options:" << endl;
+  cerr << "   -h        --help              show this message and exit" << endl;
+  cerr << "   --host                  HOST  server host (default: localhost)"
+       << endl;
+  cerr << "   -p  PORT  --port        PORT  server port (default: 8080)" << endl;
+  cerr << "   --voice           FILE[=NUM]  model path on the server with "
+          "optional weight (may be repeated)"
+       << endl;
+  cerr << "   --sentences_dir         DIR   directory with test sentences "
+          "(default: etc/test_sentences)"
+       << endl;
+  cerr << "   --language              LANG  language of test sentences "
+          "(default: en)"
+       << endl;
+  cerr << "   --sentences             FILE  .txt or .jsonl sentence file "
+          "(may be repeated)"
+       << endl;
+  cerr << "   --max_sentences         NUM   join 1 to NUM random sentences per "
+          "request (default: 1)"
+       << endl;
+  cerr << "   --concurrency           NUM   number of connections (default: 1)"
+       << endl;
+  cerr << "   --rate                  NUM   open-loop arrival rate in "
+          "requests/second (default: closed loop)"
+       << endl;
+  cerr << "   --requests              NUM   number of requests (default: 100)"
+       << endl;
+  cerr << "   --duration              SEC   run for a number of seconds "
+          "instead"
+       << endl;
+  cerr << "   --warmup                NUM   untimed requests per voice "
+          "(default: 1)"
+       << endl;
+  cerr << "   --stream                      request chunked audio streaming"
+       << endl;
+  cerr << "   --seed                  NUM   random seed (default: 1234)" << endl;
+  cerr << endl;
+}
+
+void ensureArg(int argc, char *argv[], int argi) {
+  if ((argi + 1) >= argc) {
+    printUsage(argv);
+    exit(0);
+  }
+}
+
+void parseArgs(int argc, char *argv[], LoadConfig &loadConfig) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "--host") {
+      ensureArg(argc, argv, i);
+      loadConfig.host = argv[++i];
+    } else if (arg == "-p" || arg == "--port") {
+      ensureArg(argc, argv, i);
+      loadConfig.port = stoi(argv[++i]);
+    } else if (arg == "--voice" || arg == "-m" || arg == "--model") {
+      ensureArg(argc, argv, i);
+      std::string voiceArg = argv[++i];
+      VoiceWeight voice;
+      auto equalsIndex = voiceArg.rfind('=');
+      if (equalsIndex != std::string::npos) {
+        voice.modelPath = voiceArg.substr(0, equalsIndex);
+        voice.weight = stod(voiceArg.substr(equalsIndex + 1));
+      } else {
+        voice.modelPath = voiceArg;
+      }
+      loadConfig.voices.push_back(voice);
+    } else if (arg == "--sentences_dir" || arg == "--sentences-dir") {
+      ensureArg(argc, argv, i);
+      loadConfig.sentencesDir = filesystem::path(argv[++i]);
+    } else if (arg == "--language") {
+      ensureArg(argc, argv, i);
+      loadConfig.language = argv[++i];
+    } else if (arg == "--sentences") {
+      ensureArg(argc, argv, i);
+      loadConfig.sentenceFiles.push_back(filesystem::path(argv[++i]));
+    } else if (arg == "--max_sentences" || arg == "--max-sentences") {
+      ensureArg(argc, argv, i);
+      loadConfig.maxSentences = max(1, stoi(argv[++i]));
+    } else if (arg == "--concurrency") {
+      ensureArg(argc, argv, i);
+      loadConfig.concurrency = max(1, stoi(argv[++i]));
+    } else if (arg == "--rate") {
+      ensureArg(argc, argv, i);
+      loadConfig.rate = stod(argv[++i]);
+    } else if (arg == "--requests") {
+      ensureArg(argc, argv, i);
+      loadConfig.requests = stoi(argv[++i]);
+    } else if (arg == "--duration") {
+      ensureArg(argc, argv, i);
+      loadConfig.durationSeconds = stod(argv[++i]);
+    } else if (arg == "--warmup") {
+      ensureArg(argc, argv, i);
+      loadConfig.warmup = stoi(argv[++i]);
+    } else if (arg == "--stream") {
+      loadConfig.stream = true;
+    } else if (arg == "--seed") {
+      ensureArg(argc, argv, i);
+      loadConfig.seed = (unsigned int)stoul(argv[++i]);
+    } else if (arg == "-h" || arg == "--help") {
+      printUsage(argv);
+      exit(0);
+    }
+  }
+
+  if (loadConfig.voices.empty()) {
+    printUsage(argv);
+    exit(1);
+  }
+
+  if (loadConfig.rate && (*loadConfig.rate <= 0)) {
+    throw invalid_argument("Rate must be positive");
+  }
+}
@@ -1,5 +1,7 @@
+#include <cerrno>
 #include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <functional>
@@ -21,6 +23,8 @@
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <unistd.h>
 #endif
 
 #ifdef __APPLE__
@@ -38,6 +42,23 @@ using json = nlohmann::json;
 
 enum OutputType { OUTPUT_FILE, OUTPUT_DIRECTORY, OUTPUT_STDOUT, OUTPUT_RAW };
 
+// How requests are read from stdin and results written to stdout
+enum Protocol { PROTOCOL_TEXT, PROTOCOL_BINARY };
+
+// Frame types of the binary protocol
+enum FrameType : uint8_t {
+  FRAME_REQUEST = 1, // JSON settings (stdin)
+  FRAME_AUDIO = 2,   // 16-bit PCM for one sentence (stdout)
+  FRAME_DONE = 3,    // JSON timings, ends a request (stdout)
+  FRAME_ERROR = 4    // UTF-8 error message, ends a request (stdout)
+};
+
+// Size of frame header after the length field (type + request id)
+const uint32_t FRAME_HEADER_SIZE = 5;
+
+// Largest frame accepted on stdin
+const uint32_t MAX_REQUEST_FRAME_SIZE = 64 * 1024 * 1024;
+
 struct RunConfig {
   // Path to .onnx voice file
   filesystem::path modelPath;
@@ -88,9 +109,16 @@ struct RunConfig {
 
   // true to use CUDA execution provider
   bool useCuda = false;
+
+  // false to always load the fp32 model, even if a quantized variant exists
+  bool useQuantizedModel = true;
+
+  // Line-based text/JSON (default) or length-prefixed binary frames
+  Protocol protocol = PROTOCOL_TEXT;
 };
 
 void parseArgs(int argc, char *argv[], RunConfig &runConfig);
+void runBinaryProtocol(piper::PiperConfig &piperConfig, piper::Voice &voice);
 void rawOutputProc(vector<int16_t> &sharedAudioBuffer, mutex &mutAudio,
                    condition_variable &cvAudio, bool &audioReady,
                    bool &audioFinished);
@@ -111,6 +139,8 @@ int main(int argc, char *argv[]) {
   piper::PiperConfig piperConfig;
   piper::Voice voice;
 
+  piperConfig.useQuantizedModel = runConfig.useQuantizedModel;
+
   spdlog::debug("Loading voice from {} (config={})",
                 runConfig.modelPath.string(),
                 runConfig.modelConfigPath.string());
@@ -228,6 +258,12 @@ int main(int argc, char *argv[]) {
     spdlog::info("Output directory: {}", runConfig.outputPath.value().string());
   }
 
+  if (runConfig.protocol == PROTOCOL_BINARY) {
+    runBinaryProtocol(piperConfig, voice);
+    piper::terminate(piperConfig);
+    return EXIT_SUCCESS;
+  }
+
   string line;
   piper::SynthesisResult result;
   while (getline(cin, line)) {
@@ -332,8 +368,15 @@ int main(int argc, char *argv[]) {
         // Signal thread that audio is ready
         {
           unique_lock lockAudio(mutAudio);
-          copy(audioBuffer.begin(), audioBuffer.end(),
-               back_inserter(sharedAudioBuffer));
+          if (sharedAudioBuffer.empty()) {
+            // Hand buffer over without copying.
+            // textToAudio clears the (now empty) buffer we get back.
+            swap(audioBuffer, sharedAudioBuffer);
+          } else {
+            // Output thread hasn't picked up the previous sentence yet
+            sharedAudioBuffer.insert(sharedAudioBuffer.end(),
+                                     audioBuffer.begin(), audioBuffer.end());
+          }
           audioReady = true;
           cvAudio.notify_one();
         }
@@ -370,10 +413,217 @@ int main(int argc, char *argv[]) {
 
 // ----------------------------------------------------------------------------
 
+// Write all bytes to standard output, bypassing iostreams
+bool writeStdout(const char *data, size_t size) {
+  while (size > 0) {
+#ifdef _WIN32
+    int written = _write(1, data, static_cast<unsigned int>(size));
+#else
+    ssize_t written = write(STDOUT_FILENO, data, size);
+#endif
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return false;
+    }
+
+    data += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+// Read exactly size bytes from standard input, bypassing iostreams.
+// Returns false at end of input.
+bool readStdin(char *data, size_t size) {
+  while (size > 0) {
+#ifdef _WIN32
+    int numRead = _read(0, data, static_cast<unsigned int>(size));
+#else
+    ssize_t numRead = read(STDIN_FILENO, data, size);
+#endif
+    if (numRead < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return false;
+    }
+
+    if (numRead == 0) {
+      return false;
+    }
+
+    data += numRead;
+    size -= numRead;
+  }
+
+  return true;
+}
+
+// Unsigned 32-bit little-endian integer
+uint32_t readUInt32(const char *data) {
+  auto bytes = (const uint8_t *)data;
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+         ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+void writeUInt32(char *data, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    data[i] = (char)((value >> (8 * i)) & 0xFF);
+  }
+}
+
+// Write a frame to standard output:
+// length (uint32), type (uint8), request id (uint32), payload
+bool writeFrame(FrameType type, uint32_t requestId, const char *payload,
+                size_t payloadSize) {
+  char header[4 + FRAME_HEADER_SIZE];
+  writeUInt32(header, (uint32_t)(FRAME_HEADER_SIZE + payloadSize));
+  header[4] = (char)type;
+  writeUInt32(header + 5, requestId);
+
+  return writeStdout(header, sizeof(header)) &&
+         writeStdout(payload, payloadSize);
+}
+
+// Handle requests as length-prefixed frames until stdin is closed.
+//
+// Every frame is: length (uint32, bytes after this field), type (uint8),
+// request id (uint32), payload. Integers are little-endian.
+//
+// A request frame carries the same JSON object as --json-input (text,
+// speaker_id, speaker) plus optional noise_scale, length_scale and noise_w.
+// Requests are handled in order, so many can be written without waiting.
+// Each one is answered with an audio frame per sentence (16-bit PCM,
+// little-endian) followed by a done frame with JSON timings, or an error frame.
+// An unknown speaker name is an error.
+void runBinaryProtocol(piper::PiperConfig &piperConfig, piper::Voice &voice) {
+#ifdef _WIN32
+  // Needed on Windows to avoid terminal conversions
+  setmode(fileno(stdout), O_BINARY);
+  setmode(fileno(stdin), O_BINARY);
+#endif
+
+  const auto defaultSynthesisConfig = voice.synthesisConfig;
+  vector<int16_t> audioBuffer;
+  std::string audioBytes;
+  std::string payload;
+  char header[4 + FRAME_HEADER_SIZE];
+
+  while (readStdin(header, sizeof(header))) {
+    uint32_t frameSize = readUInt32(header);
+    auto type = (FrameType)header[4];
+    uint32_t requestId = readUInt32(header + 5);
+
+    if ((frameSize < FRAME_HEADER_SIZE) ||
+        (frameSize > MAX_REQUEST_FRAME_SIZE)) {
+      spdlog::error("Invalid frame size: {}", frameSize);
+      return;
+    }
+
+    payload.resize(frameSize - FRAME_HEADER_SIZE);
+    if (!readStdin(payload.data(), payload.size())) {
+      spdlog::error("Incomplete frame for request {}", requestId);
+      return;
+    }
+
+    auto startTime = chrono::steady_clock::now();
+    piper::SynthesisResult result;
+    bool outputOk = true;
+    try {
+      if (type != FRAME_REQUEST) {
+        throw runtime_error("Expected a request frame, got type " +
+                            to_string((int)type));
+      }
+
+      json requestRoot = json::parse(payload);
+      std::string text = requestRoot["text"].get<std::string>();
+
+      voice.synthesisConfig = defaultSynthesisConfig;
+      if (requestRoot.contains("speaker_id")) {
+        voice.synthesisConfig.speakerId =
+            requestRoot["speaker_id"].get<piper::SpeakerId>();
+      } else if (requestRoot.contains("speaker")) {
+        // Resolve to id using speaker id map
+        auto speakerName = requestRoot["speaker"].get<std::string>();
+        if ((voice.modelConfig.speakerIdMap) &&
+            (voice.modelConfig.speakerIdMap->count(speakerName) > 0)) {
+          voice.synthesisConfig.speakerId =
+              (*voice.modelConfig.speakerIdMap)[speakerName];
+        } else {
+          throw runtime_error("No speaker named: " + speakerName);
+        }
+      }
+
+      if (requestRoot.contains("noise_scale")) {
+        voice.synthesisConfig.noiseScale =
+            requestRoot["noise_scale"].get<float>();
+      }
+      if (requestRoot.contains("length_scale")) {
+        voice.synthesisConfig.lengthScale =
+            requestRoot["length_scale"].get<float>();
+      }
+      if (requestRoot.contains("noise_w")) {
+        voice.synthesisConfig.noiseW = requestRoot["noise_w"].get<float>();
+      }
+
+      // Each sentence is sent as soon as it is synthesized
+      auto audioCallback = [&audioBuffer, &audioBytes, &outputOk,
+                            requestId]() {
+        audioBytes.resize(sizeof(int16_t) * audioBuffer.size());
+        for (size_t i = 0; i < audioBuffer.size(); i++) {
+          auto sample = (uint16_t)audioBuffer[i];
+          audioBytes[2 * i] = (char)(sample & 0xFF);
+          audioBytes[2 * i + 1] = (char)(sample >> 8);
+        }
+        outputOk = outputOk && writeFrame(FRAME_AUDIO, requestId,
+                                          audioBytes.data(), audioBytes.size());
+      };
+      piper::textToAudio(piperConfig, voice, text, audioBuffer, result,
+                         audioCallback);
+
+      json doneRoot{
+          {"sampleRate", voice.synthesisConfig.sampleRate},
+          {"channels", voice.synthesisConfig.channels},
+          {"sampleWidth", voice.synthesisConfig.sampleWidth},
+          {"audioSeconds", result.audioSeconds},
+          {"inferSeconds", result.inferSeconds},
+          {"phonemizeSeconds", result.phonemizeSeconds},
+          {"realTimeFactor", result.realTimeFactor},
+          {"numSamples", result.numSamples},
+          {"totalSeconds",
+           chrono::duration<double>(chrono::steady_clock::now() - startTime)
+               .count()}};
+      auto doneStr = doneRoot.dump();
+      outputOk = outputOk && writeFrame(FRAME_DONE, requestId, doneStr.data(),
+                                        doneStr.size());
+    } catch (const std::exception &e) {
+      spdlog::error("Request {} failed: {}", requestId, e.what());
+      std::string message = e.what();
+      outputOk = outputOk && writeFrame(FRAME_ERROR, requestId, message.data(),
+                                        message.size());
+    }
+
+    audioBuffer.clear();
+    if (!outputOk) {
+      // Nobody is reading the results anymore
+      spdlog::error("Failed to write to stdout (errno={})", errno);
+      return;
+    }
+  }
+
+  voice.synthesisConfig = defaultSynthesisConfig;
+}
+
 void rawOutputProc(vector<int16_t> &sharedAudioBuffer, mutex &mutAudio,
                    condition_variable &cvAudio, bool &audioReady,
                    bool &audioFinished) {
   vector<int16_t> internalAudioBuffer;
+  bool outputFailed = false;
   while (true) {
     {
       unique_lock lockAudio{mutAudio};
@@ -383,19 +633,23 @@ void rawOutputProc(vector<int16_t> &sharedAudioBuffer, mutex &mutAudio,
         break;
       }
 
-      copy(sharedAudioBuffer.begin(), sharedAudioBuffer.end(),
-           back_inserter(internalAudioBuffer));
-
-      sharedAudioBuffer.clear();
+      // Swap buffers instead of copying.
+      // The empty buffer keeps its capacity for the next sentence.
+      swap(sharedAudioBuffer, internalAudioBuffer);
 
       if (!audioFinished) {
         audioReady = false;
       }
     }
 
-    cout.write((const char *)internalAudioBuffer.data(),
-               sizeof(int16_t) * internalAudioBuffer.size());
-    cout.flush();
+    if (!outputFailed &&
+        !writeStdout((const char *)internalAudioBuffer.data(),
+                     sizeof(int16_t) * internalAudioBuffer.size())) {
+      // Keep draining audio so synthesis can finish
+      spdlog::error("Failed to write audio to stdout (errno={})", errno);
+      outputFailed = true;
+    }
+
     internalAudioBuffer.clear();
   }
 
@@ -409,7 +663,9 @@ void printUsage(char *argv[]) {
   cerr << endl;
   cerr << "options:" << endl;
   cerr << "   -h        --help              show this message and exit" << endl;
-  cerr << "   -m  FILE  --model       FILE  path to onnx model file" << endl;
+  cerr << "   -m  FILE  --model       FILE  path to onnx model file (.ort "
+          "models share weights between processes)"
+       << endl;
   cerr << "   -c  FILE  --config      FILE  path to model config file "
           "(default: model path + .json)"
        << endl;
@@ -442,6 +698,12 @@ void printUsage(char *argv[]) {
        << endl;
   cerr << "   --use-cuda                    use CUDA execution provider"
        << endl;
+  cerr << "   --protocol    NAME            text (default) or binary "
+          "(length-prefixed frames on stdin/stdout)"
+       << endl;
+  cerr << "   --no-quantized                ignore .int8.onnx/.fp16.onnx model "
+          "variants"
+       << endl;
   cerr << "   --debug                       print DEBUG messages to the console"
        << endl;
   cerr << "   -q       --quiet              disable logging" << endl;
@@ -527,6 +789,18 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
       runConfig.jsonInput = true;
     } else if (arg == "--use_cuda" || arg == "--use-cuda") {
       runConfig.useCuda = true;
+    } else if (arg == "--no_quantized" || arg == "--no-quantized") {
+      runConfig.useQuantizedModel = false;
+    } else if (arg == "--protocol") {
+      ensureArg(argc, argv, i);
+      std::string protocolName = argv[++i];
+      if (protocolName == "text") {
+        runConfig.protocol = PROTOCOL_TEXT;
+      } else if (protocolName == "binary") {
+        runConfig.protocol = PROTOCOL_BINARY;
+      } else {
+        throw invalid_argument("Unknown protocol: " + protocolName);
+      }
     } else if (arg == "--version") {
       std::cout << piper::getVersion() << std::endl;
       exit(0);
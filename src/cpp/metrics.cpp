@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "metrics.hpp"
+
+namespace piper {
+
+const std::vector<double> SECONDS_BUCKETS{0.001, 0.0025, 0.005, 0.01, 0.025,
+                                          0.05,  0.1,    0.25,  0.5,  1,
+                                          2.5,   5,      10,    30,   60};
+
+const std::vector<double> RTF_BUCKETS{0.01, 0.025, 0.05, 0.1, 0.2,
+                                      0.3,  0.5,   0.75, 1,   2};
+
+// Number of values in each thread's shard.
+// Counters use one value, histograms use buckets + 2 (+Inf and sum).
+const std::size_t MAX_METRIC_VALUES = 4096;
+
+// Series offsets already looked up by this thread
+struct MetricsThreadState {
+  Metrics *owner = nullptr;
+  void *shard = nullptr;
+  std::unordered_map<std::string, std::size_t> offsets;
+};
+
+thread_local MetricsThreadState metricsThreadState;
+
+Metrics::Shard::Shard()
+    : values(new std::atomic<double>[MAX_METRIC_VALUES]()) {}
+
+Metrics::Shard &Metrics::getShard() {
+  auto &state = metricsThreadState;
+  if (state.owner != this) {
+    auto shard = std::make_shared<Shard>();
+    {
+      std::lock_guard<std::mutex> lock(registryMutex);
+      shards.push_back(shard);
+    }
+
+    state.owner = this;
+    state.shard = shard.get();
+    state.offsets.clear();
+  }
+
+  return *static_cast<Shard *>(state.shard);
+}
+
+std::size_t Metrics::getOffset(const std::string &name,
+                               const std::string &labels,
+                               const std::vector<double> *buckets) {
+  getShard();
+
+  std::string key = name + "{" + labels + "}";
+  auto &offsets = metricsThreadState.offsets;
+  auto offsetIter = offsets.find(key);
+  if (offsetIter != offsets.end()) {
+    return offsetIter->second;
+  }
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto seriesIter = series.find(key);
+  if (seriesIter == series.end()) {
+    std::size_t numValues = buckets ? buckets->size() + 2 : 1;
+    if ((nextOffset + numValues) > MAX_METRIC_VALUES) {
+      spdlog::warn("Too many metric series, dropping {}", key);
+      offsets[key] = std::string::npos;
+      return std::string::npos;
+    }
+
+    Series newSeries{name, labels, buckets ? *buckets : std::vector<double>(),
+                     nextOffset};
+    nextOffset += numValues;
+    seriesIter = series.emplace(key, std::move(newSeries)).first;
+  }
+
+  offsets[key] = seriesIter->second.offset;
+  return seriesIter->second.offset;
+}
+
+void Metrics::describe(const std::string &name, const std::string &type,
+                       const std::string &help) {
+  std::lock_guard<std::mutex> lock(registryMutex);
+  families[name] = Family{type, help};
+}
+
+void Metrics::increment(const std::string &name, const std::string &labels,
+                        double value) {
+  auto offset = getOffset(name, labels, nullptr);
+  if (offset == std::string::npos) {
+    return;
+  }
+
+  // Only this thread writes to its shard
+  auto &slot = getShard().values[offset];
+  slot.store(slot.load(std::memory_order_relaxed) + value,
+             std::memory_order_relaxed);
+}
+
+void Metrics::observe(const std::string &name, const std::string &labels,
+                      double value, const std::vector<double> &buckets) {
+  auto offset = getOffset(name, labels, &buckets);
+  if (offset == std::string::npos) {
+    return;
+  }
+
+  auto *values = getShard().values.get() + offset;
+
+  // Non-cumulative count per bucket, last bucket is +Inf
+  std::size_t bucket =
+      std::lower_bound(buckets.begin(), buckets.end(), value) -
+      buckets.begin();
+  values[bucket].store(values[bucket].load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+
+  auto &sum = values[buckets.size() + 1];
+  sum.store(sum.load(std::memory_order_relaxed) + value,
+            std::memory_order_relaxed);
+}
+
+void Metrics::addCollector(std::function<void(std::string &out)> collector) {
+  std::lock_guard<std::mutex> lock(registryMutex);
+  collectors.push_back(std::move(collector));
+}
+
+std::string Metrics::render() {
+  std::string out;
+  std::vector<std::function<void(std::string &out)>> currentCollectors;
+
+  {
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    // Sum values across shards
+    std::vector<double> totals(nextOffset, 0.0);
+    for (auto &shard : shards) {
+      for (std::size_t i = 0; i < nextOffset; i++) {
+        totals[i] += shard->values[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    // Series are sorted by key, so each family is contiguous
+    std::string lastName;
+    for (auto &[key, s] : series) {
+      if (s.name != lastName) {
+        auto familyIter = families.find(s.name);
+        if (familyIter != families.end()) {
+          out += fmt::format("# HELP {} {}\n", s.name, familyIter->second.help);
+          out += fmt::format("# TYPE {} {}\n", s.name, familyIter->second.type);
+        }
+        lastName = s.name;
+      }
+
+      std::string labelPrefix = s.labels.empty() ? "" : s.labels + ",";
+      if (s.buckets.empty()) {
+        out += fmt::format("{}{}{}{} {}\n", s.name, s.labels.empty() ? "" : "{",
+                           s.labels, s.labels.empty() ? "" : "}",
+                           totals[s.offset]);
+        continue;
+      }
+
+      double count = 0;
+      for (std::size_t i = 0; i <= s.buckets.size(); i++) {
+        count += totals[s.offset + i];
+        std::string bound =
+            (i < s.buckets.size()) ? fmt::format("{}", s.buckets[i]) : "+Inf";
+        out += fmt::format("{}_bucket{{{}le=\"{}\"}} {}\n", s.name, labelPrefix,
+                           bound, count);
+      }
+
+      std::string labels = s.labels.empty() ? "" : "{" + s.labels + "}";
+      out += fmt::format("{}_sum{} {}\n", s.name, labels,
+                         totals[s.offset + s.buckets.size() + 1]);
+      out += fmt::format("{}_count{} {}\n", s.name, labels, count);
+    }
+
+    currentCollectors = collectors;
+  }
+
+  for (auto &collector : currentCollectors) {
+    collector(out);
+  }
+
+  return out;
+}
+
+std::string escapeLabelValue(const std::string &value) {
+  std::string escaped;
+  escaped.reserve(value.size());
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+
+  return escaped;
+}
+
+} // namespace piper
@@ -0,0 +1,84 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace piper {
+
+// Histogram bucket upper bounds
+extern const std::vector<double> SECONDS_BUCKETS;
+extern const std::vector<double> RTF_BUCKETS;
+
+// Counters and histograms exported in Prometheus text format.
+//
+// Every thread writes to its own shard of values with relaxed loads/stores
+// (single writer, no locks or read-modify-write on the hot path). The
+// registry lock is only taken the first time a thread sees a series, and
+// when metrics are rendered.
+class Metrics {
+public:
+  // Set type and help text of a metric family
+  void describe(const std::string &name, const std::string &type,
+                const std::string &help);
+
+  // Add to a counter. Labels are preformatted, e.g. voice="x",outcome="ok"
+  void increment(const std::string &name, const std::string &labels = "",
+                 double value = 1);
+
+  // Record an observation in a histogram
+  void observe(const std::string &name, const std::string &labels,
+               double value,
+               const std::vector<double> &buckets = SECONDS_BUCKETS);
+
+  // Add a function that appends gauges (text format) when rendering
+  void addCollector(std::function<void(std::string &out)> collector);
+
+  // All metrics in Prometheus text format
+  std::string render();
+
+private:
+  struct Series {
+    std::string name;
+    std::string labels;
+    std::vector<double> buckets; // empty for counters
+    std::size_t offset;
+  };
+
+  struct Shard {
+    Shard();
+    std::unique_ptr<std::atomic<double>[]> values;
+  };
+
+  struct Family {
+    std::string type;
+    std::string help;
+  };
+
+  // Offset of a series' values in every shard, or npos if full
+  std::size_t getOffset(const std::string &name, const std::string &labels,
+                        const std::vector<double> *buckets);
+
+  // Shard of the calling thread
+  Shard &getShard();
+
+  std::mutex registryMutex;
+  std::map<std::string, Series> series; // key is name{labels}
+  std::map<std::string, Family> families;
+  std::vector<std::shared_ptr<Shard>> shards;
+  std::vector<std::function<void(std::string &out)>> collectors;
+  std::size_t nextOffset = 0;
+};
+
+// Escape a label value (backslash, quote, newline)
+std::string escapeLabelValue(const std::string &value);
+
+} // namespace piper
+
+#endif // METRICS_H_
@@ -1,5 +1,7 @@
 #include <array>
+#include <cctype>
 #include <chrono>
+#include <filesystem>
 #include <fstream>
 #include <limits>
 #include <sstream>
@@ -11,14 +13,34 @@
 #include <soundtouch/SoundTouch.h>
 #include <vector>
 #include <cstdint>
+#include <cstring>
 #include <cmath>
 #include <algorithm>
-#include <stdexcept>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <thread>
+#include <tuple>
 #include "json.hpp"
 #include "piper.hpp"
 #include "utf8.h"
 #include "wavfile.hpp"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 namespace piper
 {
 
@@ -304,6 +326,165 @@ namespace piper
     spdlog::info("Terminated piper");
   }
 
+  MappedFile::MappedFile(const std::string &path)
+  {
+#ifdef _WIN32
+    auto pathW = std::wstring(path.begin(), path.end());
+    fileHandle = CreateFileW(pathW.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+      fileHandle = nullptr;
+      throw std::runtime_error("Failed to open file for mapping: " + path);
+    }
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(fileHandle, &fileSize);
+    mapSize = (std::size_t)fileSize.QuadPart;
+
+    mappingHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0,
+                                       0, nullptr);
+    if (mappingHandle != nullptr)
+    {
+      mapData = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    }
+
+    if (mapData == nullptr)
+    {
+      if (mappingHandle != nullptr)
+      {
+        CloseHandle(mappingHandle);
+      }
+      CloseHandle(fileHandle);
+      throw std::runtime_error("Failed to map file: " + path);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      throw std::runtime_error("Failed to open file for mapping: " + path);
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0)
+    {
+      close(fd);
+      throw std::runtime_error("Failed to get size of file: " + path);
+    }
+
+    mapSize = (std::size_t)fileStat.st_size;
+    mapData = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+
+    // Mapping stays valid after the descriptor is closed
+    close(fd);
+
+    if (mapData == MAP_FAILED)
+    {
+      mapData = nullptr;
+      throw std::runtime_error("Failed to map file: " + path);
+    }
+#endif
+  }
+
+  MappedFile::~MappedFile()
+  {
+#ifdef _WIN32
+    UnmapViewOfFile(mapData);
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+#else
+    munmap(mapData, mapSize);
+#endif
+  }
+
+  Lexicon::Lexicon(const std::string &path) : file(path)
+  {
+    auto data = (const char *)file.data();
+    std::size_t lineStart = 0;
+    while (lineStart < file.size())
+    {
+      auto lineEnd = (const char *)std::memchr(data + lineStart, '\n',
+                                               file.size() - lineStart);
+      std::size_t nextLine =
+          lineEnd ? (std::size_t)(lineEnd - data) + 1 : file.size();
+
+      if ((data[lineStart] != '#') && (data[lineStart] != '\n') &&
+          (data[lineStart] != '\r'))
+      {
+        entryOffsets.push_back(lineStart);
+        if ((entryOffsets.size() > 1) &&
+            (getWord(lineStart) < getWord(entryOffsets[size() - 2])))
+        {
+          throw std::runtime_error("Lexicon is not sorted at word \"" +
+                                   std::string(getWord(lineStart)) +
+                                   "\": " + path);
+        }
+      }
+
+      lineStart = nextLine;
+    }
+
+    spdlog::debug("Loaded lexicon with {} word(s) from {}", size(), path);
+  }
+
+  std::string_view Lexicon::getWord(std::size_t offset) const
+  {
+    auto data = (const char *)file.data();
+    std::size_t start = offset;
+    std::size_t end = start;
+    while ((end < file.size()) && (data[end] != '\t') && (data[end] != '\n') &&
+           (data[end] != '\r'))
+    {
+      end++;
+    }
+
+    return std::string_view(data + start, end - start);
+  }
+
+  bool Lexicon::lookup(std::string_view word,
+                       std::vector<Phoneme> &phonemes) const
+  {
+    std::string key(word);
+    for (auto &c : key)
+    {
+      if ((c >= 'A') && (c <= 'Z'))
+      {
+        c = c - 'A' + 'a';
+      }
+    }
+
+    auto entryIter = std::lower_bound(
+        entryOffsets.begin(), entryOffsets.end(), key,
+        [this](std::size_t offset, const std::string &key)
+        { return getWord(offset) < key; });
+    if ((entryIter == entryOffsets.end()) || (getWord(*entryIter) != key))
+    {
+      return false;
+    }
+
+    // Phonemes are the rest of the line after the tab
+    auto data = (const char *)file.data();
+    std::size_t start = *entryIter + key.size();
+    if ((start >= file.size()) || (data[start] != '\t'))
+    {
+      return false;
+    }
+
+    start++;
+    std::size_t end = start;
+    while ((end < file.size()) && (data[end] != '\n') && (data[end] != '\r'))
+    {
+      end++;
+    }
+
+    utf8::iterator phonemeIter(data + start, data + start, data + end);
+    utf8::iterator phonemeEnd(data + end, data + start, data + end);
+    phonemes.insert(phonemes.end(), phonemeIter, phonemeEnd);
+
+    return true;
+  }
+
   void loadModel(std::string modelPath, ModelSession &session, bool useCuda)
   {
     spdlog::debug("Loading onnx model from {}", modelPath);
@@ -345,13 +526,60 @@ namespace piper
     auto modelPathStr = modelPath.c_str();
 #endif
 
-    session.onnx = Ort::Session(session.env, modelPathStr, session.options);
+    std::shared_ptr<MappedFile> modelData;
+    try
+    {
+      modelData = std::make_shared<MappedFile>(modelPath);
+    }
+    catch (const std::exception &e)
+    {
+      spdlog::warn("{}, reading model file instead", e.what());
+    }
+
+    // Only models in ORT format can use the mapped bytes for their weights.
+    // ONNX models are parsed from the mapping, but their initializers are
+    // copied into private memory.
+    bool isOrtFormat = modelPath.size() >= 4 &&
+                       modelPath.compare(modelPath.size() - 4, 4, ".ort") == 0;
+
+    if (modelData)
+    {
+      // Create session from the mapped model instead of reading the file
+      if (isOrtFormat)
+      {
+        session.options.AddConfigEntry("session.use_ort_model_bytes_directly",
+                                       "1");
+        session.options.AddConfigEntry(
+            "session.use_ort_model_bytes_for_initializers", "1");
+      }
+
+      session.onnx = Ort::Session(session.env, modelData->data(),
+                                  modelData->size(), session.options);
+    }
+    else
+    {
+      session.onnx = Ort::Session(session.env, modelPathStr, session.options);
+    }
+
+    // Previous session (if any) is gone, so its mapping can be released.
+    // The mapping is only kept while the session uses its bytes.
+    session.modelData = isOrtFormat ? modelData : nullptr;
 
     auto endTime = std::chrono::steady_clock::now();
     spdlog::debug("Loaded onnx model in {} second(s)",
                   std::chrono::duration<double>(endTime - startTime).count());
   }
 
+  // Path of a quantized model variant: model.onnx -> model.<suffix>.onnx
+  static std::string getQuantizedModelPath(const std::string &modelPath,
+                                           const std::string &suffix)
+  {
+    std::filesystem::path path(modelPath);
+    auto quantizedPath = path;
+    quantizedPath.replace_extension("." + suffix + path.extension().string());
+    return quantizedPath.string();
+  }
+
   // Load Onnx model and JSON config file
   void loadVoice(PiperConfig &config, std::string modelPath,
                  std::string modelConfigPath, Voice &voice,
@@ -361,6 +589,10 @@ namespace piper
     std::ifstream modelConfigFile(modelConfigPath);
     voice.configRoot = json::parse(modelConfigFile);
 
+    // Parsing adds to the maps, so don't keep anything from a previous voice
+    voice.phonemizeConfig = PhonemizeConfig();
+    voice.synthesisConfig = SynthesisConfig();
+    voice.modelConfig = ModelConfig();
     parsePhonemizeConfig(voice.configRoot, voice.phonemizeConfig);
     parseSynthesisConfig(voice.configRoot, voice.synthesisConfig);
     parseModelConfig(voice.configRoot, voice.modelConfig);
@@ -381,53 +613,827 @@ namespace piper
 
     spdlog::debug("Voice contains {} speaker(s)", voice.modelConfig.numSpeakers);
 
+    voice.lexicon.reset();
+    auto lexiconPath = modelPath + ".lexicon";
+    std::error_code lexiconEc;
+    if ((voice.phonemizeConfig.phonemeType == eSpeakPhonemes) &&
+        std::filesystem::exists(lexiconPath, lexiconEc))
+    {
+      voice.lexicon = std::make_shared<Lexicon>(lexiconPath);
+      spdlog::info("Using lexicon {} ({} word(s))", lexiconPath,
+                   voice.lexicon->size());
+    }
+
+    if (config.useQuantizedModel)
+    {
+      // INT8 kernels only pay off on CPU, fp16 weights only on GPU
+      auto quantizedPath =
+          getQuantizedModelPath(modelPath, useCuda ? "fp16" : "int8");
+      std::error_code ec;
+      if (std::filesystem::exists(quantizedPath, ec))
+      {
+        spdlog::info("Using quantized model variant {}", quantizedPath);
+        modelPath = quantizedPath;
+      }
+    }
+
     loadModel(modelPath, voice.session, useCuda);
 
   } /* loadVoice */
 
+#ifndef _WIN32
+  // Sentence count sent by a worker when phonemization failed
+  const uint32_t PHONEMIZER_ERROR = 0xFFFFFFFF;
+
+  static bool sendAll(int fd, const void *data, std::size_t size)
+  {
+    auto bytes = (const char *)data;
+    while (size > 0)
+    {
+#ifdef MSG_NOSIGNAL
+      ssize_t numSent = send(fd, bytes, size, MSG_NOSIGNAL);
+#else
+      ssize_t numSent = send(fd, bytes, size, 0);
+#endif
+      if (numSent < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        return false;
+      }
+
+      bytes += numSent;
+      size -= numSent;
+    }
+
+    return true;
+  }
+
+  static bool receiveAll(int fd, void *data, std::size_t size)
+  {
+    auto bytes = (char *)data;
+    while (size > 0)
+    {
+      ssize_t numReceived = recv(fd, bytes, size, 0);
+      if (numReceived < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        return false;
+      }
+
+      if (numReceived == 0)
+      {
+        return false;
+      }
+
+      bytes += numReceived;
+      size -= numReceived;
+    }
+
+    return true;
+  }
+
+  // Length-prefixed string
+  static bool sendString(int fd, const std::string &str)
+  {
+    uint32_t size = (uint32_t)str.size();
+    return sendAll(fd, &size, sizeof(size)) && sendAll(fd, str.data(), size);
+  }
+
+  static bool receiveString(int fd, std::string &str)
+  {
+    uint32_t size = 0;
+    if (!receiveAll(fd, &size, sizeof(size)))
+    {
+      return false;
+    }
+
+    str.resize(size);
+    return receiveAll(fd, str.data(), size);
+  }
+
+  // Close every file descriptor except stdio and the one to keep, so a worker
+  // does not hold the server's sockets or files open.
+  static void closeInheritedFiles(int keepFd)
+  {
+#ifdef __linux__
+    if (DIR *fdDir = opendir("/proc/self/fd"))
+    {
+      int dirFd = dirfd(fdDir);
+      while (dirent *entry = readdir(fdDir))
+      {
+        int fd = atoi(entry->d_name);
+        if ((fd > STDERR_FILENO) && (fd != keepFd) && (fd != dirFd))
+        {
+          close(fd);
+        }
+      }
+
+      closedir(fdDir);
+      return;
+    }
+#endif
+
+    long maxFd = sysconf(_SC_OPEN_MAX);
+    for (int fd = STDERR_FILENO + 1; fd < ((maxFd > 0) ? maxFd : 1024); fd++)
+    {
+      if (fd != keepFd)
+      {
+        close(fd);
+      }
+    }
+  }
+
+  // Initialize eSpeak and report the result, then phonemize requests (voice,
+  // text) from the parent until it goes away. Response is the number of
+  // sentences, then for each sentence the number of phonemes followed by the
+  // phonemes.
+  [[noreturn]] static void runPhonemizerWorker(int fd,
+                                               const std::string &dataPath)
+  {
+    closeInheritedFiles(fd);
+
+    int initResult = espeak_Initialize(AUDIO_OUTPUT_SYNCHRONOUS,
+                                       /*buflength*/ 0,
+                                       /*path*/ dataPath.c_str(),
+                                       /*options*/ 0);
+    uint32_t status = (initResult < 0) ? PHONEMIZER_ERROR : 0;
+    if (!sendAll(fd, &status, sizeof(status)) || (initResult < 0))
+    {
+      _exit(1);
+    }
+
+    std::string voice;
+    std::string text;
+    std::vector<std::vector<Phoneme>> phonemes;
+    std::vector<uint32_t> response;
+
+    while (receiveString(fd, voice) && receiveString(fd, text))
+    {
+      phonemes.clear();
+      response.clear();
+      try
+      {
+        eSpeakPhonemeConfig eSpeakConfig;
+        eSpeakConfig.voice = voice;
+        phonemize_eSpeak(text, eSpeakConfig, phonemes);
+
+        response.push_back((uint32_t)phonemes.size());
+        for (auto &sentencePhonemes : phonemes)
+        {
+          response.push_back((uint32_t)sentencePhonemes.size());
+          response.insert(response.end(), sentencePhonemes.begin(),
+                          sentencePhonemes.end());
+        }
+      }
+      catch (const std::exception &)
+      {
+        response.assign(1, PHONEMIZER_ERROR);
+      }
+
+      if (!sendAll(fd, response.data(), sizeof(uint32_t) * response.size()))
+      {
+        break;
+      }
+    }
+
+    _exit(0);
+  }
+
+  // Requests to the spawner: command and worker pid
+  const uint32_t SPAWNER_START_WORKER = 1;
+  const uint32_t SPAWNER_KILL_WORKER = 2;
+
+  // A worker that fails more often than this within the window stays stopped
+  const std::size_t MAX_PHONEMIZER_RESTARTS = 5;
+  const std::chrono::seconds PHONEMIZER_RESTART_WINDOW(60);
+
+  // Send a value along with a file descriptor (fd < 0 sends only the value)
+  static bool sendWithFd(int socketFd, int32_t value, int fd)
+  {
+    iovec iov{&value, sizeof(value)};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0)
+    {
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+      cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+    while (true)
+    {
+#ifdef MSG_NOSIGNAL
+      ssize_t numSent = sendmsg(socketFd, &message, MSG_NOSIGNAL);
+#else
+      ssize_t numSent = sendmsg(socketFd, &message, 0);
+#endif
+      if ((numSent < 0) && (errno == EINTR))
+      {
+        continue;
+      }
+
+      return numSent == (ssize_t)sizeof(value);
+    }
+  }
+
+  // Receive a value and the file descriptor sent with it (-1 if none)
+  static bool receiveWithFd(int socketFd, int32_t &value, int &fd)
+  {
+    iovec iov{&value, sizeof(value)};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    fd = -1;
+    ssize_t numReceived = -1;
+    do
+    {
+      numReceived = recvmsg(socketFd, &message, 0);
+    } while ((numReceived < 0) && (errno == EINTR));
+
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+         header = CMSG_NXTHDR(&message, header))
+    {
+      if ((header->cmsg_level == SOL_SOCKET) &&
+          (header->cmsg_type == SCM_RIGHTS))
+      {
+        std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+      }
+    }
+
+    if (numReceived != (ssize_t)sizeof(value))
+    {
+      if (fd >= 0)
+      {
+        close(fd);
+        fd = -1;
+      }
+      return false;
+    }
+
+    return true;
+  }
+
+  // Fork phonemizer workers for the server, which may be multithreaded by
+  // then and so can't fork safely itself. The spawner is forked before any
+  // threads and stays single-threaded. Workers are its children, so it also
+  // kills them on request: a worker's pid can't be reused before the spawner
+  // reaps it.
+  [[noreturn]] static void runWorkerSpawner(int fd,
+                                            const std::string &dataPath)
+  {
+    closeInheritedFiles(fd);
+
+    // Reap workers explicitly, even if the server ignores SIGCHLD
+    signal(SIGCHLD, SIG_DFL);
+
+    uint32_t request[2];
+    while (receiveAll(fd, request, sizeof(request)))
+    {
+      pid_t pid = (pid_t)request[1];
+      if (request[0] == SPAWNER_KILL_WORKER)
+      {
+        if (waitpid(pid, nullptr, WNOHANG) == 0)
+        {
+          kill(pid, SIGKILL);
+          waitpid(pid, nullptr, 0);
+        }
+        continue;
+      }
+
+      int workerFds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, workerFds) < 0)
+      {
+        if (!sendWithFd(fd, -1, -1))
+        {
+          break;
+        }
+        continue;
+      }
+
+#ifdef SO_NOSIGPIPE
+      int opt = 1;
+      setsockopt(workerFds[0], SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+      setsockopt(workerFds[1], SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+
+      pid = fork();
+      if (pid == 0)
+      {
+        runPhonemizerWorker(workerFds[1], dataPath);
+      }
+
+      close(workerFds[1]);
+      bool sent = sendWithFd(fd, (int32_t)pid, (pid > 0) ? workerFds[0] : -1);
+      close(workerFds[0]);
+      if (!sent)
+      {
+        break;
+      }
+    }
+
+    // Workers exit once the server has closed their sockets
+    while ((wait(nullptr) > 0) || (errno == EINTR))
+    {
+    }
+
+    _exit(0);
+  }
+
+  // Read one phonemize response. Returns false if the worker is gone or
+  // the stream is out of sync; failed is set if eSpeak itself failed.
+  static bool receivePhonemes(int fd,
+                              std::vector<std::vector<Phoneme>> &phonemes,
+                              bool &failed)
+  {
+    uint32_t numSentences = 0;
+    if (!receiveAll(fd, &numSentences, sizeof(numSentences)))
+    {
+      return false;
+    }
+
+    failed = (numSentences == PHONEMIZER_ERROR);
+    for (uint32_t i = 0; !failed && (i < numSentences); i++)
+    {
+      uint32_t numPhonemes = 0;
+      if (!receiveAll(fd, &numPhonemes, sizeof(numPhonemes)))
+      {
+        return false;
+      }
+
+      auto &sentencePhonemes = phonemes.emplace_back(numPhonemes);
+      if (!receiveAll(fd, sentencePhonemes.data(),
+                      sizeof(Phoneme) * numPhonemes))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Offsets where eSpeak starts a new sentence anyway, so the parts can be
+  // phonemized separately: after a blank line (end of paragraph), or after
+  // '.', '!' or '?' and whitespace when the next word is capitalized or a
+  // number. A '.' after a short capitalized word ("Dr.", "Mrs.") may be an
+  // abbreviation, so the text is not cut there.
+  static std::vector<std::size_t> findSentenceStarts(const std::string &text)
+  {
+    std::vector<std::size_t> sentenceStarts;
+    for (std::size_t i = 0; i < text.size(); i++)
+    {
+      char c = text[i];
+      bool isBlankLine = false;
+      if (c == '\n')
+      {
+        std::size_t lineStart = text.find_first_not_of(" \t\r", i + 1);
+        isBlankLine = (lineStart != std::string::npos) && (text[lineStart] == '\n');
+      }
+
+      if (!isBlankLine && (c != '.') && (c != '!') && (c != '?'))
+      {
+        continue;
+      }
+
+      std::size_t next = text.find_first_not_of(" \t\r\n", i + 1);
+      if (next == std::string::npos)
+      {
+        break;
+      }
+
+      if (!isBlankLine)
+      {
+        unsigned char first = (unsigned char)text[next];
+        if ((next == (i + 1)) || !(std::isupper(first) || std::isdigit(first)))
+        {
+          continue;
+        }
+
+        std::size_t wordStart = i;
+        while ((wordStart > 0) &&
+               std::isalpha((unsigned char)text[wordStart - 1]))
+        {
+          wordStart--;
+        }
+
+        if ((c == '.') && (wordStart < i) && ((i - wordStart) <= 3) &&
+            std::isupper((unsigned char)text[wordStart]))
+        {
+          continue;
+        }
+      }
+
+      if (sentenceStarts.empty() || (sentenceStarts.back() != next))
+      {
+        sentenceStarts.push_back(next);
+      }
+
+      i = next - 1;
+    }
+
+    return sentenceStarts;
+  }
+
+  PhonemizerPool::PhonemizerPool(int numWorkers,
+                                 const std::string &eSpeakDataPath)
+      : eSpeakDataPath(eSpeakDataPath)
+  {
+    if ((numWorkers < 1) || (numWorkers > (int)MAX_WORKERS))
+    {
+      throw std::invalid_argument("Number of phonemizer workers must be 1-" +
+                                  std::to_string(MAX_WORKERS));
+    }
+
+    startSpawner();
+
+    workers.resize(numWorkers);
+    try
+    {
+      for (std::size_t i = 0; i < workers.size(); i++)
+      {
+        startWorker(i);
+      }
+    }
+    catch (...)
+    {
+      for (std::size_t i = 0; i < workers.size(); i++)
+      {
+        stopWorker(i, /*kill*/ true);
+      }
+
+      close(spawnerFd);
+      waitpid(spawnerPid, nullptr, 0);
+      throw;
+    }
+
+    numLiveWorkers = workers.size();
+    idleWorkers = (workers.size() == MAX_WORKERS)
+                      ? ~(uint64_t)0
+                      : (((uint64_t)1 << workers.size()) - 1);
+  }
+
+  PhonemizerPool::~PhonemizerPool()
+  {
+    for (std::size_t i = 0; i < workers.size(); i++)
+    {
+      stopWorker(i);
+    }
+
+    // Spawner exits after its workers do
+    close(spawnerFd);
+    waitpid(spawnerPid, nullptr, 0);
+  }
+
+  void PhonemizerPool::startSpawner()
+  {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+      throw std::runtime_error("Failed to create phonemizer spawner socket");
+    }
+
+#ifdef SO_NOSIGPIPE
+    int opt = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+      close(fds[0]);
+      close(fds[1]);
+      throw std::runtime_error("Failed to start phonemizer spawner");
+    }
+
+    if (pid == 0)
+    {
+      runWorkerSpawner(fds[1], eSpeakDataPath);
+    }
+
+    close(fds[1]);
+    spawnerPid = pid;
+    spawnerFd = fds[0];
+  }
+
+  void PhonemizerPool::startWorker(std::size_t index)
+  {
+    auto &worker = workers[index];
+    {
+      std::lock_guard<std::mutex> lock(spawnerMutex);
+      uint32_t request[2] = {SPAWNER_START_WORKER, 0};
+      int32_t pid = -1;
+      int fd = -1;
+      if (!sendAll(spawnerFd, request, sizeof(request)) ||
+          !receiveWithFd(spawnerFd, pid, fd) || (pid <= 0) || (fd < 0))
+      {
+        if (fd >= 0)
+        {
+          close(fd);
+        }
+
+        throw std::runtime_error("Failed to start phonemizer worker");
+      }
+
+      worker.pid = pid;
+      worker.fd = fd;
+    }
+
+    uint32_t status = PHONEMIZER_ERROR;
+    if (!receiveAll(worker.fd, &status, sizeof(status)) || (status != 0))
+    {
+      throw std::runtime_error(
+          "Failed to initialize eSpeak-ng in phonemizer worker (data path: " +
+          eSpeakDataPath + ")");
+    }
+  }
+
+  void PhonemizerPool::stopWorker(std::size_t index, bool kill)
+  {
+    auto &worker = workers[index];
+    if (kill && (worker.pid > 0))
+    {
+      std::lock_guard<std::mutex> lock(spawnerMutex);
+      uint32_t request[2] = {SPAWNER_KILL_WORKER, (uint32_t)worker.pid};
+      sendAll(spawnerFd, request, sizeof(request));
+    }
+
+    if (worker.fd >= 0)
+    {
+      // Worker exits when its socket is closed
+      close(worker.fd);
+      worker.fd = -1;
+    }
+
+    // Reaped by the spawner
+    worker.pid = -1;
+  }
+
+  bool PhonemizerPool::restartWorker(std::size_t index)
+  {
+    auto &worker = workers[index];
+    stopWorker(index, /*kill*/ true);
+
+    auto now = std::chrono::steady_clock::now();
+    while (!worker.restartTimes.empty() &&
+           ((now - worker.restartTimes.front()) > PHONEMIZER_RESTART_WINDOW))
+    {
+      worker.restartTimes.pop_front();
+    }
+
+    if (worker.restartTimes.size() >= MAX_PHONEMIZER_RESTARTS)
+    {
+      spdlog::error("Phonemizer worker {} failed {} times in {} second(s), "
+                    "stopping it",
+                    index, worker.restartTimes.size() + 1,
+                    PHONEMIZER_RESTART_WINDOW.count());
+      return false;
+    }
+
+    worker.restartTimes.push_back(now);
+    try
+    {
+      startWorker(index);
+    }
+    catch (const std::exception &e)
+    {
+      spdlog::error("Failed to restart phonemizer worker {}: {}", index,
+                    e.what());
+      stopWorker(index, /*kill*/ true);
+      return false;
+    }
+
+    return true;
+  }
+
+  uint64_t PhonemizerPool::claimWorkers(std::size_t maxCount)
+  {
+    uint64_t idle = idleWorkers.load();
+    while (true)
+    {
+      uint64_t claimed = 0;
+      uint64_t remaining = idle;
+      for (std::size_t i = 0; (i < maxCount) && (remaining != 0); i++)
+      {
+        uint64_t lowest = remaining & (~remaining + 1);
+        claimed |= lowest;
+        remaining &= ~lowest;
+      }
+
+      if ((claimed == 0) ||
+          idleWorkers.compare_exchange_weak(idle, idle & ~claimed))
+      {
+        return claimed;
+      }
+    }
+  }
+
+  bool PhonemizerPool::phonemize(const std::string &text,
+                                 const std::string &voice,
+                                 std::vector<std::vector<Phoneme>> &phonemes)
+  {
+    // Sentences are split across as many idle workers as possible
+    auto sentenceStarts = findSentenceStarts(text);
+    uint64_t claimed = 0;
+    while ((claimed = claimWorkers(sentenceStarts.size() + 1)) == 0)
+    {
+      // Every worker is busy with another caller's text
+      std::unique_lock<std::mutex> lock(idleMutex);
+      idleChanged.wait(lock, [this]()
+                       { return (idleWorkers != 0) || (numLiveWorkers == 0); });
+      if ((idleWorkers == 0) && (numLiveWorkers == 0))
+      {
+        return false;
+      }
+    }
+
+    std::vector<std::size_t> indexes;
+    for (std::size_t i = 0; i < workers.size(); i++)
+    {
+      if ((claimed >> i) & 1)
+      {
+        indexes.push_back(i);
+      }
+    }
+
+    // Cut at the sentence start closest after each equal share of the text
+    std::vector<std::size_t> cuts{0};
+    auto startIter = sentenceStarts.begin();
+    for (std::size_t i = 1; i < indexes.size(); i++)
+    {
+      startIter = std::lower_bound(startIter, sentenceStarts.end(),
+                                   std::max(cuts.back() + 1,
+                                            text.size() * i / indexes.size()));
+      if (startIter == sentenceStarts.end())
+      {
+        break;
+      }
+
+      cuts.push_back(*startIter);
+    }
+    cuts.push_back(text.size());
+
+    // Send every part before reading any results, so workers run in parallel
+    std::size_t numParts = cuts.size() - 1;
+    std::vector<bool> workerOk(numParts, true);
+    for (std::size_t i = 0; i < numParts; i++)
+    {
+      int fd = workers[indexes[i]].fd;
+      workerOk[i] =
+          sendString(fd, voice) &&
+          sendString(fd, text.substr(cuts[i], cuts[i + 1] - cuts[i]));
+    }
+
+    bool failed = false;
+    for (std::size_t i = 0; i < numParts; i++)
+    {
+      bool partFailed = false;
+      workerOk[i] = workerOk[i] &&
+                    receivePhonemes(workers[indexes[i]].fd, phonemes,
+                                    partFailed);
+      failed = failed || partFailed || !workerOk[i];
+    }
+
+    // Workers that died or are out of sync are replaced by the spawner
+    uint64_t released = 0;
+    for (std::size_t i = 0; i < indexes.size(); i++)
+    {
+      if ((i < numParts) && !workerOk[i])
+      {
+        spdlog::error("Phonemizer worker {} failed, restarting it", indexes[i]);
+        if (!restartWorker(indexes[i]))
+        {
+          numLiveWorkers--;
+          continue;
+        }
+      }
+
+      released |= (uint64_t)1 << indexes[i];
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(idleMutex);
+      idleWorkers |= released;
+    }
+    idleChanged.notify_all();
+
+    if (failed)
+    {
+      throw std::runtime_error("Failed to phonemize text with eSpeak");
+    }
+
+    return true;
+  }
+#endif
+
+  void CancelToken::cancel()
+  {
+    std::lock_guard<std::mutex> lock(runMutex);
+    cancelled = true;
+    if (runOptions)
+    {
+      runOptions->SetTerminate();
+    }
+  }
+
+  void CancelToken::check() const
+  {
+    if (cancelled)
+    {
+      throw SynthesisCancelled();
+    }
+  }
+
+  void CancelToken::beginRun(Ort::RunOptions &options)
+  {
+    std::lock_guard<std::mutex> lock(runMutex);
+    runOptions = &options;
+    if (cancelled)
+    {
+      runOptions->SetTerminate();
+    }
+  }
+
+  void CancelToken::endRun()
+  {
+    std::lock_guard<std::mutex> lock(runMutex);
+    runOptions = nullptr;
+  }
+
+  // Seconds elapsed since a start time
+  static double secondsSince(std::chrono::steady_clock::time_point startTime)
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         startTime)
+        .count();
+  }
+
   // Phoneme ids to WAV audio
   void synthesize(std::vector<PhonemeId> &phonemeIds,
                   SynthesisConfig &synthesisConfig, ModelSession &session,
-                  std::vector<int16_t> &audioBuffer, SynthesisResult &result)
+                  std::vector<int16_t> &audioBuffer, SynthesisResult &result,
+                  CancelToken *cancelToken)
   {
     spdlog::debug("Synthesizing audio for {} phoneme id(s)", phonemeIds.size());
 
     auto memoryInfo = Ort::MemoryInfo::CreateCpu(
         OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
 
-    // Allocate
-    std::vector<int64_t> phonemeIdLengths{(int64_t)phonemeIds.size()};
-    std::vector<float> scales{synthesisConfig.noiseScale,
-                              synthesisConfig.lengthScale,
-                              synthesisConfig.noiseW};
-
-    std::vector<Ort::Value> inputTensors;
-    std::vector<int64_t> phonemeIdsShape{1, (int64_t)phonemeIds.size()};
-    inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
+    // Inputs and shapes are fixed size, so they live on the stack instead of
+    // being allocated for every phrase
+    std::array<int64_t, 1> phonemeIdLengths{(int64_t)phonemeIds.size()};
+    std::array<float, 3> scales{synthesisConfig.noiseScale,
+                                synthesisConfig.lengthScale,
+                                synthesisConfig.noiseW};
+
+    std::array<Ort::Value, 4> inputTensors{Ort::Value(nullptr),
+                                           Ort::Value(nullptr),
+                                           Ort::Value(nullptr),
+                                           Ort::Value(nullptr)};
+    std::size_t numInputs = 0;
+    std::array<int64_t, 2> phonemeIdsShape{1, (int64_t)phonemeIds.size()};
+    inputTensors[numInputs++] = Ort::Value::CreateTensor<int64_t>(
         memoryInfo, phonemeIds.data(), phonemeIds.size(), phonemeIdsShape.data(),
-        phonemeIdsShape.size()));
+        phonemeIdsShape.size());
 
-    std::vector<int64_t> phomemeIdLengthsShape{(int64_t)phonemeIdLengths.size()};
-    inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
+    std::array<int64_t, 1> phomemeIdLengthsShape{(int64_t)phonemeIdLengths.size()};
+    inputTensors[numInputs++] = Ort::Value::CreateTensor<int64_t>(
         memoryInfo, phonemeIdLengths.data(), phonemeIdLengths.size(),
-        phomemeIdLengthsShape.data(), phomemeIdLengthsShape.size()));
+        phomemeIdLengthsShape.data(), phomemeIdLengthsShape.size());
 
-    std::vector<int64_t> scalesShape{(int64_t)scales.size()};
-    inputTensors.push_back(
+    std::array<int64_t, 1> scalesShape{(int64_t)scales.size()};
+    inputTensors[numInputs++] =
         Ort::Value::CreateTensor<float>(memoryInfo, scales.data(), scales.size(),
-                                        scalesShape.data(), scalesShape.size()));
+                                        scalesShape.data(), scalesShape.size());
 
     // Add speaker id.
     // NOTE: These must be kept outside the "if" below to avoid being deallocated.
-    std::vector<int64_t> speakerId{
+    std::array<int64_t, 1> speakerId{
         (int64_t)synthesisConfig.speakerId.value_or(0)};
-    std::vector<int64_t> speakerIdShape{(int64_t)speakerId.size()};
+    std::array<int64_t, 1> speakerIdShape{(int64_t)speakerId.size()};
 
     if (synthesisConfig.speakerId)
     {
-      inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
+      inputTensors[numInputs++] = Ort::Value::CreateTensor<int64_t>(
           memoryInfo, speakerId.data(), speakerId.size(), speakerIdShape.data(),
-          speakerIdShape.size()));
+          speakerIdShape.size());
     }
 
     // From export_onnx.py
@@ -435,11 +1441,35 @@ namespace piper
                                               "sid"};
     std::array<const char *, 1> outputNames = {"output"};
 
-    // Infer
-    auto startTime = std::chrono::steady_clock::now();
-    auto outputTensors = session.onnx.Run(
-        Ort::RunOptions{nullptr}, inputNames.data(), inputTensors.data(),
-        inputTensors.size(), outputNames.data(), outputNames.size());
+    // Infer
+    auto startTime = std::chrono::steady_clock::now();
+    Ort::RunOptions runOptions;
+    std::vector<Ort::Value> outputTensors;
+    if (cancelToken)
+    {
+      cancelToken->beginRun(runOptions);
+    }
+
+    try
+    {
+      outputTensors = session.onnx.Run(
+          runOptions, inputNames.data(), inputTensors.data(),
+          numInputs, outputNames.data(), outputNames.size());
+    }
+    catch (const Ort::Exception &)
+    {
+      if (cancelToken)
+      {
+        cancelToken->endRun();
+        cancelToken->check();
+      }
+      throw;
+    }
+
+    if (cancelToken)
+    {
+      cancelToken->endRun();
+    }
     auto endTime = std::chrono::steady_clock::now();
 
     if ((outputTensors.size() != 1) || (!outputTensors.front().IsTensor()))
@@ -453,6 +1483,7 @@ namespace piper
     auto audioShape =
         outputTensors.front().GetTensorTypeAndShapeInfo().GetShape();
     int64_t audioCount = audioShape[audioShape.size() - 1];
+    result.numSamples = (std::size_t)audioCount;
 
     result.audioSeconds = (double)audioCount / (double)synthesisConfig.sampleRate;
     result.realTimeFactor = 0.0;
@@ -464,6 +1495,7 @@ namespace piper
                   result.audioSeconds, result.inferSeconds);
 
     // Get max audio value for scaling
+    startTime = std::chrono::steady_clock::now();
     float maxAudioValue = 0.01f;
     for (int64_t i = 0; i < audioCount; i++)
     {
@@ -474,20 +1506,21 @@ namespace piper
       }
     }
 
-    // We know the size up front
-    audioBuffer.reserve(audioCount);
+    // We know the size up front, so append in place
+    std::size_t audioOffset = audioBuffer.size();
+    audioBuffer.resize(audioOffset + audioCount);
+    int16_t *audioOut = audioBuffer.data() + audioOffset;
 
     // Scale audio to fill range and convert to int16
     float audioScale = (MAX_WAV_VALUE / std::max(0.01f, maxAudioValue));
     for (int64_t i = 0; i < audioCount; i++)
     {
-      int16_t intAudioValue = static_cast<int16_t>(
+      audioOut[i] = static_cast<int16_t>(
           std::clamp(audio[i] * audioScale,
                      static_cast<float>(std::numeric_limits<int16_t>::min()),
                      static_cast<float>(std::numeric_limits<int16_t>::max())));
-
-      audioBuffer.push_back(intAudioValue);
     }
+    result.quantizeSeconds = secondsSince(startTime);
 
     // Clean up
     for (std::size_t i = 0; i < outputTensors.size(); i++)
@@ -495,7 +1528,7 @@ namespace piper
       Ort::detail::OrtRelease(outputTensors[i].release());
     }
 
-    for (std::size_t i = 0; i < inputTensors.size(); i++)
+    for (std::size_t i = 0; i < numInputs; i++)
     {
       Ort::detail::OrtRelease(inputTensors[i].release());
     }
@@ -503,11 +1536,369 @@ namespace piper
 
   // ----------------------------------------------------------------------------
 
+  // Size of per-thread buffer backing request arenas
+  const std::size_t REQUEST_ARENA_SIZE = 256 * 1024;
+
+  // Per-thread backing buffer, reused by each request on that thread
+  thread_local std::vector<std::byte> requestArenaBuffer;
+  thread_local bool requestArenaInUse = false;
+
+  RequestArena::RequestArena()
+  {
+    if (requestArenaInUse)
+    {
+      // Nested arena on the same thread only gets heap memory
+      monotonic.emplace(std::pmr::new_delete_resource());
+      return;
+    }
+
+    requestArenaInUse = true;
+    ownsThreadBuffer = true;
+    requestArenaBuffer.resize(REQUEST_ARENA_SIZE);
+    monotonic.emplace(requestArenaBuffer.data(), requestArenaBuffer.size(),
+                      std::pmr::new_delete_resource());
+  }
+
+  RequestArena::~RequestArena()
+  {
+    monotonic.reset();
+    if (ownsThreadBuffer)
+    {
+      requestArenaInUse = false;
+    }
+  }
+
+  // Phrase within a sentence's phonemes
+  struct PhraseSpan
+  {
+    std::size_t offset;
+    std::size_t length;
+    std::size_t silenceSamples;
+  };
+
+  // Rough speaking rate used to pre-size audio buffers
+  const float ESTIMATED_SECONDS_PER_PHONEME = 0.08f;
+
+  // Estimate number of samples that will be synthesized for a number of
+  // phonemes and sentences, including silence after each sentence.
+  std::size_t estimateAudioSamples(std::size_t numPhonemes,
+                                   std::size_t numSentences,
+                                   std::size_t sentenceSilenceSamples,
+                                   const SynthesisConfig &synthesisConfig)
+  {
+    double phonemeSamples = (double)numPhonemes *
+                            ESTIMATED_SECONDS_PER_PHONEME *
+                            synthesisConfig.lengthScale *
+                            synthesisConfig.sampleRate *
+                            synthesisConfig.channels;
+
+    return (std::size_t)phonemeSamples + (numSentences * sentenceSilenceSamples);
+  }
+
+  std::size_t estimateTextAudioSamples(const std::string &text,
+                                       const Voice &voice,
+                                       const AudioEffects &effects)
+  {
+    std::size_t numCodepoints = 0;
+    std::size_t numSentences = 1;
+    for (char c : text)
+    {
+      if ((c & 0xC0) != 0x80)
+      {
+        numCodepoints++;
+      }
+
+      if ((c == '.') || (c == '?') || (c == '!'))
+      {
+        numSentences++;
+      }
+    }
+
+    const SynthesisConfig &synthesisConfig = voice.synthesisConfig;
+    std::size_t sentenceSilenceSamples = 0;
+    if (synthesisConfig.sentenceSilenceSeconds > 0)
+    {
+      sentenceSilenceSamples =
+          (std::size_t)(synthesisConfig.sentenceSilenceSeconds *
+                        synthesisConfig.sampleRate * synthesisConfig.channels);
+    }
+
+    double numSamples = (double)estimateAudioSamples(
+        numCodepoints, numSentences, sentenceSilenceSamples, synthesisConfig);
+    if (effects.speed > 0)
+    {
+      numSamples /= effects.speed;
+    }
+
+    return (std::size_t)(numSamples *
+                         getOutputChannels(effects, synthesisConfig) /
+                         synthesisConfig.channels);
+  }
+
+  // Phonemize text with espeak-ng, in a helper process if there is a pool
+  static void phonemizeESpeak(PiperConfig &config, Voice &voice,
+                              const std::string &text,
+                              std::vector<std::vector<Phoneme>> &phonemes)
+  {
+#ifndef _WIN32
+    // Workers only have the eSpeak data they were started with. Without
+    // workers left, the in-process eSpeak is used.
+    if (config.phonemizerPool &&
+        (config.phonemizerPool->getDataPath() == config.eSpeakDataPath) &&
+        config.phonemizerPool->phonemize(
+            text, voice.phonemizeConfig.eSpeak.voice, phonemes))
+    {
+      return;
+    }
+#endif
+
+    eSpeakPhonemeConfig eSpeakConfig;
+    eSpeakConfig.voice = voice.phonemizeConfig.eSpeak.voice;
+    phonemize_eSpeak(text, eSpeakConfig, phonemes);
+  }
+
+  // Punctuation that eSpeak keeps as a phoneme at the end of a clause
+  static bool isClausePunctuation(char32_t c)
+  {
+    return (c == '.') || (c == ',') || (c == ';') || (c == ':') ||
+           (c == '?') || (c == '!');
+  }
+
+  static bool isSentenceEnd(char32_t c)
+  {
+    return (c == '.') || (c == '?') || (c == '!');
+  }
+
+  // Word of the text and its phonemes, if it is in the lexicon
+  struct LexiconWord
+  {
+    std::string_view text;
+    std::size_t tokenStart = 0; // offset of the word and its punctuation
+    char punctuation = 0;       // clause punctuation after the word
+    bool found = false;
+    std::size_t phonemeStart = 0;
+    std::size_t phonemeEnd = 0;
+  };
+
+  // Phonemize text using the voice's lexicon. Lexicon words never reach
+  // eSpeak: their phonemes are separated by spaces, clause punctuation after
+  // them is kept, and sentences end at . ? ! like eSpeak's output.
+  //
+  // Each run of text between lexicon words is phonemized by eSpeak as it is,
+  // with its punctuation, so numbers, abbreviations and sentence boundaries
+  // inside the run are eSpeak's. Where a run stops mid-sentence, the period
+  // eSpeak adds at the end of its text is dropped and the sentence continues
+  // with the next lexicon word.
+  //
+  // Returns false without phonemizing if none of the words are in the
+  // lexicon, so such text is left to eSpeak unchanged.
+  static bool phonemizeWithLexicon(PiperConfig &config, Voice &voice,
+                                   const std::string &text,
+                                   std::vector<std::vector<Phoneme>> &phonemes,
+                                   SynthesisResult &result)
+  {
+    // Split at whitespace and strip ASCII punctuation around words
+    std::vector<LexiconWord> words;
+    std::vector<Phoneme> foundPhonemes;
+    std::size_t numHits = 0;
+    std::size_t tokenStart = 0;
+    while (tokenStart < text.size())
+    {
+      if (std::isspace((unsigned char)text[tokenStart]))
+      {
+        tokenStart++;
+        continue;
+      }
+
+      std::size_t tokenEnd = tokenStart;
+      while ((tokenEnd < text.size()) &&
+             !std::isspace((unsigned char)text[tokenEnd]))
+      {
+        tokenEnd++;
+      }
+
+      std::size_t wordEnd = tokenEnd;
+      while ((wordEnd > tokenStart) &&
+             std::ispunct((unsigned char)text[wordEnd - 1]))
+      {
+        wordEnd--;
+      }
+
+      std::size_t wordStart = tokenStart;
+      while ((wordStart < wordEnd) &&
+             std::ispunct((unsigned char)text[wordStart]))
+      {
+        wordStart++;
+      }
+
+      char punctuation = 0;
+      for (std::size_t i = wordEnd; i < tokenEnd; i++)
+      {
+        if (isClausePunctuation(text[i]))
+        {
+          punctuation = text[i];
+          break;
+        }
+      }
+
+      if (wordStart == wordEnd)
+      {
+        // Punctuation only, e.g. "word ?"
+        if ((punctuation != 0) && !words.empty() &&
+            (words.back().punctuation == 0))
+        {
+          words.back().punctuation = punctuation;
+        }
+
+        tokenStart = tokenEnd;
+        continue;
+      }
+
+      LexiconWord &word = words.emplace_back();
+      word.text = std::string_view(text).substr(wordStart, wordEnd - wordStart);
+      word.tokenStart = tokenStart;
+      word.punctuation = punctuation;
+      word.phonemeStart = foundPhonemes.size();
+      word.found = voice.lexicon->lookup(word.text, foundPhonemes);
+      word.phonemeEnd = foundPhonemes.size();
+      if (word.found)
+      {
+        numHits++;
+      }
+
+      tokenStart = tokenEnd;
+    }
+
+    spdlog::debug("Found {} of {} word(s) in lexicon", numHits, words.size());
+
+    result.numLexiconHits += numHits;
+    result.numLexiconMisses += words.size() - numHits;
+    if (numHits == 0)
+    {
+      return false;
+    }
+
+    // Phonemes of the sentence being built
+    std::vector<Phoneme> sentencePhonemes;
+    std::vector<std::vector<Phoneme>> runSentences;
+    for (std::size_t i = 0; i < words.size(); i++)
+    {
+      if (!words[i].found)
+      {
+        // Run of text up to the next lexicon word
+        std::size_t runEnd = i + 1;
+        while ((runEnd < words.size()) && !words[runEnd].found)
+        {
+          runEnd++;
+        }
+
+        std::size_t runTextEnd = (runEnd < words.size())
+                                     ? words[runEnd].tokenStart
+                                     : text.size();
+        std::string_view runText = std::string_view(text).substr(
+            words[i].tokenStart, runTextEnd - words[i].tokenStart);
+        while (!runText.empty() && std::isspace((unsigned char)runText.back()))
+        {
+          runText.remove_suffix(1);
+        }
+
+        runSentences.clear();
+        phonemizeESpeak(config, voice, std::string(runText), runSentences);
+
+        // A run followed by a lexicon word ends its last sentence only if
+        // the text does
+        bool runEndsSentence =
+            (runEnd == words.size()) || isSentenceEnd(runText.back());
+        for (std::size_t s = 0; s < runSentences.size(); s++)
+        {
+          if (!sentencePhonemes.empty() && (sentencePhonemes.back() != U' '))
+          {
+            sentencePhonemes.push_back(U' ');
+          }
+          sentencePhonemes.insert(sentencePhonemes.end(),
+                                  runSentences[s].begin(),
+                                  runSentences[s].end());
+
+          if (((s + 1) < runSentences.size()) || runEndsSentence)
+          {
+            phonemes.push_back(std::move(sentencePhonemes));
+            sentencePhonemes.clear();
+            continue;
+          }
+
+          // Sentence continues with the next lexicon word. Keep the run's
+          // own clause punctuation, drop the period eSpeak added.
+          while (!sentencePhonemes.empty() &&
+                 ((sentencePhonemes.back() == U' ') ||
+                  isClausePunctuation(sentencePhonemes.back())))
+          {
+            sentencePhonemes.pop_back();
+          }
+
+          if (isClausePunctuation(runText.back()))
+          {
+            sentencePhonemes.push_back((Phoneme)runText.back());
+          }
+        }
+
+        i = runEnd - 1;
+        continue;
+      }
+
+      LexiconWord &word = words[i];
+      if (!sentencePhonemes.empty() && (sentencePhonemes.back() != U' '))
+      {
+        sentencePhonemes.push_back(U' ');
+      }
+      sentencePhonemes.insert(sentencePhonemes.end(),
+                              foundPhonemes.begin() + word.phonemeStart,
+                              foundPhonemes.begin() + word.phonemeEnd);
+
+      if (word.punctuation != 0)
+      {
+        sentencePhonemes.push_back((Phoneme)word.punctuation);
+        if (isSentenceEnd(word.punctuation))
+        {
+          phonemes.push_back(std::move(sentencePhonemes));
+          sentencePhonemes.clear();
+        }
+        else
+        {
+          sentencePhonemes.push_back(U' ');
+        }
+      }
+    }
+
+    // Like eSpeak, the last sentence ends with punctuation
+    while (!sentencePhonemes.empty() && (sentencePhonemes.back() == U' '))
+    {
+      sentencePhonemes.pop_back();
+    }
+
+    if (!sentencePhonemes.empty())
+    {
+      if (!isClausePunctuation(sentencePhonemes.back()))
+      {
+        sentencePhonemes.push_back(U'.');
+      }
+      phonemes.push_back(std::move(sentencePhonemes));
+    }
+
+    return true;
+  }
+
   // Phonemize text and synthesize audio
   void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                    std::vector<int16_t> &audioBuffer, SynthesisResult &result,
-                   const std::function<void()> &audioCallback)
+                   const std::function<void()> &audioCallback,
+                   std::pmr::memory_resource *arena,
+                   const SentenceCallback &sentenceCallback,
+                   CancelToken *cancelToken)
   {
+    if (cancelToken)
+    {
+      cancelToken->check();
+    }
 
     std::size_t sentenceSilenceSamples = 0;
     if (voice.synthesisConfig.sentenceSilenceSeconds > 0)
@@ -525,19 +1916,25 @@ namespace piper
       }
 
       spdlog::debug("Diacritizing text with libtashkeel: {}", text);
+      auto startTime = std::chrono::steady_clock::now();
       text = tashkeel::tashkeel_run(text, *config.tashkeelState);
+      result.tashkeelSeconds += secondsSince(startTime);
     }
 
     // Phonemes for each sentence
     spdlog::debug("Phonemizing text: {}", text);
     std::vector<std::vector<Phoneme>> phonemes;
+    auto phonemizeStartTime = std::chrono::steady_clock::now();
 
     if (voice.phonemizeConfig.phonemeType == eSpeakPhonemes)
     {
-      // Use espeak-ng for phonemization
-      eSpeakPhonemeConfig eSpeakConfig;
-      eSpeakConfig.voice = voice.phonemizeConfig.eSpeak.voice;
-      phonemize_eSpeak(text, eSpeakConfig, phonemes);
+      // Use the voice's lexicon if it has any of the words, otherwise
+      // espeak-ng for phonemization
+      if (!voice.lexicon ||
+          !phonemizeWithLexicon(config, voice, text, phonemes, result))
+      {
+        phonemizeESpeak(config, voice, text, phonemes);
+      }
     }
     else
     {
@@ -545,10 +1942,73 @@ namespace piper
       CodepointsPhonemeConfig codepointsConfig;
       phonemize_codepoints(text, codepointsConfig, phonemes);
     }
+    result.phonemizeSeconds += secondsSince(phonemizeStartTime);
+
+    // Reserve audio buffer once up front: for the whole text, or for the
+    // longest sentence if the buffer is handed off after each sentence.
+    std::size_t numPhonemes = 0;
+    std::size_t maxSentencePhonemes = 0;
+    for (auto &sentencePhonemes : phonemes)
+    {
+      numPhonemes += sentencePhonemes.size();
+      maxSentencePhonemes =
+          std::max(maxSentencePhonemes, sentencePhonemes.size());
+    }
+    result.numPhonemes += numPhonemes;
+
+    if (audioCallback)
+    {
+      audioBuffer.reserve(estimateAudioSamples(maxSentencePhonemes, 1,
+                                               sentenceSilenceSamples,
+                                               voice.synthesisConfig));
+    }
+    else
+    {
+      audioBuffer.reserve(
+          audioBuffer.size() +
+          estimateAudioSamples(numPhonemes, phonemes.size(),
+                               sentenceSilenceSamples, voice.synthesisConfig));
+    }
+
+    // Use phoneme/id map from config without copying it
+    PhonemeIdConfig idConfig;
+    idConfig.phonemeIdMap = std::shared_ptr<PhonemeIdMap>(
+        &voice.phonemizeConfig.phonemeIdMap, [](PhonemeIdMap *) {});
+
+    // Dense bitmap of phonemes that end a phrase (phoneme silence)
+    std::pmr::vector<uint64_t> phraseBreakBits(arena);
+    std::pmr::map<Phoneme, std::size_t> phraseBreakSamples(arena);
+    if (voice.synthesisConfig.phonemeSilenceSeconds)
+    {
+      for (auto &[phoneme, silenceSeconds] :
+           *voice.synthesisConfig.phonemeSilenceSeconds)
+      {
+        std::size_t word = phoneme / 64;
+        if (word >= phraseBreakBits.size())
+        {
+          phraseBreakBits.resize(word + 1, 0);
+        }
+
+        phraseBreakBits[word] |= (uint64_t)1 << (phoneme % 64);
+        phraseBreakSamples[phoneme] =
+            (std::size_t)(silenceSeconds * voice.synthesisConfig.sampleRate *
+                          voice.synthesisConfig.channels);
+      }
+    }
+
+    auto isPhraseBreak = [&phraseBreakBits](Phoneme phoneme)
+    {
+      std::size_t word = phoneme / 64;
+      return (word < phraseBreakBits.size()) &&
+             ((phraseBreakBits[word] >> (phoneme % 64)) & 1);
+    };
 
     // Synthesize each sentence independently.
     std::vector<PhonemeId> phonemeIds;
     std::map<Phoneme, std::size_t> missingPhonemes;
+    std::pmr::vector<PhraseSpan> phrases(arena);
+    std::vector<Phoneme> phrasePhonemes;
+    std::size_t remainingPhonemes = numPhonemes;
     for (auto phonemesIter = phonemes.begin(); phonemesIter != phonemes.end();
          ++phonemesIter)
     {
@@ -567,73 +2027,46 @@ namespace piper
                       sentencePhonemes.size(), phonemesStr);
       }
 
-      std::vector<std::shared_ptr<std::vector<Phoneme>>> phrasePhonemes;
-      std::vector<SynthesisResult> phraseResults;
-      std::vector<size_t> phraseSilenceSamples;
-
-      // Use phoneme/id map from config
-      PhonemeIdConfig idConfig;
-      idConfig.phonemeIdMap =
-          std::make_shared<PhonemeIdMap>(voice.phonemizeConfig.phonemeIdMap);
-
-      if (voice.synthesisConfig.phonemeSilenceSeconds)
+      // Split into phrases at phonemes with extra silence
+      phrases.clear();
+      std::size_t phraseStart = 0;
+      for (std::size_t i = 0; i < sentencePhonemes.size(); i++)
       {
-        // Split into phrases
-        std::map<Phoneme, float> &phonemeSilenceSeconds =
-            *voice.synthesisConfig.phonemeSilenceSeconds;
-
-        auto currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
-        phrasePhonemes.push_back(currentPhrasePhonemes);
-
-        for (auto sentencePhonemesIter = sentencePhonemes.begin();
-             sentencePhonemesIter != sentencePhonemes.end();
-             sentencePhonemesIter++)
+        if (isPhraseBreak(sentencePhonemes[i]))
         {
-          Phoneme &currentPhoneme = *sentencePhonemesIter;
-          currentPhrasePhonemes->push_back(currentPhoneme);
-
-          if (phonemeSilenceSeconds.count(currentPhoneme) > 0)
-          {
-            // Split at phrase boundary
-            phraseSilenceSamples.push_back(
-                (std::size_t)(phonemeSilenceSeconds[currentPhoneme] *
-                              voice.synthesisConfig.sampleRate *
-                              voice.synthesisConfig.channels));
-
-            currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
-            phrasePhonemes.push_back(currentPhrasePhonemes);
-          }
+          phrases.push_back({phraseStart, i + 1 - phraseStart,
+                             phraseBreakSamples[sentencePhonemes[i]]});
+          phraseStart = i + 1;
         }
       }
-      else
-      {
-        // Use all phonemes
-        phrasePhonemes.push_back(
-            std::make_shared<std::vector<Phoneme>>(sentencePhonemes));
-      }
-
-      // Ensure results/samples are the same size
-      while (phraseResults.size() < phrasePhonemes.size())
-      {
-        phraseResults.emplace_back();
-      }
 
-      while (phraseSilenceSamples.size() < phrasePhonemes.size())
-      {
-        phraseSilenceSamples.push_back(0);
-      }
+      phrases.push_back(
+          {phraseStart, sentencePhonemes.size() - phraseStart, 0});
 
       // phonemes -> ids -> audio
-      for (size_t phraseIdx = 0; phraseIdx < phrasePhonemes.size(); phraseIdx++)
+      for (auto &phrase : phrases)
       {
-        if (phrasePhonemes[phraseIdx]->size() <= 0)
+        if (phrase.length == 0)
         {
           continue;
         }
 
+        // Whole sentence is used directly, otherwise the phrase is copied
+        // into a buffer that is reused for every phrase.
+        const std::vector<Phoneme> *currentPhonemes = &sentencePhonemes;
+        if (phrase.length != sentencePhonemes.size())
+        {
+          auto phraseBegin = sentencePhonemes.begin() + phrase.offset;
+          phrasePhonemes.assign(phraseBegin, phraseBegin + phrase.length);
+          currentPhonemes = &phrasePhonemes;
+        }
+
         // phonemes -> ids
-        phonemes_to_ids(*(phrasePhonemes[phraseIdx]), idConfig, phonemeIds,
+        auto idStartTime = std::chrono::steady_clock::now();
+        phonemes_to_ids(*currentPhonemes, idConfig, phonemeIds,
                         missingPhonemes);
+        result.phonemeIdSeconds += secondsSince(idStartTime);
+        result.numPhonemeIds += phonemeIds.size();
         if (spdlog::should_log(spdlog::level::debug))
         {
           // DEBUG log for phoneme ids
@@ -644,34 +2077,33 @@ namespace piper
           }
 
           spdlog::debug("Converted {} phoneme(s) to {} phoneme id(s): {}",
-                        phrasePhonemes[phraseIdx]->size(), phonemeIds.size(),
+                        phrase.length, phonemeIds.size(),
                         phonemeIdsStr.str());
         }
 
         // ids -> audio
+        if (cancelToken)
+        {
+          cancelToken->check();
+        }
+
+        SynthesisResult phraseResult;
         synthesize(phonemeIds, voice.synthesisConfig, voice.session, audioBuffer,
-                   phraseResults[phraseIdx]);
+                   phraseResult, cancelToken);
 
         // Add end of phrase silence
-        for (std::size_t i = 0; i < phraseSilenceSamples[phraseIdx]; i++)
-        {
-          audioBuffer.push_back(0);
-        }
+        audioBuffer.resize(audioBuffer.size() + phrase.silenceSamples, 0);
 
-        result.audioSeconds += phraseResults[phraseIdx].audioSeconds;
-        result.inferSeconds += phraseResults[phraseIdx].inferSeconds;
+        result.audioSeconds += phraseResult.audioSeconds;
+        result.inferSeconds += phraseResult.inferSeconds;
+        result.quantizeSeconds += phraseResult.quantizeSeconds;
+        result.numSamples += phraseResult.numSamples;
 
         phonemeIds.clear();
       }
 
       // Add end of sentence silence
-      if (sentenceSilenceSamples > 0)
-      {
-        for (std::size_t i = 0; i < sentenceSilenceSamples; i++)
-        {
-          audioBuffer.push_back(0);
-        }
-      }
+      audioBuffer.resize(audioBuffer.size() + sentenceSilenceSamples, 0);
 
       if (audioCallback)
       {
@@ -681,6 +2113,12 @@ namespace piper
       }
 
       phonemeIds.clear();
+
+      remainingPhonemes -= sentencePhonemes.size();
+      if (sentenceCallback && (std::next(phonemesIter) != phonemes.end()))
+      {
+        sentenceCallback(remainingPhonemes);
+      }
     }
 
     if (missingPhonemes.size() > 0)
@@ -705,14 +2143,22 @@ namespace piper
   } /* textToAudio */
 
 
-  void speed_effect(std::vector<int16_t>& audioBuffer, float speed) {
+  // Resample in place; the original audio is kept in request scratch memory
+  void speed_effect(std::vector<int16_t>& audioBuffer, float speed,
+                    std::pmr::memory_resource *arena) {
       if (speed <= 0) {
           throw std::invalid_argument("Speed must be greater than 0");
       }
 
       size_t originalSize = audioBuffer.size();
       size_t newSize = static_cast<size_t>(originalSize / speed);
-      std::vector<int16_t> newBuffer(newSize);
+      if (newSize == 0) {
+          audioBuffer.clear();
+          return;
+      }
+
+      std::pmr::vector<int16_t> input(audioBuffer.begin(), audioBuffer.end(), arena);
+      audioBuffer.resize(newSize);
 
       // Resample the audio
       for (size_t i = 0; i < newSize; ++i) {
@@ -722,28 +2168,25 @@ namespace piper
 
           if (index + 1 < originalSize) {
               // Linear interpolation
-              newBuffer[i] = static_cast<int16_t>(
-                  audioBuffer[index] * (1 - fraction) + audioBuffer[index + 1] * fraction
+              audioBuffer[i] = static_cast<int16_t>(
+                  input[index] * (1 - fraction) + input[index + 1] * fraction
               );
           } else {
-              newBuffer[i] = audioBuffer[index]; // Last sample
+              audioBuffer[i] = input[index]; // Last sample
           }
       }
 
       // Normalize the audio
-      int16_t maxAmplitude = *std::max_element(newBuffer.begin(), newBuffer.end(), [](int16_t a, int16_t b) {
+      int16_t maxAmplitude = *std::max_element(audioBuffer.begin(), audioBuffer.end(), [](int16_t a, int16_t b) {
           return std::abs(a) < std::abs(b);
       });
 
       if (maxAmplitude > 0) {
           float normalizationFactor = 32767.0f / maxAmplitude;
-          for (auto& sample : newBuffer) {
+          for (auto& sample : audioBuffer) {
               sample = static_cast<int16_t>(sample * normalizationFactor);
           }
       }
-
-      // Replace the original buffer with the new buffer
-      audioBuffer = std::move(newBuffer);
   }
 
   // Function to adjust volume of audio buffer
@@ -765,43 +2208,77 @@ namespace piper
       }
   }
 
-  void pitch_effect(std::vector<int16_t>& audioBuffer, float semitones) {
-    using namespace soundtouch;
+  // Maximum number of configured SoundTouch processors kept per thread
+  const std::size_t MAX_PITCH_PROCESSORS = 16;
+
+  // SoundTouch processors are expensive to construct, so each worker thread
+  // keeps its configured instances around for the next request.
+  soundtouch::SoundTouch &getPitchProcessor(int sampleRate, int channels,
+                                            float semitones) {
+    using PitchProcessorKey = std::tuple<int, int, float>;
+    thread_local std::map<PitchProcessorKey,
+                          std::unique_ptr<soundtouch::SoundTouch>>
+        pitchProcessors;
+
+    PitchProcessorKey key{sampleRate, channels, semitones};
+    auto processorIter = pitchProcessors.find(key);
+    if (processorIter == pitchProcessors.end()) {
+      if (pitchProcessors.size() >= MAX_PITCH_PROCESSORS) {
+        // Avoid unbounded growth with many distinct pitch values
+        pitchProcessors.clear();
+      }
+
+      auto soundTouch = std::make_unique<soundtouch::SoundTouch>();
+      soundTouch->setSampleRate(sampleRate);
+      soundTouch->setChannels(channels);
+      soundTouch->setPitchSemiTones(semitones);
+      processorIter =
+          pitchProcessors.emplace(key, std::move(soundTouch)).first;
+    }
+
+    return *processorIter->second;
+  }
 
+  // Float samples for SoundTouch live in request scratch memory
+  void pitch_effect(std::vector<int16_t>& audioBuffer, float semitones,
+                    int sampleRate, int channels,
+                    std::pmr::memory_resource *arena) {
     if (semitones < -12.0f || semitones > 12.0f) {
         throw std::invalid_argument("Semitones should be within the range of -12 to 12.");
     }
 
-    // Create SoundTouch processor
-    SoundTouch soundTouch;
-    soundTouch.setSampleRate(22050);
-    soundTouch.setChannels(1); // Mono audio, modify if stereo
-    soundTouch.setPitchSemiTones(semitones);
+    if (audioBuffer.empty()) {
+        return;
+    }
+
+    soundtouch::SoundTouch &soundTouch =
+        getPitchProcessor(sampleRate, channels, semitones);
 
-    // Feed data into SoundTouch
+    // Convert to float for processing
     size_t numSamples = audioBuffer.size();
-    std::vector<float> floatBuffer(numSamples); // Convert to float for processing
+    size_t numFrames = numSamples / channels;
+    std::pmr::vector<float> floatBuffer(numSamples, arena);
     for (size_t i = 0; i < numSamples; ++i) {
         floatBuffer[i] = static_cast<float>(audioBuffer[i]) / 32768.0f;
     }
 
-    soundTouch.putSamples(floatBuffer.data(), numSamples);
+    // Processor may still hold samples from a failed request
+    soundTouch.clear();
+    soundTouch.putSamples(floatBuffer.data(), numFrames);
 
-    // Retrieve processed samples
-    std::vector<float> processedFloatBuffer;
-    size_t maxBufferSize = 1024; // Chunk size for retrieval
-    std::vector<float> tempBuffer(maxBufferSize);
+    // Push the remaining samples through the processing pipeline
+    soundTouch.flush();
 
-    size_t samplesReceived;
-    do {
-        samplesReceived = soundTouch.receiveSamples(tempBuffer.data(), maxBufferSize);
-        processedFloatBuffer.insert(processedFloatBuffer.end(), tempBuffer.begin(), tempBuffer.begin() + samplesReceived);
-    } while (samplesReceived != 0);
+    // Pitch shifting keeps the duration, so drop the padding from flush()
+    size_t outputFrames = std::min<size_t>(soundTouch.numSamples(), numFrames);
+    floatBuffer.resize(outputFrames * channels);
+    soundTouch.receiveSamples(floatBuffer.data(), outputFrames);
+    soundTouch.clear();
 
     // Convert back to int16_t
-    audioBuffer.resize(processedFloatBuffer.size());
-    for (size_t i = 0; i < processedFloatBuffer.size(); ++i) {
-        audioBuffer[i] = static_cast<int16_t>(std::clamp(processedFloatBuffer[i] * 32768.0f, -32768.0f, 32767.0f));
+    audioBuffer.resize(floatBuffer.size());
+    for (size_t i = 0; i < floatBuffer.size(); ++i) {
+        audioBuffer[i] = static_cast<int16_t>(std::clamp(floatBuffer[i] * 32768.0f, -32768.0f, 32767.0f));
     }
   }
 
@@ -830,16 +2307,18 @@ namespace piper
       }
   }
 
-  // Butterworth bandpass filter function
-  std::vector<int16_t> butter_bandpass_filter(const std::vector<int16_t>& data,
-                                            double lowFreq, double highFreq, double fs, int order = 5) {
+  // Butterworth bandpass filter function (in place).
+  // The unfiltered input is kept in request scratch memory.
+  void butter_bandpass_filter(std::vector<int16_t>& data, double lowFreq,
+                              double highFreq, double fs,
+                              std::pmr::memory_resource *arena, int order = 5) {
       // Compute filter coefficients
       Eigen::VectorXd b, a;
       butter_params(lowFreq, highFreq, fs, order, b, a);
 
       // Apply the filter using convolution
       size_t dataSize = data.size();
-      std::vector<int16_t> filtered(dataSize, 0.0);
+      std::pmr::vector<int16_t> input(data.begin(), data.end(), arena);
 
       // Convolution loop (FIR/IIR filtering)
       for (size_t n = 0; n < dataSize; ++n) {
@@ -847,23 +2326,21 @@ namespace piper
 
           // Apply numerator (b coefficients)
           for (int i = 0; i < b.size(); ++i) {
-              if (n >= i) yn += b[i] * data[n - i];
+              if (n >= (size_t)i) yn += b[i] * input[n - i];
           }
 
           // Apply denominator (a coefficients, skip a[0])
           for (int i = 1; i < a.size(); ++i) {
-              if (n >= i) yn -= a[i] * filtered[n - i];
+              if (n >= (size_t)i) yn -= a[i] * data[n - i];
           }
 
-          filtered[n] = yn;
+          data[n] = yn;
       }
-
-      return filtered;
   }
 
-  // Normalize audio data
-  std::vector<int16_t> normalize_audio(const std::vector<int16_t>& sound,
-                                      double headroom = 0.1, double maxPossibleAmp = std::pow(2.0, 15)) {
+  // Normalize audio data (in place)
+  void normalize_audio(std::vector<int16_t>& sound, double headroom = 0.1,
+                       double maxPossibleAmp = std::pow(2.0, 15)) {
     if (sound.empty()) {
         throw std::runtime_error("Sound data is empty and cannot be normalized.");
     }
@@ -876,23 +2353,21 @@ namespace piper
 
     // If the max amplitude is 0, the signal is silent
     if (maxAmp == 0 || maxAmp == -std::numeric_limits<double>::infinity()) {
-        return sound;  // Return the original silent signal
+        return;  // Keep the original silent signal
     }
 
     // Calculate the target amplitude based on the headroom and maximum possible amplitude
     double targetAmp = maxPossibleAmp * std::pow(10.0, -headroom / 20.0);
 
     // Normalize the sound data
-    std::vector<int16_t> normalizedSound = sound;
-    for (auto& sample : normalizedSound) {
+    for (auto& sample : sound) {
         sample = static_cast<int16_t>(std::clamp(static_cast<int>(sample * targetAmp / maxAmp), -32768, 32767));
     }
-
-    return normalizedSound;
   }
 
   // Function to apply telephone effect
-  void telephone_effect(std::vector<int16_t>& audioBuffer) {
+  void telephone_effect(std::vector<int16_t>& audioBuffer, int sampleRate,
+                        std::pmr::memory_resource *arena) {
     // Constants for telephone effect
     const bool normalize = true;
     const double lowFreq = 300.0;
@@ -904,11 +2379,11 @@ namespace piper
     }
 
     // Apply Butterworth bandpass filter
-    audioBuffer = butter_bandpass_filter(audioBuffer, lowFreq, highFreq, 22050, filterOrder);
+    butter_bandpass_filter(audioBuffer, lowFreq, highFreq, sampleRate, arena, filterOrder);
 
     // Normalize audio if requested
     if (normalize) {
-        audioBuffer = normalize_audio(audioBuffer);
+        normalize_audio(audioBuffer);
     }
 
     // Clamp values to the int16 range (-32768 to 32767)
@@ -980,102 +2455,247 @@ namespace piper
       }
   }
 
-  // Function to apply stereo effect
-  void stereo_effect(std::vector<int16_t>& audioBuffer) {
-      // Convert mono to stereo
-      std::vector<int16_t> stereoBuffer;
-      for (auto sample : audioBuffer) {
-          stereoBuffer.push_back(sample);
-          stereoBuffer.push_back(sample);
+  // Maximum delay between channels for the Haas effect
+  const float MAX_HAAS_DELAY_MS = 40.0f;
+
+  int getOutputChannels(const AudioEffects &effects,
+                        const SynthesisConfig &synthesisConfig)
+  {
+    if (effects.channels > 1)
+    {
+      return effects.channels;
+    }
+
+    if (effects.stereo)
+    {
+      return 2;
+    }
+
+    return synthesisConfig.channels;
+  }
+
+  // Function to lay out mono audio as interleaved multi-channel audio.
+  // The first two channels are panned with the sine law, scaled so the louder
+  // channel keeps the original level (never boosted, so full-scale speech
+  // does not clip). The far channel is optionally delayed (Haas effect). Any
+  // extra channels get the centered signal.
+  void channel_layout_effect(std::vector<int16_t>& audioBuffer, int channels,
+                             float pan, float haasDelayMs, int sampleRate) {
+      if (channels < 1 || channels > 8) {
+          throw std::invalid_argument("Channels should be within the range of 1 to 8.");
+      }
+
+      if (pan < -1.0f || pan > 1.0f) {
+          throw std::invalid_argument("Pan should be within the range of -1 to 1.");
+      }
+
+      if (haasDelayMs < 0.0f || haasDelayMs > MAX_HAAS_DELAY_MS) {
+          throw std::invalid_argument("Haas delay should be within the range of 0 to 40 ms.");
+      }
+
+      if (channels == 1) {
+          return;
+      }
+
+      // Sine law panning, normalized so neither gain exceeds 1
+      // (centered pan keeps the original level on both channels)
+      const float panAngle = (pan + 1.0f) * 0.78539816f; // pi / 4
+      const float peakGain = std::max(std::cos(panAngle), std::sin(panAngle));
+      const float gains[2] = {std::cos(panAngle) / peakGain,
+                              std::sin(panAngle) / peakGain};
+
+      // Delay the channel facing away from the source
+      std::size_t delayFrames[2] = {0, 0};
+      std::size_t haasFrames = static_cast<std::size_t>(haasDelayMs * sampleRate / 1000.0f);
+      delayFrames[(pan < 0.0f) ? 1 : 0] = haasFrames;
+
+      // Interleave in place from back to front: frame i is written at
+      // i * channels and only reads mono samples at or before i, which are
+      // not overwritten until frames before i are laid out.
+      std::size_t numFrames = audioBuffer.size();
+      audioBuffer.resize(numFrames * channels);
+      for (std::size_t frame = numFrames; frame-- > 0;) {
+          int16_t centered = audioBuffer[frame];
+          int16_t panned[2] = {0, 0};
+          for (int channel = 0; channel < 2; ++channel) {
+              if (frame < delayFrames[channel]) {
+                  continue;
+              }
+
+              float sample = audioBuffer[frame - delayFrames[channel]] * gains[channel];
+              panned[channel] = static_cast<int16_t>(std::clamp(sample, -32768.0f, 32767.0f));
+          }
+
+          int16_t *out = audioBuffer.data() + (frame * channels);
+          out[0] = panned[0];
+          out[1] = panned[1];
+          for (int channel = 2; channel < channels; ++channel) {
+              out[channel] = centered;
+          }
       }
-      audioBuffer = std::move(stereoBuffer);
   }
 
-  void applyEffects(std::vector<int16_t> &audioBuffer, AudioEffects &effects)
+  void applyEffects(std::vector<int16_t> &audioBuffer, AudioEffects &effects,
+                    SynthesisConfig &synthesisConfig,
+                    std::pmr::memory_resource *arena, SynthesisResult &result)
   {
+    auto effectsStartTime = std::chrono::steady_clock::now();
+
+    // Run effect and record its time under name
+    auto timeEffect = [&result](const char *name, auto &&effect)
+    {
+      auto startTime = std::chrono::steady_clock::now();
+      effect();
+      result.effectSeconds[name] += secondsSince(startTime);
+    };
+
     if (effects.speed != 1.0f)
     {
       spdlog::debug("Applying speed effect: {}", effects.speed);
-      speed_effect(audioBuffer, effects.speed);
+      timeEffect("speed", [&]() { speed_effect(audioBuffer, effects.speed, arena); });
     }
     if (effects.volume != 0.0f)
     {
       spdlog::debug("Applying volume effect: {}", effects.volume);
-      volume_effect(audioBuffer, effects.volume);
+      timeEffect("volume", [&]() { volume_effect(audioBuffer, effects.volume); });
     }
     if (effects.semitones != 0.0f)
     {
       spdlog::debug("Applying pitch effect: {}", effects.semitones);
-      pitch_effect(audioBuffer, effects.semitones);
+      timeEffect("pitch", [&]() {
+        pitch_effect(audioBuffer, effects.semitones, synthesisConfig.sampleRate,
+                     synthesisConfig.channels, arena);
+      });
     }
     if (effects.telephone)
     {
       spdlog::debug("Applying telephone effect");
-      telephone_effect(audioBuffer);
+      timeEffect("telephone", [&]() {
+        telephone_effect(audioBuffer, synthesisConfig.sampleRate, arena);
+      });
     }
     if (effects.cave)
     {
       spdlog::debug("Applying cave effect");
-      cave_effect(audioBuffer);
+      timeEffect("cave", [&]() { cave_effect(audioBuffer); });
     }
     if (effects.smallCave)
     {
       spdlog::debug("Applying small cave effect");
-      small_cave_effect(audioBuffer);
+      timeEffect("smallCave", [&]() { small_cave_effect(audioBuffer); });
     }
     if (effects.gasMask)
     {
       spdlog::debug("Applying gas mask effect");
-      gas_mask_effect(audioBuffer);
+      timeEffect("gasMask", [&]() { gas_mask_effect(audioBuffer); });
     }
     if (effects.badReception)
     {
       spdlog::debug("Applying bad reception effect");
-      bad_reception_effect(audioBuffer);
+      timeEffect("badReception", [&]() { bad_reception_effect(audioBuffer); });
     }
     if (effects.nextRoom)
     {
       spdlog::debug("Applying next room effect");
-      next_room_effect(audioBuffer);
+      timeEffect("nextRoom", [&]() { next_room_effect(audioBuffer); });
     }
     if (effects.alien)
     {
       spdlog::debug("Applying alien effect");
-      alien_effect(audioBuffer);
+      timeEffect("alien", [&]() { alien_effect(audioBuffer); });
     }
     if (effects.alien2)
     {
       spdlog::debug("Applying alien2 effect");
-      alien2_effect(audioBuffer);
+      timeEffect("alien2", [&]() { alien2_effect(audioBuffer); });
     }
-    if (effects.stereo)
+    int outputChannels = getOutputChannels(effects, synthesisConfig);
+    if (outputChannels != synthesisConfig.channels)
     {
-      spdlog::debug("Applying stereo effect");
-      stereo_effect(audioBuffer);
+      spdlog::debug("Applying channel layout: channels={}, pan={}, haasDelayMs={}",
+                    outputChannels, effects.pan, effects.haasDelayMs);
+      timeEffect("channelLayout", [&]() {
+        channel_layout_effect(audioBuffer, outputChannels, effects.pan,
+                              effects.haasDelayMs, synthesisConfig.sampleRate);
+      });
     }
+
+    result.effectsSeconds += secondsSince(effectsStartTime);
   }
 
 
-  // Phonemize text and synthesize audio to WAV file
+  bool hasUtteranceEffects(const AudioEffects &effects)
+  {
+    return (effects.speed != 1.0f) || (effects.semitones != 0.0f) ||
+           effects.telephone || (effects.haasDelayMs > 0.0f);
+  }
+
+  // Phonemize text and synthesize audio to WAV file.
+  // Audio is written one sentence at a time, so memory use does not grow with
+  // the length of the text (unless effects need the whole utterance).
   void textToWavFile(PiperConfig &config, Voice &voice, std::string text, AudioEffects &effects,
-                     std::ostream &audioFile, SynthesisResult &result)
+                     std::ostream &audioFile, SynthesisResult &result,
+                     std::pmr::memory_resource *arena)
   {
+    auto encoder = createEncoder(OUTPUT_FORMAT_WAV);
+    textToEncodedAudio(config, voice, text, effects, *encoder, audioFile,
+                       result, arena);
+
+  } /* textToWavFile */
 
+  // Phonemize text, synthesize audio, and encode it one sentence at a time
+  void textToEncodedAudio(PiperConfig &config, Voice &voice, std::string text,
+                          AudioEffects &effects, AudioEncoder &encoder,
+                          std::ostream &audioFile, SynthesisResult &result,
+                          std::pmr::memory_resource *arena,
+                          const SentenceCallback &sentenceCallback,
+                          CancelToken *cancelToken)
+  {
     std::vector<int16_t> audioBuffer;
-    textToAudio(config, voice, text, audioBuffer, result, NULL);
+    int channels = getOutputChannels(effects, voice.synthesisConfig);
 
-    // Apply effect
-    applyEffects(audioBuffer, effects);
+    auto startTime = std::chrono::steady_clock::now();
+    encoder.begin(voice.synthesisConfig.sampleRate, channels, audioFile);
+    auto endTime = std::chrono::steady_clock::now();
+    result.encodeSeconds +=
+        std::chrono::duration<double>(endTime - startTime).count();
 
-    // Write WAV
-    auto synthesisConfig = voice.synthesisConfig;
-    writeWavHeader(synthesisConfig.sampleRate, synthesisConfig.sampleWidth,
-                   synthesisConfig.channels, (int32_t)audioBuffer.size(),
-                   audioFile);
+    auto encodeAudio = [&audioBuffer, &effects, &voice, &encoder, &audioFile,
+                        &result, arena]()
+    {
+      if (audioBuffer.empty())
+      {
+        return;
+      }
 
-    audioFile.write((const char *)audioBuffer.data(),
-                    sizeof(int16_t) * audioBuffer.size());
+      applyEffects(audioBuffer, effects, voice.synthesisConfig, arena, result);
 
-  } /* textToWavFile */
+      auto startTime = std::chrono::steady_clock::now();
+      encoder.encode(audioBuffer.data(), audioBuffer.size(), audioFile);
+      auto endTime = std::chrono::steady_clock::now();
+      result.encodeSeconds +=
+          std::chrono::duration<double>(endTime - startTime).count();
+    };
+
+    if (hasUtteranceEffects(effects))
+    {
+      // Effects see the whole utterance, so it is encoded at the end
+      textToAudio(config, voice, text, audioBuffer, result, nullptr, arena,
+                  sentenceCallback, cancelToken);
+      encodeAudio();
+    }
+    else
+    {
+      textToAudio(config, voice, text, audioBuffer, result, encodeAudio,
+                  arena, sentenceCallback, cancelToken);
+    }
+
+    startTime = std::chrono::steady_clock::now();
+    encoder.end(audioFile);
+    endTime = std::chrono::steady_clock::now();
+    result.encodeSeconds +=
+        std::chrono::duration<double>(endTime - startTime).count();
+
+  } /* textToEncodedAudio */
 
 } // namespace piper
@@ -1,11 +1,20 @@
 #ifndef PIPER_H_
 #define PIPER_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <onnxruntime_cxx_api.h>
@@ -13,6 +22,7 @@
 #include <piper-phonemize/phonemize.hpp>
 #include <piper-phonemize/tashkeel.hpp>
 
+#include "encoder.hpp"
 #include "json.hpp"
 
 using json = nlohmann::json;
@@ -25,10 +35,19 @@ struct eSpeakConfig {
   std::string voice = "en-us";
 };
 
+class PhonemizerPool;
+
 struct PiperConfig {
   std::string eSpeakDataPath;
   bool useESpeak = true;
 
+  // eSpeak helper processes (POSIX only), used while their data path
+  // matches eSpeakDataPath. Not created or destroyed by initialize/terminate.
+  std::shared_ptr<PhonemizerPool> phonemizerPool;
+
+  // Load <model>.int8.onnx (CPU) or <model>.fp16.onnx (CUDA) when present
+  bool useQuantizedModel = true;
+
   bool useTashkeel = false;
   std::optional<std::string> tashkeelModelPath;
   std::unique_ptr<tashkeel::State> tashkeelState;
@@ -48,7 +67,10 @@ struct AudioEffects {
   bool nextRoom = false; // Apply next room effect
   bool alien = false; // Apply alien effect
   bool alien2 = false; // Apply alien2 effect
-  bool stereo = false; // Apply stereo effect
+  bool stereo = false; // Apply stereo effect (same as channels = 2)
+  int channels = 1; // Number of interleaved output channels
+  float pan = 0.0f; // Stereo position from -1 (left) to 1 (right)
+  float haasDelayMs = 0.0f; // Delay of the far channel for spatialization
 };
 
 enum PhonemeType { eSpeakPhonemes, TextPhonemes };
@@ -94,7 +116,60 @@ struct ModelConfig {
 
 
 
+// Read-only memory mapping of a file.
+// Pages are backed by the page cache, so processes mapping the same file
+// share physical memory.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const void *data() const { return mapData; }
+  std::size_t size() const { return mapSize; }
+
+private:
+  void *mapData = nullptr;
+  std::size_t mapSize = 0;
+
+#ifdef _WIN32
+  void *fileHandle = nullptr;
+  void *mappingHandle = nullptr;
+#endif
+};
+
+// Word -> phonemes table consulted before eSpeak (<model>.onnx.lexicon).
+// Each line is a lowercase word, a tab, and its phonemes as UTF-8, sorted
+// by word (byte order). Lines starting with # are comments. The file is
+// memory-mapped; only the offsets of its entries are kept in memory.
+// Only ASCII letters are lowercased for lookup; other letters must match the
+// text exactly.
+class Lexicon {
+public:
+  explicit Lexicon(const std::string &path);
+
+  // Append the phonemes of a word (ASCII is matched case-insensitively).
+  // Returns false if the word is not in the lexicon.
+  bool lookup(std::string_view word, std::vector<Phoneme> &phonemes) const;
+
+  std::size_t size() const { return entryOffsets.size(); }
+
+private:
+  // Word of the entry starting at this offset in the file
+  std::string_view getWord(std::size_t offset) const;
+
+  MappedFile file;
+  std::vector<std::size_t> entryOffsets;
+};
+
 struct ModelSession {
+  // Mapped model file whose bytes the session uses for its weights
+  // (ORT format only, must outlive the session). Shared between processes
+  // serving the same voice.
+  std::shared_ptr<MappedFile> modelData;
+
   Ort::Session onnx;
   Ort::AllocatorWithDefaultOptions allocator;
   Ort::SessionOptions options;
@@ -104,9 +179,39 @@ struct ModelSession {
 };
 
 struct SynthesisResult {
-  double inferSeconds;
-  double audioSeconds;
-  double realTimeFactor;
+  double inferSeconds = 0;
+  double audioSeconds = 0;
+  double realTimeFactor = 0;
+
+  // Time spent before synthesis (filled in by the caller, e.g. the server)
+  double queueSeconds = 0;      // waiting for the synthesis lock
+  double loadSeconds = 0;       // loading the voice
+  double initializeSeconds = 0; // piper::initialize
+
+  // Time spent in each stage, summed over all sentences
+  double tashkeelSeconds = 0;   // diacritization
+  double phonemizeSeconds = 0;  // eSpeak or codepoints
+  double phonemeIdSeconds = 0;  // phonemes -> ids
+  double quantizeSeconds = 0;   // float -> int16 audio
+  double effectsSeconds = 0;    // all effects combined
+
+  // Time spent in each applied effect, by name
+  std::map<std::string, double> effectSeconds;
+
+  // Time spent in the output encoder
+  double encodeSeconds = 0;
+
+  // Time spent opening, flushing and closing output (filled in by the caller)
+  double ioSeconds = 0;
+
+  // Amount of work done
+  std::size_t numPhonemes = 0;
+  std::size_t numPhonemeIds = 0;
+  std::size_t numSamples = 0; // synthesized samples, before effects
+
+  // Words found (hits) and not found (misses) in the voice's lexicon
+  std::size_t numLexiconHits = 0;
+  std::size_t numLexiconMisses = 0;
 };
 
 struct Voice {
@@ -115,6 +220,121 @@ struct Voice {
   SynthesisConfig synthesisConfig;
   ModelConfig modelConfig;
   ModelSession session;
+
+  // Optional word -> phonemes table (eSpeak voices only)
+  std::shared_ptr<Lexicon> lexicon;
+};
+
+// Phonemizes with eSpeak in helper processes, so long texts are not
+// serialized on eSpeak's process-global state: sentences are split across
+// idle workers. The constructor forks a single-threaded spawner process, so
+// create the pool before starting any threads. The spawner forks the workers,
+// also when one has to be restarted after a failure (at most 5 times a
+// minute per worker). Each worker closes the file descriptors it inherited
+// and initializes its own eSpeak.
+class PhonemizerPool {
+public:
+  static const std::size_t MAX_WORKERS = 64;
+
+  PhonemizerPool(int numWorkers, const std::string &eSpeakDataPath);
+  ~PhonemizerPool();
+
+  PhonemizerPool(const PhonemizerPool &) = delete;
+  PhonemizerPool &operator=(const PhonemizerPool &) = delete;
+
+  // Phonemize text with an eSpeak voice (one vector per sentence).
+  // Waits while every worker is busy. Returns false if every worker has
+  // failed for good.
+  bool phonemize(const std::string &text, const std::string &voice,
+                 std::vector<std::vector<Phoneme>> &phonemes);
+
+  const std::string &getDataPath() const { return eSpeakDataPath; }
+
+private:
+  struct Worker {
+    int pid = -1;
+    int fd = -1; // socket to the worker
+    std::deque<std::chrono::steady_clock::time_point> restartTimes;
+  };
+
+  void startSpawner();
+  void startWorker(std::size_t index);
+
+  // Close the worker's socket, killing it first if it may be stuck
+  void stopWorker(std::size_t index, bool kill = false);
+
+  // Replace a failed worker. Returns false if it failed too often or could
+  // not be started.
+  bool restartWorker(std::size_t index);
+
+  // Take up to maxCount idle workers without locking (bit per worker)
+  uint64_t claimWorkers(std::size_t maxCount);
+
+  std::string eSpeakDataPath;
+  std::vector<Worker> workers;
+  std::atomic<uint64_t> idleWorkers{0};
+  std::atomic<std::size_t> numLiveWorkers{0};
+
+  // Signalled when workers become idle or are lost
+  std::mutex idleMutex;
+  std::condition_variable idleChanged;
+
+  // Process that forks (and kills) workers
+  int spawnerPid = -1;
+  int spawnerFd = -1;
+  std::mutex spawnerMutex;
+};
+
+// Thrown when synthesis is stopped with a CancelToken
+class SynthesisCancelled : public std::runtime_error {
+public:
+  SynthesisCancelled() : std::runtime_error("Synthesis was cancelled") {}
+};
+
+// Stops synthesis from another thread.
+// Checked between sentences and phrases; an inference in progress is
+// terminated.
+class CancelToken {
+public:
+  void cancel();
+  bool isCancelled() const { return cancelled; }
+
+  // Throw SynthesisCancelled if cancelled
+  void check() const;
+
+  // Called around an inference so cancel() can terminate it
+  void beginRun(Ort::RunOptions &runOptions);
+  void endRun();
+
+private:
+  std::atomic<bool> cancelled{false};
+  std::mutex runMutex;
+  Ort::RunOptions *runOptions = nullptr;
+};
+
+// Scratch memory for a single request.
+// Transient allocations are carved from a per-thread buffer (falling back to
+// the heap when it is full) and released all at once with the arena.
+// Only piper's own scratch containers use it: phrase spans, phrase break
+// tables, and effect buffers (the input copies of the speed and telephone
+// effects, the float samples passed through SoundTouch). Phoneme and phoneme
+// id vectors stay on the heap, since piper-phonemize's API takes std
+// containers. So does the server's parsed request JSON: nlohmann::json only
+// takes a stateless allocator type, which can't point at a per-request
+// resource.
+class RequestArena {
+public:
+  RequestArena();
+  ~RequestArena();
+
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  std::pmr::memory_resource *resource() { return &monotonic.value(); }
+
+private:
+  bool ownsThreadBuffer = false;
+  std::optional<std::pmr::monotonic_buffer_resource> monotonic;
 };
 
 // True if the string is a single UTF-8 codepoint
@@ -137,14 +357,50 @@ void loadVoice(PiperConfig &config, std::string modelPath,
                std::string modelConfigPath, Voice &voice,
                std::optional<SpeakerId> &speakerId, bool useCuda);
 
+// Called between sentences with the number of phonemes left to synthesize
+using SentenceCallback = std::function<void(std::size_t remainingPhonemes)>;
+
 // Phonemize text and synthesize audio
 void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                  std::vector<int16_t> &audioBuffer, SynthesisResult &result,
-                 const std::function<void()> &audioCallback);
+                 const std::function<void()> &audioCallback,
+                 std::pmr::memory_resource *arena =
+                     std::pmr::get_default_resource(),
+                 const SentenceCallback &sentenceCallback = nullptr,
+                 CancelToken *cancelToken = nullptr);
+
+// Number of interleaved channels in the audio after applying effects
+int getOutputChannels(const AudioEffects &effects,
+                      const SynthesisConfig &synthesisConfig);
+
+// Rough number of samples (all output channels) synthesized for text,
+// assuming about one phoneme per character. Used to pre-size output buffers.
+std::size_t estimateTextAudioSamples(const std::string &text,
+                                     const Voice &voice,
+                                     const AudioEffects &effects);
 
 // Phonemize text and synthesize audio to WAV file
 void textToWavFile(PiperConfig &config, Voice &voice, std::string text, AudioEffects &effects,
-                   std::ostream &audioFile, SynthesisResult &result);
+                   std::ostream &audioFile, SynthesisResult &result,
+                   std::pmr::memory_resource *arena =
+                       std::pmr::get_default_resource());
+
+// True if an effect depends on the whole utterance: speed and telephone
+// normalize to the utterance's peak, pitch shifting and the telephone filter
+// carry state across samples, and the Haas delay would restart at every
+// sentence.
+bool hasUtteranceEffects(const AudioEffects &effects);
+
+// Phonemize text, synthesize audio, and encode it one sentence at a time.
+// With effects that need the whole utterance (see hasUtteranceEffects), the
+// audio is encoded once synthesis is done instead.
+void textToEncodedAudio(PiperConfig &config, Voice &voice, std::string text,
+                        AudioEffects &effects, AudioEncoder &encoder,
+                        std::ostream &audioFile, SynthesisResult &result,
+                        std::pmr::memory_resource *arena =
+                            std::pmr::get_default_resource(),
+                        const SentenceCallback &sentenceCallback = nullptr,
+                        CancelToken *cancelToken = nullptr);
 
 } // namespace piper
 
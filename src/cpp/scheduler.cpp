@@ -0,0 +1,293 @@
+#include <algorithm>
+
+#include "scheduler.hpp"
+
+namespace piper {
+
+// Weight of the newest measurement in the cost model's moving averages
+const double COST_SMOOTHING = 0.2;
+
+// Seconds of predicted cost forgiven for each second a job has waited
+const double AGING_RATE = 1.0;
+
+// How often queued jobs check whether they were cancelled
+const std::chrono::milliseconds CANCEL_CHECK_INTERVAL(250);
+
+int parsePriority(const std::string &priorityName) {
+  if (priorityName == "bulk") {
+    return PRIORITY_BULK;
+  } else if (priorityName == "normal") {
+    return PRIORITY_NORMAL;
+  } else if (priorityName == "interactive") {
+    return PRIORITY_INTERACTIVE;
+  }
+
+  try {
+    return std::stoi(priorityName);
+  } catch (const std::exception &) {
+    throw std::invalid_argument("Invalid priority: " + priorityName);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+CostModel::VoiceCost CostModel::getCostLocked(const std::string &voiceName) {
+  auto voiceIter = voices.find(voiceName);
+  if (voiceIter == voices.end()) {
+    return VoiceCost();
+  }
+
+  return voiceIter->second;
+}
+
+double CostModel::predictSeconds(const std::string &voiceName,
+                                 std::size_t numChars, float lengthScale) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto cost = getCostLocked(voiceName);
+  return numChars * cost.phonemesPerChar * cost.audioSecondsPerPhoneme *
+         lengthScale * cost.realTimeFactor;
+}
+
+double CostModel::predictPhonemeSeconds(const std::string &voiceName,
+                                        std::size_t numPhonemes,
+                                        float lengthScale) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto cost = getCostLocked(voiceName);
+  return numPhonemes * cost.audioSecondsPerPhoneme * lengthScale *
+         cost.realTimeFactor;
+}
+
+void CostModel::update(const std::string &voiceName, std::size_t numChars,
+                       std::size_t numPhonemes, double audioSeconds,
+                       double realTimeFactor, float lengthScale) {
+  if ((numChars == 0) || (numPhonemes == 0) || (audioSeconds <= 0) ||
+      (lengthScale <= 0)) {
+    return;
+  }
+
+  auto smooth = [](double &average, double value) {
+    average = ((1.0 - COST_SMOOTHING) * average) + (COST_SMOOTHING * value);
+  };
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto [voiceIter, isNew] = voices.try_emplace(voiceName);
+  auto &cost = voiceIter->second;
+  if (isNew) {
+    // First measurement replaces the defaults
+    cost.phonemesPerChar = (double)numPhonemes / numChars;
+    cost.audioSecondsPerPhoneme = audioSeconds / numPhonemes / lengthScale;
+    cost.realTimeFactor = realTimeFactor;
+    return;
+  }
+
+  smooth(cost.phonemesPerChar, (double)numPhonemes / numChars);
+  smooth(cost.audioSecondsPerPhoneme, audioSeconds / numPhonemes / lengthScale);
+  smooth(cost.realTimeFactor, realTimeFactor);
+}
+
+// ----------------------------------------------------------------------------
+
+// True if job a should run before job b, given how long each has been
+// waiting in the queue
+static bool runsBefore(const SynthesisScheduler::Job &a, double aWaitSeconds,
+                       const SynthesisScheduler::Job &b, double bWaitSeconds) {
+  if (a.priority != b.priority) {
+    return a.priority > b.priority;
+  }
+
+  return (a.estimatedSeconds - (AGING_RATE * aWaitSeconds)) <
+         (b.estimatedSeconds - (AGING_RATE * bWaitSeconds));
+}
+
+static double secondsSince(SynthesisScheduler::Clock::time_point time,
+                           SynthesisScheduler::Clock::time_point now) {
+  return std::chrono::duration<double>(now - time).count();
+}
+
+SynthesisScheduler::Slot::~Slot() {
+  if (scheduler) {
+    scheduler->release();
+  }
+}
+
+double SynthesisScheduler::predictWaitSecondsLocked(const Job &job) {
+  auto now = Clock::now();
+  double waitSeconds = 0;
+  if (running) {
+    double elapsedSeconds =
+        std::chrono::duration<double>(now - runningStartTime).count();
+    waitSeconds += std::max(0.0, runningEstimatedSeconds - elapsedSeconds);
+  }
+
+  for (auto &waiter : waiters) {
+    if (!waiter.granted &&
+        !runsBefore(job, 0, waiter.job, secondsSince(waiter.queuedTime, now))) {
+      waitSeconds += waiter.job.estimatedSeconds;
+    }
+  }
+
+  return waitSeconds;
+}
+
+double SynthesisScheduler::predictWaitSeconds(const Job &job) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return predictWaitSecondsLocked(job);
+}
+
+std::size_t SynthesisScheduler::getQueueLength() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return waiters.size();
+}
+
+void SynthesisScheduler::grantNextLocked() {
+  if (running || waiters.empty()) {
+    return;
+  }
+
+  // Priority, then aged cost, then earliest arrival
+  auto now = Clock::now();
+  auto next = std::min_element(
+      waiters.begin(), waiters.end(),
+      [now](const Waiter &a, const Waiter &b) {
+        double aWaitSeconds = secondsSince(a.queuedTime, now);
+        double bWaitSeconds = secondsSince(b.queuedTime, now);
+        if (runsBefore(a.job, aWaitSeconds, b.job, bWaitSeconds)) {
+          return true;
+        }
+        return !runsBefore(b.job, bWaitSeconds, a.job, aWaitSeconds) &&
+               (a.sequence < b.sequence);
+      });
+
+  next->granted = true;
+  running = true;
+  runningEstimatedSeconds = next->job.estimatedSeconds;
+  runningStartTime = now;
+  cv.notify_all();
+}
+
+SynthesisScheduler::Slot SynthesisScheduler::acquire(const Job &job,
+                                                     double &queueSeconds) {
+  auto startTime = Clock::now();
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (waiters.size() >= maxQueueLength) {
+    throw AdmissionError(503, "Server is busy (queue is full)");
+  }
+
+  if (job.deadline) {
+    double predictedSeconds = predictWaitSecondsLocked(job) + job.estimatedSeconds;
+    auto predictedEnd =
+        startTime + std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double>(predictedSeconds));
+    if (predictedEnd > *job.deadline) {
+      throw AdmissionError(429, "Deadline cannot be met (predicted " +
+                                    std::to_string(predictedSeconds) +
+                                    " second(s))");
+    }
+  }
+
+  auto waiter = waiters.insert(waiters.end(),
+                               Waiter{job, nextSequence++, startTime});
+  grantNextLocked();
+  if (!waitUntilGrantedLocked(lock, waiter)) {
+    throw AdmissionError(503, "Deadline passed while queued");
+  }
+
+  queueSeconds +=
+      std::chrono::duration<double>(Clock::now() - startTime).count();
+
+  return Slot(this);
+}
+
+bool SynthesisScheduler::waitUntilGrantedLocked(
+    std::unique_lock<std::mutex> &lock, std::list<Waiter>::iterator waiter) {
+  const Job &job = waiter->job;
+  while (!waiter->granted) {
+    auto wakeTime = Clock::now() + CANCEL_CHECK_INTERVAL;
+    if (job.deadline && (*job.deadline < wakeTime)) {
+      wakeTime = *job.deadline;
+    }
+
+    cv.wait_until(lock, wakeTime);
+    if (waiter->granted) {
+      break;
+    }
+
+    if (job.deadline && (Clock::now() >= *job.deadline)) {
+      waiters.erase(waiter);
+      return false;
+    }
+
+    if (job.checkCancelled) {
+      try {
+        job.checkCancelled();
+      } catch (...) {
+        // Not granted, so nothing else needs to be released
+        waiters.erase(waiter);
+        throw;
+      }
+    }
+  }
+
+  waiters.erase(waiter);
+  return true;
+}
+
+SynthesisScheduler::YieldResult
+SynthesisScheduler::yield(Slot &slot, const Job &job, double &queueSeconds) {
+  auto startTime = Clock::now();
+  std::unique_lock<std::mutex> lock(mutex);
+
+  // Time this job has spent running doesn't count towards its aging
+  bool isWaiting =
+      std::any_of(waiters.begin(), waiters.end(), [&](const Waiter &waiter) {
+        return runsBefore(waiter.job, secondsSince(waiter.queuedTime, startTime),
+                          job, 0);
+      });
+
+  if (!isWaiting) {
+    // Keep running
+    runningEstimatedSeconds = job.estimatedSeconds;
+    runningStartTime = startTime;
+    return YieldResult::Kept;
+  }
+
+  // Hand over the synthesizer and wait for another turn.
+  // Already admitted, so the queue limit doesn't apply.
+  // Aging starts over from now.
+  auto waiter = waiters.insert(waiters.end(),
+                               Waiter{job, nextSequence++, startTime});
+  running = false;
+  grantNextLocked();
+
+  bool isGranted = false;
+  try {
+    isGranted = waitUntilGrantedLocked(lock, waiter);
+  } catch (...) {
+    // Reported as Cancelled; the caller checks its own cancellation
+  }
+
+  queueSeconds +=
+      std::chrono::duration<double>(Clock::now() - startTime).count();
+
+  if (!isGranted) {
+    // Another job may be running now, so the slot must not release it
+    slot.scheduler = nullptr;
+    return YieldResult::Cancelled;
+  }
+
+  return YieldResult::Resumed;
+}
+
+void SynthesisScheduler::wakeWaiters() {
+  std::lock_guard<std::mutex> lock(mutex);
+  cv.notify_all();
+}
+
+void SynthesisScheduler::release() {
+  std::lock_guard<std::mutex> lock(mutex);
+  running = false;
+  grantNextLocked();
+}
+
+} // namespace piper
@@ -0,0 +1,174 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+namespace piper {
+
+// Request priorities (higher runs first)
+const int PRIORITY_BULK = 0;
+const int PRIORITY_NORMAL = 1;
+const int PRIORITY_INTERACTIVE = 2;
+
+// Parse priority name (bulk, normal, interactive) or number
+int parsePriority(const std::string &priorityName);
+
+// Request was rejected by admission control.
+// Status is the HTTP status code to return (429 or 503).
+class AdmissionError : public std::runtime_error {
+public:
+  AdmissionError(int status, const std::string &message)
+      : std::runtime_error(message), status(status) {}
+
+  int status;
+};
+
+// Predicts synthesis time of each voice from its measured results.
+// Text length is converted to phonemes, phonemes to seconds of audio, and
+// audio to synthesis time with the voice's real-time factor.
+class CostModel {
+public:
+  // Predicted seconds to synthesize text with this many characters
+  double predictSeconds(const std::string &voiceName, std::size_t numChars,
+                        float lengthScale = 1);
+
+  // Predicted seconds to synthesize this many phonemes
+  double predictPhonemeSeconds(const std::string &voiceName,
+                               std::size_t numPhonemes,
+                               float lengthScale = 1);
+
+  // Learn from a finished request
+  void update(const std::string &voiceName, std::size_t numChars,
+              std::size_t numPhonemes, double audioSeconds,
+              double realTimeFactor, float lengthScale = 1);
+
+private:
+  // Moving averages, starting from typical values for medium voices on CPU
+  struct VoiceCost {
+    double phonemesPerChar = 1.0;
+    double audioSecondsPerPhoneme = 0.08;
+    double realTimeFactor = 0.2;
+  };
+
+  VoiceCost getCostLocked(const std::string &voiceName);
+
+  std::mutex mutex;
+  std::map<std::string, VoiceCost> voices;
+};
+
+// Orders access to the synthesizer, which runs one job at a time.
+//
+// Waiting jobs are ordered by priority, then shortest predicted cost first.
+// Time spent waiting in the queue (not running) is subtracted from a job's
+// cost (aging), so long jobs are not starved by a stream of short ones. Jobs are rejected up front when
+// the queue is full (503) or when the predicted wait exceeds their deadline
+// (429), and dropped if their deadline passes while queued (503).
+class SynthesisScheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Job {
+    int priority = PRIORITY_NORMAL;
+    std::optional<Clock::time_point> deadline;
+
+    // Predicted synthesis time (of the remaining work when yielding)
+    double estimatedSeconds = 0;
+
+    // Called periodically while queued (and after wakeWaiters).
+    // Throws to give up the job's place in the queue.
+    std::function<void()> checkCancelled;
+  };
+
+  // Exclusive access to the synthesizer, released on destruction
+  class Slot {
+    friend class SynthesisScheduler;
+
+  public:
+    explicit Slot(SynthesisScheduler *scheduler) : scheduler(scheduler) {}
+    Slot(Slot &&other) noexcept : scheduler(other.scheduler) {
+      other.scheduler = nullptr;
+    }
+    Slot(const Slot &) = delete;
+    Slot &operator=(const Slot &) = delete;
+    ~Slot();
+
+  private:
+    SynthesisScheduler *scheduler;
+  };
+
+  explicit SynthesisScheduler(std::size_t maxQueueLength)
+      : maxQueueLength(maxQueueLength) {}
+
+  // Wait until the job may run.
+  // Adds the time spent waiting to queueSeconds. Anything thrown by the
+  // job's checkCancelled is passed on after the job leaves the queue.
+  Slot acquire(const Job &job, double &queueSeconds);
+
+  enum class YieldResult {
+    Kept,     // no job had to run first
+    Resumed,  // another job ran in the meantime
+    Cancelled // gave up waiting (checkCancelled threw or deadline passed)
+  };
+
+  // Called by the running job between work items (e.g., sentences) with
+  // its slot. If a waiting job should run first, the synthesizer is handed
+  // over and this blocks until it is this job's turn again. When Cancelled,
+  // the slot no longer holds the synthesizer.
+  YieldResult yield(Slot &slot, const Job &job, double &queueSeconds);
+
+  // Wake queued jobs so they check for cancellation now
+  void wakeWaiters();
+
+  // Seconds a job is predicted to wait before starting
+  double predictWaitSeconds(const Job &job);
+
+  // Number of jobs waiting to run
+  std::size_t getQueueLength();
+
+  std::size_t getMaxQueueLength() const { return maxQueueLength; }
+
+private:
+  struct Waiter {
+    Job job;
+    uint64_t sequence;
+
+    // When the job (re)joined the queue, used for aging
+    Clock::time_point queuedTime;
+    bool granted = false;
+  };
+
+  void release();
+  double predictWaitSecondsLocked(const Job &job);
+
+  // Wait until the waiter is granted, checking the job for cancellation.
+  // Returns false if its deadline passed, and passes on anything thrown by
+  // checkCancelled. The waiter is removed from the queue in any case.
+  bool waitUntilGrantedLocked(std::unique_lock<std::mutex> &lock,
+                              std::list<Waiter>::iterator waiter);
+  void grantNextLocked();
+
+  std::size_t maxQueueLength;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::list<Waiter> waiters;
+  uint64_t nextSequence = 0;
+
+  // Currently running job
+  bool running = false;
+  double runningEstimatedSeconds = 0;
+  Clock::time_point runningStartTime;
+};
+
+} // namespace piper
+
+#endif // SCHEDULER_H_
@@ -1,11 +1,20 @@
 #include "httplib.h" // Include the cpp-httplib header
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <stdexcept>
@@ -29,12 +38,23 @@
 #include <mach-o/dyld.h>
 #endif
 
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <spdlog/async.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/basic_file_sink.h>
 
 #include "json.hpp"
+#include "metrics.hpp"
 #include "piper.hpp"
+#include "scheduler.hpp"
 
 using namespace std;
 using json = nlohmann::json;
@@ -56,10 +76,136 @@ enum OutputType
   OUTPUT_RAW
 };
 
+// Output stream buffer that writes directly into a string (e.g., a response
+// body). Seeking is supported so encoders can patch their headers.
+class StringStreamBuf : public std::streambuf
+{
+public:
+  explicit StringStreamBuf(std::string &target) : target(target), pos(target.size()) {}
+
+protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override
+  {
+    target.replace(pos, n, s, n);
+    pos += n;
+    return n;
+  }
+
+  int_type overflow(int_type ch) override
+  {
+    if (!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+      char c = traits_type::to_char_type(ch);
+      xsputn(&c, 1);
+    }
+
+    return traits_type::not_eof(ch);
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override
+  {
+    if (!(which & std::ios_base::out))
+    {
+      return pos_type(off_type(-1));
+    }
+
+    off_type base = 0;
+    if (dir == std::ios_base::cur)
+    {
+      base = pos;
+    }
+    else if (dir == std::ios_base::end)
+    {
+      base = target.size();
+    }
+
+    off_type newPos = base + off;
+    if ((newPos < 0) || (newPos > (off_type)target.size()))
+    {
+      return pos_type(off_type(-1));
+    }
+
+    pos = newPos;
+    return pos_type(newPos);
+  }
+
+  pos_type seekpos(pos_type p, std::ios_base::openmode which) override
+  {
+    return seekoff(off_type(p), std::ios_base::beg, which);
+  }
+
+private:
+  std::string &target;
+  std::size_t pos;
+};
+
+// Reserve a response body for the encoded audio of text, so it is not
+// reallocated as it grows
+static void reserveAudioBody(std::string &body, const std::string &text, const piper::Voice &voice,
+                             const piper::AudioEffects &effects, const piper::AudioEncoder &encoder)
+{
+  std::size_t numSamples = piper::estimateTextAudioSamples(text, voice, effects);
+  body.reserve(encoder.estimateSize(numSamples, voice.synthesisConfig.sampleRate,
+                                    piper::getOutputChannels(effects, voice.synthesisConfig)));
+}
+
+// Output stream buffer that sends everything to an HTTP chunked response.
+// Not seekable, so encoders fall back to streaming headers.
+class DataSinkStreamBuf : public std::streambuf
+{
+public:
+  explicit DataSinkStreamBuf(httplib::DataSink &sink) : sink(sink) {}
+
+protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override
+  {
+    return sink.write(s, n) ? n : 0;
+  }
+
+  int_type overflow(int_type ch) override
+  {
+    if (traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+      return traits_type::not_eof(ch);
+    }
+
+    char c = traits_type::to_char_type(ch);
+    return sink.write(&c, 1) ? ch : traits_type::eof();
+  }
+
+private:
+  httplib::DataSink &sink;
+};
+
 
 
 struct InitConfig {
   optional<string> port = params.port;
+
+  // Maximum number of requests waiting to be synthesized
+  std::size_t maxQueueLength = 64;
+
+  // Directory where audio of background jobs is written
+  filesystem::path jobsPath = "jobs";
+
+  // Listen on this Unix domain socket instead of TCP
+  optional<string> unixSocketPath;
+
+  // Allow other processes to listen on the same port (SO_REUSEPORT)
+  bool reusePort = false;
+
+  // Number of worker processes sharing the listening socket
+  int numProcesses = 1;
+
+  // Number of eSpeak processes phonemizing text in parallel
+  int numPhonemizerWorkers = 1;
+
+  // Load <model>.int8.onnx (CPU) or <model>.fp16.onnx (CUDA) when present
+  bool useQuantizedModel = true;
+
+  // Log level from the command line
+  optional<spdlog::level::level_enum> logLevel;
 };
 
 struct RunConfig {
@@ -78,6 +224,12 @@ struct RunConfig {
   // Default is to write a WAV file in the current directory.
   OutputType outputType = OUTPUT_DIRECTORY;
 
+  // Audio encoding of the output (wav, flac, mulaw, alaw, opus)
+  piper::OutputFormat outputFormat = piper::OUTPUT_FORMAT_WAV;
+
+  // Send OUTPUT_RAW audio with chunked encoding as it is synthesized
+  bool stream = false;
+
   // Path for output
   optional<filesystem::path> outputPath = filesystem::path(".");
 
@@ -117,6 +269,19 @@ struct RunConfig {
 
   // true to use CUDA execution provider
   bool useCuda = false;
+
+  // Scheduling priority (see piper::parsePriority)
+  int priority = piper::PRIORITY_NORMAL;
+
+  // Time by which synthesis must be finished
+  optional<chrono::steady_clock::time_point> deadline;
+
+  // When the request arrived
+  chrono::steady_clock::time_point arrivalTime = chrono::steady_clock::now();
+
+  // Id used to cancel the request with DELETE /tts/{id}.
+  // Default is the server's request number.
+  string requestId;
 };
 
 void parseStartupArgs(int argc, char *argv[], InitConfig &initConfig);
@@ -125,57 +290,1159 @@ void parseArgsFromJson(const json &inputJson, RunConfig&runConfig, piper::AudioE
 //                   condition_variable &cvAudio, bool &audioReady,
 //                   bool &audioFinished);
 
-std::mutex processingMutex;
+// Orders requests for the synthesizer (created once arguments are parsed)
+std::unique_ptr<piper::SynthesisScheduler> scheduler;
+
+// Predicts how long requests take, learned from finished requests
+piper::CostModel costModel;
+
+piper::Metrics metrics;
+
+// Requests being handled
+std::atomic<int> inFlightRequests{0};
+
+// Voice currently loaded
+std::mutex residentVoiceMutex;
+std::string residentVoiceName;
+std::atomic<int64_t> residentVoiceBytes{0};
+std::atomic<bool> residentVoiceIsShared{false};
+std::atomic<bool> residentVoiceUsesCuda{false};
+
+// Id of the next request, used to correlate log records
+std::atomic<uint64_t> nextRequestId{1};
+
+// Maximum number of log messages waiting to be written
+const std::size_t LOG_QUEUE_SIZE = 8192;
+
+// HTTP threads beyond those that can wait for or hold the synthesizer, so
+// /metrics, /log-level and DELETE /tts/{id} are served under overload
+const std::size_t CONTROL_THREADS = 8;
+
+// Counts a request as in flight for its lifetime
+struct InFlightGuard
+{
+  InFlightGuard() { inFlightRequests++; }
+  ~InFlightGuard() { inFlightRequests--; }
+};
+
+// Cancel tokens of requests being handled, by id
+std::mutex activeRequestsMutex;
+std::map<std::string, std::shared_ptr<piper::CancelToken>> activeRequests;
+
+// Makes a request cancellable by id for its lifetime
+struct ActiveRequest
+{
+  explicit ActiveRequest(const std::string &id) : id(id)
+  {
+    std::lock_guard<std::mutex> lock(activeRequestsMutex);
+    if (!activeRequests.emplace(id, cancelToken).second) {
+      throw std::invalid_argument("Request id is already in use: " + id);
+    }
+  }
+
+  ~ActiveRequest()
+  {
+    std::lock_guard<std::mutex> lock(activeRequestsMutex);
+    activeRequests.erase(id);
+  }
+
+  ActiveRequest(const ActiveRequest &) = delete;
+  ActiveRequest &operator=(const ActiveRequest &) = delete;
+
+  std::string id;
+  std::shared_ptr<piper::CancelToken> cancelToken = std::make_shared<piper::CancelToken>();
+};
+
+// Long-form synthesis running in the background (POST /jobs)
+struct SynthesisJob
+{
+  uint64_t requestNumber = 0;
+  RunConfig runConfig;
+  piper::AudioEffects effects;
+  filesystem::path audioPath;
+  std::string contentType;
+
+  // Cancellable with DELETE /tts/{id} until finished
+  std::shared_ptr<ActiveRequest> activeRequest;
+
+  // Progress, guarded by mutex
+  std::mutex mutex;
+  std::string status = "queued"; // queued, running, done, failed, cancelled
+  std::string error;
+  std::size_t sentencesDone = 0;
+  double progress = 0; // fraction of phonemes synthesized
+  double audioSeconds = 0;
+  double realTimeFactor = 0;
+};
+
+// Jobs by id, and jobs waiting for the background worker
+std::mutex jobsMutex;
+std::map<std::string, std::shared_ptr<SynthesisJob>> jobs;
+std::deque<std::shared_ptr<SynthesisJob>> jobQueue;
+std::condition_variable jobQueueCv;
+
+// Finished jobs, oldest first. The oldest are forgotten (and their audio
+// deleted) when there are more than MAX_FINISHED_JOBS.
+std::deque<std::string> finishedJobIds;
+const std::size_t MAX_FINISHED_JOBS = 1024;
+
+// Seconds elapsed since a start time
+static double secondsSince(chrono::steady_clock::time_point startTime)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+}
+
+// Scheduler job for a request, with its cost predicted from text length.
+// With a cancel token, the job leaves the queue when it is cancelled or its
+// client disconnects.
+static piper::SynthesisScheduler::Job getJob(const RunConfig &runConfig,
+                                             piper::CancelToken *cancelToken = nullptr,
+                                             std::function<bool()> isClientConnected = nullptr)
+{
+  piper::SynthesisScheduler::Job job;
+  job.priority = runConfig.priority;
+  job.deadline = runConfig.deadline;
+  if (cancelToken) {
+    job.checkCancelled = [cancelToken, isClientConnected]() {
+      if (isClientConnected && !isClientConnected()) {
+        cancelToken->cancel();
+      }
+      cancelToken->check();
+    };
+  }
+  job.estimatedSeconds = costModel.predictSeconds(runConfig.modelPath.stem().string(),
+                                                  runConfig.sentence.size(),
+                                                  runConfig.lengthScale.value_or(1.0f));
+  return job;
+}
+
+// Learn the voice's cost from a successful request
+static void updateCostModel(const RunConfig &runConfig, const piper::Voice &voice,
+                            const piper::SynthesisResult &result)
+{
+  costModel.update(runConfig.modelPath.stem().string(), runConfig.sentence.size(),
+                   result.numPhonemes, result.audioSeconds, result.realTimeFactor,
+                   voice.synthesisConfig.lengthScale);
+}
+
+// Register metric families and gauges
+static void setupMetrics()
+{
+  metrics.describe("piper_requests_total", "counter", "TTS requests by voice and outcome (ok, error, rejected, cancelled)");
+  metrics.describe("piper_request_seconds", "histogram", "Total time to handle a TTS request");
+  metrics.describe("piper_stage_seconds", "histogram", "Time spent in each synthesis stage");
+  metrics.describe("piper_rtf", "histogram", "Real-time factor (inference time / audio time) by voice");
+  metrics.describe("piper_audio_seconds_total", "counter", "Seconds of audio synthesized by voice");
+  metrics.describe("piper_voice_cache_requests_total", "counter", "Voice lookups that reused the loaded voice (hit) or loaded it (miss)");
+  metrics.describe("piper_lexicon_words_total", "counter", "Words found (hit) or not found (miss) in the voice's lexicon");
+
+  metrics.addCollector([](std::string &out) {
+    out += "# HELP piper_in_flight_requests TTS requests being handled\n";
+    out += "# TYPE piper_in_flight_requests gauge\n";
+    out += fmt::format("piper_in_flight_requests {}\n", inFlightRequests.load());
+    out += "# HELP piper_queue_depth TTS requests waiting for the synthesizer\n";
+    out += "# TYPE piper_queue_depth gauge\n";
+    out += fmt::format("piper_queue_depth {}\n", scheduler->getQueueLength());
+    out += "# HELP piper_queue_capacity Maximum TTS requests waiting for the synthesizer\n";
+    out += "# TYPE piper_queue_capacity gauge\n";
+    out += fmt::format("piper_queue_capacity {}\n", scheduler->getMaxQueueLength());
+
+    std::string voiceName;
+    {
+      std::lock_guard<std::mutex> lock(residentVoiceMutex);
+      voiceName = residentVoiceName;
+    }
+
+    out += "# HELP piper_resident_voices Voices loaded in memory\n";
+    out += "# TYPE piper_resident_voices gauge\n";
+    out += fmt::format("piper_resident_voices {}\n", voiceName.empty() ? 0 : 1);
+    // Weights are a private copy unless the session uses the file mapping
+    out += "# HELP piper_resident_voice_bytes Approximate memory holding loaded voice weights (model file size), "
+           "as a private copy or a file mapping shared between processes\n";
+    out += "# TYPE piper_resident_voice_bytes gauge\n";
+    if (!voiceName.empty()) {
+      out += fmt::format("piper_resident_voice_bytes{{voice=\"{}\",memory=\"{}\"}} {}\n",
+                         piper::escapeLabelValue(voiceName), residentVoiceIsShared ? "shared" : "private",
+                         residentVoiceBytes.load());
+    }
+
+    // Mirrors the session options set in piper::loadModel (0 = ORT default)
+    out += "# HELP piper_ort_info Onnx Runtime session settings\n";
+    out += "# TYPE piper_ort_info gauge\n";
+    out += fmt::format("piper_ort_info{{provider=\"{}\",intra_op_threads=\"0\",inter_op_threads=\"0\","
+                       "execution_mode=\"sequential\",graph_optimization=\"disabled\"}} 1\n",
+                       residentVoiceUsesCuda ? "cuda" : "cpu");
+  });
+}
+
+// Record metrics for a finished request
+static void recordRequestMetrics(const std::string &voiceName, const piper::SynthesisResult &result,
+                                 double totalSeconds, const std::string &outcome)
+{
+  std::string voiceLabel = "voice=\"" + piper::escapeLabelValue(voiceName) + "\"";
+  metrics.increment("piper_requests_total", voiceLabel + ",outcome=\"" + outcome + "\"");
+  metrics.observe("piper_request_seconds", voiceLabel, totalSeconds);
+  if (outcome != "ok") {
+    return;
+  }
+
+  std::pair<const char *, double> stages[] = {
+      {"queue", result.queueSeconds},
+      {"load", result.loadSeconds},
+      {"init", result.initializeSeconds},
+      {"tashkeel", result.tashkeelSeconds},
+      {"phonemize", result.phonemizeSeconds},
+      {"ids", result.phonemeIdSeconds},
+      {"infer", result.inferSeconds},
+      {"post", result.quantizeSeconds + result.effectsSeconds},
+      {"encode", result.encodeSeconds},
+      {"io", result.ioSeconds}};
+
+  for (auto &[stage, seconds] : stages) {
+    metrics.observe("piper_stage_seconds", fmt::format("stage=\"{}\"", stage), seconds);
+  }
+
+  metrics.observe("piper_rtf", voiceLabel, result.realTimeFactor, piper::RTF_BUCKETS);
+  metrics.increment("piper_audio_seconds_total", voiceLabel, result.audioSeconds);
+
+  if (result.numLexiconHits + result.numLexiconMisses > 0) {
+    metrics.increment("piper_lexicon_words_total", voiceLabel + ",result=\"hit\"", result.numLexiconHits);
+    metrics.increment("piper_lexicon_words_total", voiceLabel + ",result=\"miss\"", result.numLexiconMisses);
+  }
+}
+
+// Stage durations as an HTTP Server-Timing header value (milliseconds)
+static std::string getServerTiming(const piper::SynthesisResult &result, double totalSeconds)
+{
+  std::vector<std::pair<const char *, double>> stages{
+      {"queue", result.queueSeconds},
+      {"load", result.loadSeconds},
+      {"init", result.initializeSeconds},
+      {"tashkeel", result.tashkeelSeconds},
+      {"phonemize", result.phonemizeSeconds},
+      {"ids", result.phonemeIdSeconds},
+      {"infer", result.inferSeconds},
+      {"post", result.quantizeSeconds + result.effectsSeconds},
+      {"encode", result.encodeSeconds},
+      {"io", result.ioSeconds},
+      {"total", totalSeconds}};
+
+  std::string timing;
+  for (auto &[name, seconds] : stages) {
+    if (!timing.empty()) {
+      timing += ", ";
+    }
+    timing += fmt::format("{};dur={:.3f}", name, seconds * 1000.0);
+  }
+
+  return timing;
+}
+
+// Stage durations and counts for the JSON response
+static json getTimingJson(const piper::SynthesisResult &result, double totalSeconds)
+{
+  json timingJson{
+      {"queueSeconds", result.queueSeconds},
+      {"loadSeconds", result.loadSeconds},
+      {"initializeSeconds", result.initializeSeconds},
+      {"tashkeelSeconds", result.tashkeelSeconds},
+      {"phonemizeSeconds", result.phonemizeSeconds},
+      {"phonemeIdSeconds", result.phonemeIdSeconds},
+      {"inferSeconds", result.inferSeconds},
+      {"quantizeSeconds", result.quantizeSeconds},
+      {"effectsSeconds", result.effectsSeconds},
+      {"effectSeconds", result.effectSeconds},
+      {"encodeSeconds", result.encodeSeconds},
+      {"ioSeconds", result.ioSeconds},
+      {"totalSeconds", totalSeconds},
+      {"audioSeconds", result.audioSeconds},
+      {"realTimeFactor", result.realTimeFactor},
+      {"numPhonemes", result.numPhonemes},
+      {"numPhonemeIds", result.numPhonemeIds},
+      {"numSamples", result.numSamples},
+      {"numLexiconHits", result.numLexiconHits},
+      {"numLexiconMisses", result.numLexiconMisses}};
+
+  return timingJson;
+}
+
+// Emit a single structured log record for a finished request
+static void logRequest(uint64_t requestId, const RunConfig &runConfig, const piper::Voice &voice,
+                       const piper::SynthesisResult &result, double totalSeconds,
+                       const std::string &error = "")
+{
+  auto level = error.empty() ? spdlog::level::info : spdlog::level::err;
+  if (!spdlog::should_log(level)) {
+    return;
+  }
+
+  json recordJson{
+      {"requestId", requestId},
+      {"voice", runConfig.modelPath.stem().string()},
+      {"textLength", runConfig.sentence.size()},
+      {"outputType", (int)runConfig.outputType},
+      {"outputFormat", (int)runConfig.outputFormat},
+      {"stream", runConfig.stream},
+      {"priority", runConfig.priority},
+      {"noiseScale", voice.synthesisConfig.noiseScale},
+      {"lengthScale", voice.synthesisConfig.lengthScale},
+      {"noiseW", voice.synthesisConfig.noiseW},
+      {"sentenceSilenceSeconds", voice.synthesisConfig.sentenceSilenceSeconds},
+      {"outcome", error.empty() ? "ok" : "error"},
+      {"timings", getTimingJson(result, totalSeconds)}};
+
+  if (!error.empty()) {
+    recordJson["error"] = error;
+  }
+
+  spdlog::log(level, "request {}", recordJson.dump());
+}
+
+
+// Path to the piper executable
+static filesystem::path getExePath()
+{
+#ifdef _MSC_VER
+  wchar_t moduleFileName[MAX_PATH] = {0};
+  GetModuleFileNameW(nullptr, moduleFileName, std::size(moduleFileName));
+  return filesystem::path(moduleFileName);
+#else
+#ifdef __APPLE__
+  char moduleFileName[PATH_MAX] = {0};
+  uint32_t moduleFileNameSize = std::size(moduleFileName);
+  _NSGetExecutablePath(moduleFileName, &moduleFileNameSize);
+  return filesystem::path(moduleFileName);
+#else
+  return filesystem::canonical("/proc/self/exe");
+#endif
+#endif
+}
+
+// espeak-ng-data next to the piper executable
+static std::string getDefaultESpeakDataPath()
+{
+  return filesystem::absolute(getExePath().parent_path().append("espeak-ng-data")).string();
+}
+
+// Load the requested voice (if not already loaded) and set up the phonemizer.
+// Must be called while holding a scheduler slot.
+static void prepareVoice(const RunConfig &runConfig, std::string &modelPath, piper::PiperConfig &piperConfig,
+                         piper::Voice &voice, piper::SynthesisResult &result)
+{
+  if (modelPath != runConfig.modelPath.string())
+  {
+    auto startTime = chrono::steady_clock::now();
+    modelPath = runConfig.modelPath.string();
+    // std::cout << "Loading voice from " << runConfig.modelPath.string() << " (config=" << runConfig.modelConfigPath.string() << ")" << std::endl;
+    auto speakerId = runConfig.speakerId;
+    piper::loadVoice(piperConfig, runConfig.modelPath.string(),
+                runConfig.modelConfigPath.string(), voice, speakerId,
+                runConfig.useCuda);
+    result.loadSeconds += secondsSince(startTime);
+    spdlog::info("Loaded onnx model in {} second(s)", result.loadSeconds);
+
+    {
+      std::lock_guard<std::mutex> voiceLock(residentVoiceMutex);
+      residentVoiceName = runConfig.modelPath.stem().string();
+    }
+    residentVoiceBytes = voice.session.modelData
+                             ? (int64_t)voice.session.modelData->size()
+                             : (int64_t)filesystem::file_size(runConfig.modelPath);
+    residentVoiceIsShared = (voice.session.modelData != nullptr);
+    residentVoiceUsesCuda = runConfig.useCuda;
+    metrics.increment("piper_voice_cache_requests_total", "result=\"miss\"");
+  }
+  else
+  {
+    metrics.increment("piper_voice_cache_requests_total", "result=\"hit\"");
+  }
+
+  // Get the path to the piper executable so we can locate espeak-ng-data, etc.
+  // next to it.
+  auto exePath = getExePath();
+
+  if (voice.phonemizeConfig.phonemeType == piper::eSpeakPhonemes) {
+    spdlog::debug("Voice uses eSpeak phonemes ({})",
+                  voice.phonemizeConfig.eSpeak.voice);
+
+    if (runConfig.eSpeakDataPath) {
+      // User provided path
+      piperConfig.eSpeakDataPath = runConfig.eSpeakDataPath.value().string();
+    } else {
+      // Assume next to piper executable
+      piperConfig.eSpeakDataPath = getDefaultESpeakDataPath();
+
+      spdlog::debug("espeak-ng-data directory is expected at {}",
+                    piperConfig.eSpeakDataPath);
+    }
+  } else {
+    // Not using eSpeak
+    piperConfig.useESpeak = false;
+  }
+
+  // Enable libtashkeel for Arabic
+  if (voice.phonemizeConfig.eSpeak.voice == "ar") {
+    piperConfig.useTashkeel = true;
+    if (runConfig.tashkeelModelPath) {
+      // User provided path
+      piperConfig.tashkeelModelPath =
+          runConfig.tashkeelModelPath.value().string();
+    } else {
+      // Assume next to piper executable
+      piperConfig.tashkeelModelPath =
+          std::filesystem::absolute(
+              exePath.parent_path().append("libtashkeel_model.ort"))
+              .string();
+
+      spdlog::debug("libtashkeel model is expected at {}",
+                    piperConfig.tashkeelModelPath.value());
+    }
+  }
+
+  auto startTime = chrono::steady_clock::now();
+  piper::initialize(piperConfig);
+  result.initializeSeconds += secondsSince(startTime);
+}
+
+// Apply the request's synthesis settings to the voice.
+// Must be called while holding a scheduler slot.
+static void applySynthesisConfig(const RunConfig &runConfig, piper::Voice &voice)
+{
+  // Scales
+  if (runConfig.noiseScale) {
+    voice.synthesisConfig.noiseScale = runConfig.noiseScale.value();
+  }
+
+  if (runConfig.lengthScale) {
+    voice.synthesisConfig.lengthScale = runConfig.lengthScale.value();
+  }
+
+  if (runConfig.noiseW) {
+    voice.synthesisConfig.noiseW = runConfig.noiseW.value();
+  }
+
+  if (runConfig.sentenceSilenceSeconds) {
+    voice.synthesisConfig.sentenceSilenceSeconds =
+        runConfig.sentenceSilenceSeconds.value();
+  }
+
+  if (runConfig.phonemeSilenceSeconds) {
+    if (!voice.synthesisConfig.phonemeSilenceSeconds) {
+      // Overwrite
+      voice.synthesisConfig.phonemeSilenceSeconds =
+          runConfig.phonemeSilenceSeconds;
+    } else {
+      // Merge
+      for (const auto &[phoneme, silenceSeconds] :
+          *runConfig.phonemeSilenceSeconds) {
+        voice.synthesisConfig.phonemeSilenceSeconds->try_emplace(
+            phoneme, silenceSeconds);
+      }
+    }
+
+  } // if phonemeSilenceSeconds
+}
+
+// Stops a request whose client is gone, and lets other requests run between
+// the sentences of a long text. If another request ran in the meantime, the
+// voice is set up again exactly as it was.
+static piper::SentenceCallback getSentenceCallback(const RunConfig &runConfig, std::string &modelPath,
+                                                   piper::PiperConfig &piperConfig, piper::Voice &voice,
+                                                   piper::SynthesisResult &result, piper::CancelToken &cancelToken,
+                                                   piper::SynthesisScheduler::Slot &slot,
+                                                   std::function<bool()> isClientConnected = nullptr)
+{
+  return [&runConfig, &modelPath, &piperConfig, &voice, &result, &cancelToken, &slot,
+          isClientConnected](std::size_t remainingPhonemes) {
+    bool isPastDeadline = runConfig.deadline && (chrono::steady_clock::now() > *runConfig.deadline);
+    if (isPastDeadline || (isClientConnected && !isClientConnected())) {
+      // Nobody is waiting for the rest of the audio
+      cancelToken.cancel();
+    }
+    cancelToken.check();
+
+    auto job = getJob(runConfig, &cancelToken, isClientConnected);
+    job.estimatedSeconds = costModel.predictPhonemeSeconds(runConfig.modelPath.stem().string(),
+                                                           remainingPhonemes,
+                                                           voice.synthesisConfig.lengthScale);
+
+    // The request running in the meantime changes these (or loads another
+    // voice), and the rest of this text must sound the same
+    auto synthesisConfig = voice.synthesisConfig;
+    auto phonemizeConfig = voice.phonemizeConfig;
+    auto yieldResult = scheduler->yield(slot, job, result.queueSeconds);
+    if (yieldResult == piper::SynthesisScheduler::YieldResult::Cancelled) {
+      // Deadline passed or client left while waiting for another turn
+      cancelToken.cancel();
+      cancelToken.check();
+    }
+
+    if (yieldResult != piper::SynthesisScheduler::YieldResult::Resumed) {
+      return;
+    }
+
+    if (modelPath != runConfig.modelPath.string()) {
+      prepareVoice(runConfig, modelPath, piperConfig, voice, result);
+    }
+    voice.synthesisConfig = std::move(synthesisConfig);
+    voice.phonemizeConfig = std::move(phonemizeConfig);
+  };
+}
+
+// Settings of one item in a batch, on top of the batch's settings:
+// {
+//   "text": str,               (required)
+//   "speaker_id": int,         (optional)
+//   "speaker": str,            (optional)
+//   "output_file": str,        (optional, default is output_<index>)
+//   "noiseScale", "lengthScale", "noiseW", "sentenceSilenceSeconds"
+// }
+static void parseBatchItem(const json &itemJson, std::size_t index, const std::string &outputExtension,
+                           const piper::Voice &voice, RunConfig &itemConfig)
+{
+  if (!itemJson.contains("text")) {
+    throw std::invalid_argument("Batch item " + std::to_string(index) + " has no text");
+  }
+  itemConfig.sentence = itemJson["text"].get<std::string>();
+
+  if (itemJson.contains("output_file")) {
+    itemConfig.outputFile = itemJson["output_file"].get<std::string>() + "." + outputExtension;
+  } else {
+    itemConfig.outputFile = "output_" + std::to_string(index) + "." + outputExtension;
+  }
+
+  if (itemJson.contains("speaker_id")) {
+    itemConfig.speakerId = itemJson["speaker_id"].get<piper::SpeakerId>();
+  } else if (itemJson.contains("speaker")) {
+    // Resolve to id using speaker id map
+    auto speakerName = itemJson["speaker"].get<std::string>();
+    if (!voice.modelConfig.speakerIdMap || (voice.modelConfig.speakerIdMap->count(speakerName) < 1)) {
+      throw std::invalid_argument("No speaker named: " + speakerName);
+    }
+    itemConfig.speakerId = voice.modelConfig.speakerIdMap->at(speakerName);
+  }
+
+  if (itemJson.contains("noiseScale")) {
+    itemConfig.noiseScale = itemJson["noiseScale"].get<float>();
+  }
+  if (itemJson.contains("lengthScale")) {
+    itemConfig.lengthScale = itemJson["lengthScale"].get<float>();
+  }
+  if (itemJson.contains("noiseW")) {
+    itemConfig.noiseW = itemJson["noiseW"].get<float>();
+  }
+  if (itemJson.contains("sentenceSilenceSeconds")) {
+    itemConfig.sentenceSilenceSeconds = itemJson["sentenceSilenceSeconds"].get<float>();
+  }
+}
+
+// Append a file to a tar (ustar) archive
+static void appendTarEntry(std::string &tar, const std::string &name, const std::string &data)
+{
+  if (name.size() >= 100) {
+    throw std::invalid_argument("File name is too long for tar: " + name);
+  }
+
+  char header[512] = {0};
+  std::snprintf(header, 100, "%s", name.c_str());
+  std::snprintf(header + 100, 8, "%07o", 0644);                      // mode
+  std::snprintf(header + 108, 8, "%07o", 0);                         // uid
+  std::snprintf(header + 116, 8, "%07o", 0);                         // gid
+  std::snprintf(header + 124, 12, "%011llo", (unsigned long long)data.size());
+  std::snprintf(header + 136, 12, "%011llo", (unsigned long long)std::time(nullptr));
+  std::memset(header + 148, ' ', 8);                                 // checksum placeholder
+  header[156] = '0';                                                 // regular file
+  std::memcpy(header + 257, "ustar", 6);
+  std::memcpy(header + 263, "00", 2);
+
+  unsigned int checksum = 0;
+  for (unsigned char c : header) {
+    checksum += c;
+  }
+  std::snprintf(header + 148, 8, "%06o", checksum);
+
+  tar.append(header, sizeof(header));
+  tar.append(data);
+  tar.append((512 - (data.size() % 512)) % 512, '\0');
+}
+
+// Status and progress of a background job as JSON
+static json getJobJson(const std::string &id, SynthesisJob &job)
+{
+  std::lock_guard<std::mutex> lock(job.mutex);
+  json jobJson{
+      {"jobId", id},
+      {"status", job.status},
+      {"sentencesDone", job.sentencesDone},
+      {"progress", job.progress},
+      {"audioSeconds", job.audioSeconds},
+      {"realTimeFactor", job.realTimeFactor}};
+
+  if (job.status == "done") {
+    jobJson["audioUrl"] = "/jobs/" + id + "/audio";
+  }
+  if (!job.error.empty()) {
+    jobJson["error"] = job.error;
+  }
+
+  return jobJson;
+}
+
+// Synthesize a background job to its audio file
+static void runJob(SynthesisJob &job, std::string &modelPath, piper::PiperConfig &piperConfig, piper::Voice &voice)
+{
+  const RunConfig &runConfig = job.runConfig;
+  piper::CancelToken &cancelToken = *job.activeRequest->cancelToken;
+  piper::SynthesisResult result;
+  std::string outcome = "ok";
+  std::string error;
+
+  {
+    std::lock_guard<std::mutex> lock(job.mutex);
+    job.status = "running";
+  }
+
+  try {
+    auto slot = scheduler->acquire(getJob(runConfig, &cancelToken), result.queueSeconds);
+    cancelToken.check();
+    prepareVoice(runConfig, modelPath, piperConfig, voice, result);
+    applySynthesisConfig(runConfig, voice);
+
+    // Audio is written to disk one sentence at a time
+    auto ioStartTime = chrono::steady_clock::now();
+    ofstream audioFile(job.audioPath.string(), ios::binary);
+    if (!audioFile) {
+      throw runtime_error("Failed to create " + job.audioPath.string());
+    }
+    result.ioSeconds += secondsSince(ioStartTime);
+
+    auto yieldCallback = getSentenceCallback(runConfig, modelPath, piperConfig, voice, result, cancelToken, slot);
+    auto progressCallback = [&job, &result, &yieldCallback](std::size_t remainingPhonemes) {
+      {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        job.sentencesDone++;
+        job.progress = result.numPhonemes > 0 ? 1.0 - ((double)remainingPhonemes / result.numPhonemes) : 0;
+        job.audioSeconds = result.audioSeconds;
+        job.realTimeFactor = result.audioSeconds > 0 ? result.inferSeconds / result.audioSeconds : 0;
+      }
+      yieldCallback(remainingPhonemes);
+    };
+
+    piper::RequestArena arena;
+    auto encoder = piper::createEncoder(runConfig.outputFormat);
+    piper::textToEncodedAudio(piperConfig, voice, runConfig.sentence, job.effects, *encoder, audioFile, result,
+                              arena.resource(), progressCallback, &cancelToken);
+
+    ioStartTime = chrono::steady_clock::now();
+    audioFile.close();
+    result.ioSeconds += secondsSince(ioStartTime);
+
+    updateCostModel(runConfig, voice, result);
+  } catch (const piper::SynthesisCancelled &e) {
+    outcome = "cancelled";
+    error = e.what();
+  } catch (const piper::AdmissionError &e) {
+    outcome = "rejected";
+    error = e.what();
+  } catch (const std::exception &e) {
+    outcome = "error";
+    error = e.what();
+  }
+
+  double totalSeconds = secondsSince(runConfig.arrivalTime);
+  recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, outcome);
+  logRequest(job.requestNumber, runConfig, voice, result, totalSeconds, error);
+
+  {
+    std::lock_guard<std::mutex> lock(job.mutex);
+    if (outcome == "ok") {
+      job.status = "done";
+      job.sentencesDone++; // last sentence has no callback
+      job.progress = 1;
+      job.audioSeconds = result.audioSeconds;
+      job.realTimeFactor = result.realTimeFactor;
+    } else {
+      job.status = (outcome == "cancelled") ? "cancelled" : "failed";
+      job.error = error;
+    }
+  }
+
+  if (outcome != "ok") {
+    std::error_code ec;
+    filesystem::remove(job.audioPath, ec);
+  }
+}
+
+// Run background jobs one at a time, forever
+static void runJobs(std::string &modelPath, piper::PiperConfig &piperConfig, piper::Voice &voice)
+{
+  while (true) {
+    std::shared_ptr<SynthesisJob> job;
+    {
+      std::unique_lock<std::mutex> lock(jobsMutex);
+      jobQueueCv.wait(lock, []() { return !jobQueue.empty(); });
+      job = jobQueue.front();
+      jobQueue.pop_front();
+    }
+
+    runJob(*job, modelPath, piperConfig, voice);
+    job->activeRequest.reset();
+
+    // Forget the oldest finished jobs
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    finishedJobIds.push_back(job->runConfig.requestId);
+    while (finishedJobIds.size() > MAX_FINISHED_JOBS) {
+      auto jobIter = jobs.find(finishedJobIds.front());
+      if (jobIter != jobs.end()) {
+        std::error_code ec;
+        filesystem::remove(jobIter->second->audioPath, ec);
+        jobs.erase(jobIter);
+      }
+      finishedJobIds.pop_front();
+    }
+  }
+}
+
+#ifndef _WIN32
+// Set by SIGINT/SIGTERM in the parent of worker processes
+volatile sig_atomic_t stopWorkers = 0;
+
+// A worker that crashes this often within the window stops the server
+const std::size_t MAX_WORKER_RESTARTS = 5;
+const std::chrono::seconds WORKER_RESTART_WINDOW(60);
+const unsigned int WORKER_RESTART_DELAY_SECONDS = 1;
+
+// Fork worker processes that share the (already bound) listening socket.
+// Each worker has its own voices and eSpeak state. Returns the worker's index
+// in the worker; the parent restarts crashed workers after a delay and never
+// returns. If a worker keeps crashing, all workers are stopped.
+static int forkWorkers(int numProcesses)
+{
+  std::map<pid_t, int> workers; // pid -> index
+  std::map<int, std::deque<std::chrono::steady_clock::time_point>> restartTimes; // index -> recent restarts
+  auto startWorker = [&workers](int index) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      throw std::runtime_error("Failed to start worker process");
+    }
+    if (pid == 0) {
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      return true;
+    }
+
+    workers[pid] = index;
+    return false;
+  };
+
+  // No SA_RESTART, so waitpid is interrupted when stopping
+  struct sigaction stopAction = {};
+  stopAction.sa_handler = [](int) { stopWorkers = 1; };
+  sigaction(SIGINT, &stopAction, nullptr);
+  sigaction(SIGTERM, &stopAction, nullptr);
+
+  for (int i = 0; i < numProcesses; i++) {
+    if (startWorker(i)) {
+      return i;
+    }
+  }
+
+  bool isStopping = false;
+  int exitCode = 0;
+  while (!workers.empty()) {
+    if (stopWorkers && !isStopping) {
+      isStopping = true;
+      for (auto &[workerPid, index] : workers) {
+        kill(workerPid, SIGTERM);
+      }
+    }
+
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    auto workerIter = workers.find(pid);
+    if (workerIter == workers.end()) {
+      continue;
+    }
 
+    int index = workerIter->second;
+    workers.erase(workerIter);
+
+    bool crashed = WIFSIGNALED(status) || (WIFEXITED(status) && (WEXITSTATUS(status) != 0));
+    if (crashed && !isStopping) {
+      auto now = std::chrono::steady_clock::now();
+      auto &recentRestarts = restartTimes[index];
+      while (!recentRestarts.empty() && (now - recentRestarts.front() > WORKER_RESTART_WINDOW)) {
+        recentRestarts.pop_front();
+      }
+
+      if (recentRestarts.size() >= MAX_WORKER_RESTARTS) {
+        std::cerr << "Worker " << index << " (pid " << pid << ") crashed " << recentRestarts.size() + 1
+                  << " times in " << WORKER_RESTART_WINDOW.count() << " second(s), stopping" << std::endl;
+        exitCode = 1;
+        stopWorkers = 1;
+        continue;
+      }
+
+      std::cerr << "Worker " << index << " (pid " << pid << ") exited unexpectedly, restarting in "
+                << WORKER_RESTART_DELAY_SECONDS << " second(s)" << std::endl;
+
+      // Interrupted by SIGINT/SIGTERM
+      sleep(WORKER_RESTART_DELAY_SECONDS);
+      if (stopWorkers) {
+        continue;
+      }
+
+      recentRestarts.push_back(std::chrono::steady_clock::now());
+      if (startWorker(index)) {
+        return index;
+      }
+    }
+  }
+
+  exit(exitCode);
+}
+#endif
 
 int main(int argc, char *argv[])
 {
+  InitConfig initConfig;
+  parseStartupArgs(argc, argv, initConfig);
+
   // Create an HTTP server instance
   httplib::Server server;
 
-  // std::unique_ptr<httplib::Server> server;
+  // Only share the port with other processes when asked to
+  bool reusePort = initConfig.reusePort;
+  server.set_socket_options([reusePort](socket_t sock) {
+    int opt = 1;
+#ifdef _WIN32
+    setsockopt(sock, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, reinterpret_cast<const char *>(&opt), sizeof(opt));
+#else
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const void *>(&opt), sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reusePort) {
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const void *>(&opt), sizeof(opt));
+    }
+#endif
+#endif
+  });
+
+  // Bind before forking so all workers accept from the same socket
+  bool isBound = false;
+  std::string address;
+  if (initConfig.unixSocketPath) {
+#ifdef _WIN32
+    std::cerr << "Unix domain sockets are not supported on Windows" << std::endl;
+    return 1;
+#else
+    // Remove socket left over from a previous run, but never anything else
+    struct stat socketStat;
+    if (lstat(initConfig.unixSocketPath->c_str(), &socketStat) == 0) {
+      if (!S_ISSOCK(socketStat.st_mode)) {
+        std::cerr << "Not a socket, refusing to replace: " << *initConfig.unixSocketPath << std::endl;
+        return 1;
+      }
+      unlink(initConfig.unixSocketPath->c_str());
+    }
+    server.set_address_family(AF_UNIX);
+    isBound = server.bind_to_port(*initConfig.unixSocketPath, 80);
+    address = "unix:" + *initConfig.unixSocketPath;
+#endif
+  } else {
+    isBound = server.bind_to_port("0.0.0.0", stoi(initConfig.port.value()));
+    address = "http://localhost:" + initConfig.port.value();
+  }
+
+  if (!isBound) {
+    std::cerr << "Failed to listen on " << address << std::endl;
+    return 1;
+  }
+
+  // Workers are forked before any threads are started
+  std::string logPath = "logs/piper_log.txt";
+  if (initConfig.numProcesses > 1) {
+#ifdef _WIN32
+    std::cerr << "--processes is not supported on Windows" << std::endl;
+    return 1;
+#else
+    int workerIndex = forkWorkers(initConfig.numProcesses);
+    logPath = "logs/piper_log." + std::to_string(workerIndex) + ".txt";
+    initConfig.jobsPath /= "worker-" + std::to_string(workerIndex);
+#endif
+  }
+
+  // The phonemizer pool's spawner is also forked before any threads are
+  // started, once per worker process. They phonemize with espeak-ng-data next to the
+  // executable; requests with another eSpeakDataPath use eSpeak in-process.
+  std::shared_ptr<piper::PhonemizerPool> phonemizerPool;
+  if (initConfig.numPhonemizerWorkers > 1) {
+#ifdef _WIN32
+    std::cerr << "--phonemizer-workers is not supported on Windows" << std::endl;
+    return 1;
+#else
+    try {
+      phonemizerPool = std::make_shared<piper::PhonemizerPool>(initConfig.numPhonemizerWorkers,
+                                                               getDefaultESpeakDataPath());
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+#endif
+  }
+
+  // Log from a background thread so requests never wait on console or disk
+  // writes. When the queue is full, the oldest messages are dropped.
+  spdlog::init_thread_pool(LOG_QUEUE_SIZE, 1);
+
   // Create a console sink
   auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
   console_sink->set_level(spdlog::level::info);
   console_sink->set_pattern("[%H:%M:%S] [%^%L%$] %v");
 
   // Create a file sink
-  auto file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("logs/piper_log.txt", true);
+  auto file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>(logPath, true);
   file_sink->set_level(spdlog::level::debug);
   file_sink->set_pattern("[%H:%M:%S] [%L] %v");
   
   // Create a multi-sink logger
   std::vector<spdlog::sink_ptr> sinks {console_sink, file_sink};
-  auto logger = std::make_shared<spdlog::logger>("piper", sinks.begin(), sinks.end());
-  logger->set_level(spdlog::level::debug);
+  auto logger = std::make_shared<spdlog::async_logger>("piper", sinks.begin(), sinks.end(),
+                                                       spdlog::thread_pool(),
+                                                       spdlog::async_overflow_policy::overrun_oldest);
+  logger->set_level(spdlog::level::info);
   logger->set_pattern("[%H:%M:%S] [%L] %v");
-  // spdlog::flush_on(spdlog::level::debug);
+  logger->flush_on(spdlog::level::warn);
   spdlog::set_default_logger(logger);
+  spdlog::flush_every(std::chrono::seconds(1));
+  if (initConfig.logLevel) {
+    spdlog::set_level(*initConfig.logLevel);
+  }
 
   server.set_default_headers({{"Server", "piper_server.cpp"}});
   // // set timeouts and change hostname and port
   server.set_read_timeout (params.timeout_read);
   server.set_write_timeout(params.timeout_write);
-  spdlog::flush_on(spdlog::level::debug);
-  InitConfig initConfig;
-  parseStartupArgs(argc, argv, initConfig);
+  scheduler = std::make_unique<piper::SynthesisScheduler>(initConfig.maxQueueLength);
+
+  // A thread for every request the scheduler can queue, plus the running one,
+  // so requests past the queue limit reach admission control and get their
+  // 503 instead of waiting for a thread. Connections beyond that are closed
+  // once this many are waiting for a thread.
+  std::size_t numHttpThreads = initConfig.maxQueueLength + 1 + CONTROL_THREADS;
+  server.new_task_queue = [numHttpThreads]() {
+    return new httplib::ThreadPool(numHttpThreads, /*max_queued_requests*/ numHttpThreads);
+  };
 
 
   std::string modelPath;
   piper::PiperConfig piperConfig;
   piper::Voice voice;
+  piperConfig.phonemizerPool = phonemizerPool;
+  piperConfig.useQuantizedModel = initConfig.useQuantizedModel;
 
   spdlog::info("Starting Piper TTS Server");
+  setupMetrics();
+
+  filesystem::create_directories(initConfig.jobsPath);
+  std::thread(runJobs, std::ref(modelPath), std::ref(piperConfig), std::ref(voice)).detach();
 
   // Define a GET route at "/"
   server.Get("/", [](const httplib::Request &req, httplib::Response &res)
              { res.set_content("Hello, World! This is a GET response.", "text/plain"); });
 
+  // Get or change log level at runtime, e.g. {"level": "debug"}
+  server.Get("/log-level", [](const httplib::Request &, httplib::Response &res)
+  {
+    auto levelName = spdlog::level::to_string_view(spdlog::get_level());
+    res.set_content(json{{"level", std::string(levelName.data(), levelName.size())}}.dump(), "application/json");
+  });
+
+  server.Put("/log-level", [](const httplib::Request &req, httplib::Response &res)
+  {
+    try {
+      auto levelName = json::parse(req.body)["level"].get<std::string>();
+      auto level = spdlog::level::from_str(levelName);
+      if ((level == spdlog::level::off) && (levelName != "off")) {
+        throw std::invalid_argument("Unknown log level: " + levelName);
+      }
+
+      spdlog::set_level(level);
+      spdlog::warn("Log level set to {}", levelName);
+      res.set_content(json{{"level", levelName}}.dump(), "application/json");
+    } catch (const std::exception &e) {
+      res.status = 400;
+      res.set_content("Error: " + string(e.what()), "text/plain");
+    }
+  });
+
+  // Prometheus metrics
+  server.Get("/metrics", [](const httplib::Request &, httplib::Response &res)
+             { res.set_content(metrics.render(), "text/plain; version=0.0.4"); });
+
+  // Cancel a request that is queued or being synthesized
+  server.Delete(R"(/tts/([^/]+))", [](const httplib::Request &req, httplib::Response &res)
+  {
+    std::string id = req.matches[1];
+    std::shared_ptr<piper::CancelToken> cancelToken;
+    {
+      std::lock_guard<std::mutex> lock(activeRequestsMutex);
+      auto requestIter = activeRequests.find(id);
+      if (requestIter != activeRequests.end()) {
+        cancelToken = requestIter->second;
+      }
+    }
+
+    if (!cancelToken) {
+      res.status = 404;
+      res.set_content("Error: No active request with id " + id, "text/plain");
+      return;
+    }
+
+    cancelToken->cancel();
+    scheduler->wakeWaiters();
+    spdlog::info("Cancelled request {}", id);
+    res.set_content(json{{"requestId", id}, {"cancelled", true}}.dump(), "application/json");
+  });
+
+  // Start long-form synthesis in the background.
+  // Body is the same as /tts, priority defaults to bulk.
+  server.Post("/jobs", [jobsPath = initConfig.jobsPath](const httplib::Request &req, httplib::Response &res)
+  {
+    try {
+      auto job = std::make_shared<SynthesisJob>();
+      job->runConfig.priority = piper::PRIORITY_BULK;
+      parseArgsFromJson(json::parse(req.body), job->runConfig, job->effects);
+
+      job->requestNumber = nextRequestId++;
+      std::string &id = job->runConfig.requestId;
+      if (id.empty()) {
+        id = "job-" + std::to_string(job->requestNumber);
+      }
+
+      // Id is used as a file name
+      bool isValidId = std::all_of(id.begin(), id.end(), [](char c) {
+        return std::isalnum((unsigned char)c) || (c == '-') || (c == '_');
+      });
+      if (!isValidId) {
+        throw std::invalid_argument("Job id may only contain letters, digits, '-' and '_': " + id);
+      }
+
+      auto encoder = piper::createEncoder(job->runConfig.outputFormat);
+      job->contentType = encoder->contentType();
+      job->audioPath = jobsPath / (id + "." + encoder->fileExtension());
+
+      {
+        // Ids of queued, running and remembered finished jobs stay reserved
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        if (jobs.count(id) > 0) {
+          res.status = 409;
+          res.set_content("Error: Job id is already in use: " + id, "text/plain");
+          return;
+        }
+        job->activeRequest = std::make_shared<ActiveRequest>(id);
+        jobs[id] = job;
+        jobQueue.push_back(job);
+      }
+      jobQueueCv.notify_one();
+
+      res.status = 202;
+      res.set_header("Location", "/jobs/" + id);
+      res.set_content(getJobJson(id, *job).dump(), "application/json");
+    } catch (const std::exception &e) {
+      res.status = 400;
+      res.set_content("Error: " + string(e.what()), "text/plain");
+    }
+  });
+
+  server.Get(R"(/jobs/([^/]+))", [](const httplib::Request &req, httplib::Response &res)
+  {
+    std::string id = req.matches[1];
+    std::shared_ptr<SynthesisJob> job;
+    {
+      std::lock_guard<std::mutex> lock(jobsMutex);
+      auto jobIter = jobs.find(id);
+      if (jobIter != jobs.end()) {
+        job = jobIter->second;
+      }
+    }
+
+    if (!job) {
+      res.status = 404;
+      res.set_content("Error: No job with id " + id, "text/plain");
+      return;
+    }
+
+    res.set_content(getJobJson(id, *job).dump(), "application/json");
+  });
+
+  // Audio of a finished job (supports Range requests)
+  server.Get(R"(/jobs/([^/]+)/audio)", [](const httplib::Request &req, httplib::Response &res)
+  {
+    std::string id = req.matches[1];
+    std::shared_ptr<SynthesisJob> job;
+    {
+      std::lock_guard<std::mutex> lock(jobsMutex);
+      auto jobIter = jobs.find(id);
+      if (jobIter != jobs.end()) {
+        job = jobIter->second;
+      }
+    }
+
+    if (!job) {
+      res.status = 404;
+      res.set_content("Error: No job with id " + id, "text/plain");
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      if (job->status != "done") {
+        res.status = 409;
+        res.set_content("Error: Job is " + job->status, "text/plain");
+        return;
+      }
+    }
+
+    auto audioFile = std::make_shared<ifstream>(job->audioPath.string(), ios::binary);
+    if (!*audioFile) {
+      res.status = 404;
+      res.set_content("Error: Audio is no longer available", "text/plain");
+      return;
+    }
+
+    // httplib answers Range requests with the requested part(s)
+    res.set_content_provider(
+        (size_t)filesystem::file_size(job->audioPath), job->contentType,
+        [audioFile](size_t offset, size_t length, httplib::DataSink &sink) {
+          char buffer[64 * 1024];
+          audioFile->clear();
+          audioFile->seekg((std::streamoff)offset);
+          audioFile->read(buffer, (std::streamsize)std::min(length, sizeof(buffer)));
+          auto numRead = audioFile->gcount();
+          return (numRead > 0) && sink.write(buffer, (size_t)numRead);
+        });
+  });
+
   // Define a POST route at "/echo"
   server.Post("/tts", [&modelPath, &piperConfig, &voice](const httplib::Request &req, httplib::Response &res)
   { 
+    InFlightGuard inFlightGuard;
+    uint64_t requestId = nextRequestId++;
+    auto requestStartTime = chrono::steady_clock::now();
+    RunConfig runConfig;
+    piper::SynthesisResult result;
+
+    // Declared outside the try block so the slot is still held when an error
+    // is handled below
+    std::optional<piper::SynthesisScheduler::Slot> slot;
     try {
-      RunConfig runConfig;
       piper::AudioEffects effects;
       // // Log Body
       // std::cout << "Request body: " << req.body << std::endl;
@@ -194,140 +1461,77 @@ int main(int argc, char *argv[])
       // std::cout << "Output Path: " << runConfig.outputPath.value().string() << std::endl;
       // std::cout << "Use CUDA: " << runConfig.useCuda << std::endl;
 
-      if (modelPath != runConfig.modelPath.string())
-      {
-        std::lock_guard<std::mutex> lock(processingMutex);
-        auto startTime = chrono::steady_clock::now();
-        modelPath = runConfig.modelPath.string();
-        // std::cout << "Loading voice from " << runConfig.modelPath.string() << " (config=" << runConfig.modelConfigPath.string() << ")" << std::endl;
-        piper::loadVoice(piperConfig, runConfig.modelPath.string(),
-                    runConfig.modelConfigPath.string(), voice, runConfig.speakerId,
-                    runConfig.useCuda);
-        auto endTime = chrono::steady_clock::now();
-        spdlog::info("Loaded onnx model in {} second(s)", std::chrono::duration<double>(endTime - startTime).count());
-      }
-      // else
-      // {
-      //   std::cout << "Model already loaded" << std::endl;
-      // }
-
-      // Get the path to the piper executable so we can locate espeak-ng-data, etc.
-      // next to it.
-      #ifdef _MSC_VER
-        auto exePath = []() {
-          wchar_t moduleFileName[MAX_PATH] = {0};
-          GetModuleFileNameW(nullptr, moduleFileName, std::size(moduleFileName));
-          return filesystem::path(moduleFileName);
-        }();
-      #else
-      #ifdef __APPLE__
-        auto exePath = []() {
-          char moduleFileName[PATH_MAX] = {0};
-          uint32_t moduleFileNameSize = std::size(moduleFileName);
-          _NSGetExecutablePath(moduleFileName, &moduleFileNameSize);
-          return filesystem::path(moduleFileName);
-        }();
-      #else
-        auto exePath = filesystem::canonical("/proc/self/exe");
-      #endif
-      #endif
-
-      if (voice.phonemizeConfig.phonemeType == piper::eSpeakPhonemes) {
-        spdlog::debug("Voice uses eSpeak phonemes ({})",
-                      voice.phonemizeConfig.eSpeak.voice);
-
-        if (runConfig.eSpeakDataPath) {
-          // User provided path
-          piperConfig.eSpeakDataPath = runConfig.eSpeakDataPath.value().string();
-        } else {
-          // Assume next to piper executable
-          piperConfig.eSpeakDataPath =
-              std::filesystem::absolute(
-                  exePath.parent_path().append("espeak-ng-data"))
-                  .string();
-
-          spdlog::debug("espeak-ng-data directory is expected at {}",
-                        piperConfig.eSpeakDataPath);
-        }
-      } else {
-        // Not using eSpeak
-        piperConfig.useESpeak = false;
+      if (runConfig.requestId.empty()) {
+        runConfig.requestId = std::to_string(requestId);
       }
-
-      // Enable libtashkeel for Arabic
-      if (voice.phonemizeConfig.eSpeak.voice == "ar") {
-        piperConfig.useTashkeel = true;
-        if (runConfig.tashkeelModelPath) {
-          // User provided path
-          piperConfig.tashkeelModelPath =
-              runConfig.tashkeelModelPath.value().string();
-        } else {
-          // Assume next to piper executable
-          piperConfig.tashkeelModelPath =
-              std::filesystem::absolute(
-                  exePath.parent_path().append("libtashkeel_model.ort"))
-                  .string();
-
-          spdlog::debug("libtashkeel model is expected at {}",
-                        piperConfig.tashkeelModelPath.value());
-        }
-      }
-      
-      {
-        std::lock_guard<std::mutex> lock(processingMutex);
-        piper::initialize(piperConfig);
-      }
-
-      
-      // Scales
-      if (runConfig.noiseScale) {
-        voice.synthesisConfig.noiseScale = runConfig.noiseScale.value();
-      }
-
-      if (runConfig.lengthScale) {
-        voice.synthesisConfig.lengthScale = runConfig.lengthScale.value();
-      }
-
-      if (runConfig.noiseW) {
-        voice.synthesisConfig.noiseW = runConfig.noiseW.value();
-      }
-
-      if (runConfig.sentenceSilenceSeconds) {
-        voice.synthesisConfig.sentenceSilenceSeconds =
-            runConfig.sentenceSilenceSeconds.value();
-      }
-
-      spdlog::debug("Synthesis config: noiseScale={}, lengthScale={}, noiseW={}, sentenceSilenceSeconds={}",
-                    voice.synthesisConfig.noiseScale, voice.synthesisConfig.lengthScale,
-                    voice.synthesisConfig.noiseW, voice.synthesisConfig.sentenceSilenceSeconds);
-      if (runConfig.phonemeSilenceSeconds) {
-        if (!voice.synthesisConfig.phonemeSilenceSeconds) {
-          // Overwrite
-          voice.synthesisConfig.phonemeSilenceSeconds =
-              runConfig.phonemeSilenceSeconds;
-        } else {
-          // Merge
-          for (const auto &[phoneme, silenceSeconds] :
-              *runConfig.phonemeSilenceSeconds) {
-            voice.synthesisConfig.phonemeSilenceSeconds->try_emplace(
-                phoneme, silenceSeconds);
-          }
-        }
-
-      } // if phonemeSilenceSeconds
-      if (voice.synthesisConfig.phonemeSilenceSeconds) {
-        std::stringstream ss;
-        for (const auto& [phoneme, silenceSeconds] : *voice.synthesisConfig.phonemeSilenceSeconds) {
-          ss << phoneme << ": " << silenceSeconds << ", ";
-        }
-        spdlog::debug("Phoneme silence seconds: {}", ss.str());
-      } else {
-        spdlog::debug("Phoneme silence seconds: none");
+      auto activeRequest = std::make_shared<ActiveRequest>(runConfig.requestId);
+      res.set_header("X-Request-Id", runConfig.requestId);
+      auto isClientConnected = [&req]() { return !req.is_connection_closed(); };
+
+      // Hold the synthesizer from loading the voice until synthesis is done.
+      // Admission control runs here, so a rejected request still gets its
+      // 429/503 before any response is committed.
+      slot.emplace(scheduler->acquire(getJob(runConfig, activeRequest->cancelToken.get(), isClientConnected),
+                                      result.queueSeconds));
+      activeRequest->cancelToken->check();
+      prepareVoice(runConfig, modelPath, piperConfig, voice, result);
+
+      piper::RequestArena arena;
+      auto encoder = piper::createEncoder(runConfig.outputFormat);
+
+      if (runConfig.outputType == OUTPUT_RAW && runConfig.stream) {
+        // Synthesize while httplib sends the response.
+        // Each sentence goes out as soon as it is encoded, and timings are
+        // sent as a trailer at the end. The provider runs right after this
+        // handler returns and takes over the slot, so the voice prepared
+        // here is still loaded.
+        std::shared_ptr<piper::AudioEncoder> streamEncoder = std::move(encoder);
+        auto streamSlot = std::make_shared<piper::SynthesisScheduler::Slot>(std::move(*slot));
+        slot.reset();
+        res.set_header("Trailer", "Server-Timing");
+        res.set_chunked_content_provider(
+            streamEncoder->contentType(),
+            [&modelPath, &piperConfig, &voice, runConfig, effects, streamEncoder, result, requestId, requestStartTime,
+             activeRequest, streamSlot](size_t, httplib::DataSink &sink) mutable {
+              DataSinkStreamBuf sinkBuf(sink);
+              std::ostream sinkStream(&sinkBuf);
+              piper::SynthesisResult streamResult = result;
+              piper::RequestArena arena;
+              try {
+                activeRequest->cancelToken->check();
+                applySynthesisConfig(runConfig, voice);
+                piper::textToEncodedAudio(piperConfig, voice, runConfig.sentence, effects, *streamEncoder, sinkStream, streamResult, arena.resource(),
+                                          getSentenceCallback(runConfig, modelPath, piperConfig, voice, streamResult,
+                                                              *activeRequest->cancelToken, *streamSlot,
+                                                              [&sink]() { return sink.is_writable(); }),
+                                          activeRequest->cancelToken.get());
+              } catch (const std::exception &e) {
+                bool isCancelled = activeRequest->cancelToken->isCancelled();
+                double totalSeconds = secondsSince(requestStartTime);
+                recordRequestMetrics(runConfig.modelPath.stem().string(), streamResult, totalSeconds,
+                                     isCancelled ? "cancelled" : "error");
+                logRequest(requestId, runConfig, voice, streamResult, totalSeconds, e.what());
+                streamSlot.reset();
+                return false;
+              }
+
+              updateCostModel(runConfig, voice, streamResult);
+              double totalSeconds = secondsSince(requestStartTime);
+              recordRequestMetrics(runConfig.modelPath.stem().string(), streamResult, totalSeconds, "ok");
+              logRequest(requestId, runConfig, voice, streamResult, totalSeconds);
+              streamSlot.reset();
+              sink.done_with_trailer({{"Server-Timing", getServerTiming(streamResult, totalSeconds)}});
+              return true;
+            });
+        return;
       }
 
-      piper::SynthesisResult result;
+      applySynthesisConfig(runConfig, voice);
       {
-        std::lock_guard<std::mutex> lock(processingMutex);
+        // Output to stdout is not interleaved with other requests
+        auto sentenceCallback = getSentenceCallback(runConfig, modelPath, piperConfig, voice, result,
+                                                    *activeRequest->cancelToken, *slot, isClientConnected);
+        auto *cancelToken = activeRequest->cancelToken.get();
         if (runConfig.outputType == OUTPUT_DIRECTORY || runConfig.outputType == OUTPUT_FILE) {
           // Output audio to automatically-named WAV file in a directory
           filesystem::path outputPath = runConfig.outputPath.value();
@@ -336,43 +1540,253 @@ int main(int argc, char *argv[])
           // log name
           spdlog::debug("Output file: {}", outputPath.string());
 
+          auto ioStartTime = chrono::steady_clock::now();
           ofstream audioFile(outputPath.string(), ios::binary);
-          piper::textToWavFile(piperConfig, voice, runConfig.sentence, effects, audioFile, result);
-          // Return output path to the client as json
+          result.ioSeconds += secondsSince(ioStartTime);
+
+          piper::textToEncodedAudio(piperConfig, voice, runConfig.sentence, effects, *encoder, audioFile, result, arena.resource(), sentenceCallback, cancelToken);
+
+          ioStartTime = chrono::steady_clock::now();
+          audioFile.close();
+          result.ioSeconds += secondsSince(ioStartTime);
+
+          // Return output path and timings to the client as json
           json outputJson;
           outputJson["outputPath"] = runConfig.outputPath.value().string();
           outputJson["outputFile"] = runConfig.outputFile;
+          outputJson["timings"] = getTimingJson(result, secondsSince(requestStartTime));
           res.set_content(outputJson.dump(), "application/json");
         }
         else if (runConfig.outputType == OUTPUT_STDOUT) {
           // Output audio to stdout
-          piper::textToWavFile(piperConfig, voice, runConfig.sentence, effects, cout, result);
+          piper::textToEncodedAudio(piperConfig, voice, runConfig.sentence, effects, *encoder, cout, result, arena.resource(), nullptr, cancelToken);
+
+          auto ioStartTime = chrono::steady_clock::now();
+          cout.flush();
+          result.ioSeconds += secondsSince(ioStartTime);
 
           res.set_content("Audio output to stdout", "text/plain");
         }
         else if (runConfig.outputType == OUTPUT_RAW) {
-          // Raw output to stdout
-          stringstream buffer;
-          piper::textToWavFile(piperConfig, voice, runConfig.sentence, effects, buffer, result);
-          res.set_content(buffer.str(), "audio/wav");
+          // Encode straight into the response body (no intermediate copies)
+          std::string body;
+          reserveAudioBody(body, runConfig.sentence, voice, effects, *encoder);
+          StringStreamBuf bodyBuf(body);
+          std::ostream bodyStream(&bodyBuf);
+          piper::textToEncodedAudio(piperConfig, voice, runConfig.sentence, effects, *encoder, bodyStream, result, arena.resource(), sentenceCallback, cancelToken);
+          res.set_content(std::move(body), encoder->contentType());
         }
         else {
           throw runtime_error("Invalid output type");
         }
       }
 
-      spdlog::info("Real-time factor: {} (infer={} sec, audio={} sec)",
-                  result.realTimeFactor, result.inferSeconds,
-                  result.audioSeconds);
+      updateCostModel(runConfig, voice, result);
+      double totalSeconds = secondsSince(requestStartTime);
+      res.set_header("Server-Timing", getServerTiming(result, totalSeconds));
+      recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, "ok");
+      logRequest(requestId, runConfig, voice, result, totalSeconds);
       
       
+    } catch (const piper::AdmissionError &e) {
+      // Rejected before synthesis, the loaded voice is still fine
+      double totalSeconds = secondsSince(requestStartTime);
+      recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, "rejected");
+      logRequest(requestId, runConfig, voice, result, totalSeconds, e.what());
+
+      auto retrySeconds = (int)std::ceil(scheduler->predictWaitSeconds(getJob(runConfig)));
+      res.status = e.status;
+      res.set_header("Retry-After", std::to_string(std::max(1, retrySeconds)));
+      res.set_content("Error: " + string(e.what()), "text/plain");
+    } catch (const piper::SynthesisCancelled &e) {
+      // Stopped early, the loaded voice is still fine
+      double totalSeconds = secondsSince(requestStartTime);
+      recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, "cancelled");
+      logRequest(requestId, runConfig, voice, result, totalSeconds, e.what());
+
+      res.status = 499; // client closed request (nginx)
+      res.set_content("Error: " + string(e.what()), "text/plain");
     } catch (const std::exception &e) {
-      spdlog::error("Error: {}", e.what());
+      double totalSeconds = secondsSince(requestStartTime);
+      recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, "error");
+      logRequest(requestId, runConfig, voice, result, totalSeconds, e.what());
+
+      // Voice may be in a bad state, so unload it. Only done while holding
+      // the synthesizer, since other requests share the voice and eSpeak.
+      if (slot) {
+        modelPath = "";
+        piper::terminate(piperConfig);
+      }
 
-      // Resetting variables
-      modelPath = "";
-      piper::terminate(piperConfig);
 
+      res.status = 400;
+      res.set_content("Error: " + string(e.what()), "text/plain");
+    }
+  });
+
+  // Synthesize many utterances with one voice in a single request.
+  // Body has the same settings as /tts (applied to every item), plus
+  // "items": [{"text": ..., ...}, ...]. Files are written to outputPath and
+  // a manifest is returned, or a tar archive with the audio and
+  // manifest.json is returned for OUTPUT_RAW.
+  server.Post("/tts/batch", [&modelPath, &piperConfig, &voice](const httplib::Request &req, httplib::Response &res)
+  {
+    InFlightGuard inFlightGuard;
+    uint64_t requestId = nextRequestId++;
+    auto requestStartTime = chrono::steady_clock::now();
+    RunConfig runConfig;
+    piper::SynthesisResult result;
+    try {
+      piper::AudioEffects effects;
+      auto batchJson = json::parse(req.body);
+      parseArgsFromJson(batchJson, runConfig, effects);
+      if (!batchJson.contains("items") || !batchJson["items"].is_array()) {
+        throw std::invalid_argument("Batch needs an array of items");
+      }
+      if (runConfig.outputType == OUTPUT_STDOUT) {
+        throw std::invalid_argument("OUTPUT_STDOUT is not supported for batches");
+      }
+
+      const json &items = batchJson["items"];
+      std::size_t remainingChars = 0;
+      for (auto &item : items) {
+        remainingChars += item.value("text", std::string()).size();
+      }
+
+      if (runConfig.requestId.empty()) {
+        runConfig.requestId = std::to_string(requestId);
+      }
+      ActiveRequest activeRequest(runConfig.requestId);
+      piper::CancelToken &cancelToken = *activeRequest.cancelToken;
+      res.set_header("X-Request-Id", runConfig.requestId);
+
+      std::string voiceName = runConfig.modelPath.stem().string();
+      auto isClientConnected = [&req]() { return !req.is_connection_closed(); };
+      auto job = getJob(runConfig, &cancelToken, isClientConnected);
+      job.estimatedSeconds = costModel.predictSeconds(voiceName, remainingChars, runConfig.lengthScale.value_or(1.0f));
+
+      // Voice is loaded and set up once for the whole batch
+      auto slot = scheduler->acquire(job, result.queueSeconds);
+      cancelToken.check();
+      prepareVoice(runConfig, modelPath, piperConfig, voice, result);
+      applySynthesisConfig(runConfig, voice);
+      auto batchSynthesisConfig = voice.synthesisConfig;
+
+      std::string outputExtension = piper::createEncoder(runConfig.outputFormat)->fileExtension();
+      std::string tar;
+      json manifestJson = json::array();
+      piper::RequestArena arena;
+      for (std::size_t i = 0; i < items.size(); i++) {
+        RunConfig itemConfig = runConfig;
+        parseBatchItem(items[i], i, outputExtension, voice, itemConfig);
+
+        // Item settings don't carry over to the next item
+        voice.synthesisConfig = batchSynthesisConfig;
+        applySynthesisConfig(itemConfig, voice);
+        if (itemConfig.speakerId) {
+          voice.synthesisConfig.speakerId = itemConfig.speakerId;
+        }
+
+        double audioSecondsBefore = result.audioSeconds;
+        double inferSecondsBefore = result.inferSeconds;
+        auto encoder = piper::createEncoder(runConfig.outputFormat);
+        if (runConfig.outputType == OUTPUT_RAW) {
+          std::string itemAudio;
+          reserveAudioBody(itemAudio, itemConfig.sentence, voice, effects, *encoder);
+          StringStreamBuf itemBuf(itemAudio);
+          std::ostream itemStream(&itemBuf);
+          piper::textToEncodedAudio(piperConfig, voice, itemConfig.sentence, effects, *encoder, itemStream, result,
+                                    arena.resource(), nullptr, &cancelToken);
+          appendTarEntry(tar, itemConfig.outputFile, itemAudio);
+        } else {
+          filesystem::path outputPath = runConfig.outputPath.value();
+          outputPath.append(itemConfig.outputFile);
+
+          auto ioStartTime = chrono::steady_clock::now();
+          ofstream audioFile(outputPath.string(), ios::binary);
+          result.ioSeconds += secondsSince(ioStartTime);
+
+          piper::textToEncodedAudio(piperConfig, voice, itemConfig.sentence, effects, *encoder, audioFile, result,
+                                    arena.resource(), nullptr, &cancelToken);
+
+          ioStartTime = chrono::steady_clock::now();
+          audioFile.close();
+          result.ioSeconds += secondsSince(ioStartTime);
+        }
+
+        double itemAudioSeconds = result.audioSeconds - audioSecondsBefore;
+        double itemInferSeconds = result.inferSeconds - inferSecondsBefore;
+        manifestJson.push_back({
+            {"index", i},
+            {"outputFile", itemConfig.outputFile},
+            {"audioSeconds", itemAudioSeconds},
+            {"realTimeFactor", itemAudioSeconds > 0 ? itemInferSeconds / itemAudioSeconds : 0.0}});
+
+        // Stop if nobody is waiting for the rest of the batch
+        if (!isClientConnected()) {
+          cancelToken.cancel();
+        }
+        cancelToken.check();
+
+        // Let other requests run between items
+        remainingChars -= std::min(remainingChars, itemConfig.sentence.size());
+        job.estimatedSeconds = costModel.predictSeconds(voiceName, remainingChars, runConfig.lengthScale.value_or(1.0f));
+        if ((i + 1) == items.size()) {
+          continue;
+        }
+
+        auto yieldResult = scheduler->yield(slot, job, result.queueSeconds);
+        if (yieldResult == piper::SynthesisScheduler::YieldResult::Cancelled) {
+          cancelToken.cancel();
+          cancelToken.check();
+        }
+
+        if (yieldResult == piper::SynthesisScheduler::YieldResult::Resumed) {
+          cancelToken.check();
+          if (modelPath != runConfig.modelPath.string()) {
+            prepareVoice(runConfig, modelPath, piperConfig, voice, result);
+            applySynthesisConfig(runConfig, voice);
+            batchSynthesisConfig = voice.synthesisConfig;
+          }
+        }
+      }
+
+      voice.synthesisConfig = batchSynthesisConfig;
+
+      double totalSeconds = secondsSince(requestStartTime);
+      json outputJson;
+      outputJson["items"] = manifestJson;
+      outputJson["timings"] = getTimingJson(result, totalSeconds);
+      if (runConfig.outputType == OUTPUT_RAW) {
+        appendTarEntry(tar, "manifest.json", outputJson.dump());
+        tar.append(1024, '\0'); // end of archive
+        res.set_content(std::move(tar), "application/x-tar");
+      } else {
+        outputJson["outputPath"] = runConfig.outputPath.value().string();
+        res.set_content(outputJson.dump(), "application/json");
+      }
+
+      res.set_header("Server-Timing", getServerTiming(result, totalSeconds));
+      recordRequestMetrics(voiceName, result, totalSeconds, "ok");
+      logRequest(requestId, runConfig, voice, result, totalSeconds);
+    } catch (const piper::AdmissionError &e) {
+      double totalSeconds = secondsSince(requestStartTime);
+      recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, "rejected");
+      logRequest(requestId, runConfig, voice, result, totalSeconds, e.what());
+
+      res.status = e.status;
+      res.set_content("Error: " + string(e.what()), "text/plain");
+    } catch (const piper::SynthesisCancelled &e) {
+      double totalSeconds = secondsSince(requestStartTime);
+      recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, "cancelled");
+      logRequest(requestId, runConfig, voice, result, totalSeconds, e.what());
+
+      res.status = 499; // client closed request (nginx)
+      res.set_content("Error: " + string(e.what()), "text/plain");
+    } catch (const std::exception &e) {
+      double totalSeconds = secondsSince(requestStartTime);
+      recordRequestMetrics(runConfig.modelPath.stem().string(), result, totalSeconds, "error");
+      logRequest(requestId, runConfig, voice, result, totalSeconds, e.what());
 
       res.status = 400;
       res.set_content("Error: " + string(e.what()), "text/plain");
@@ -380,9 +1794,10 @@ int main(int argc, char *argv[])
   });
 
   // Start the server on port 8080
-  spdlog::info("Server is running on http://localhost:{}", initConfig.port.value());
+  spdlog::info("Server is running on {}", address);
   // std::cout << "Server is running on http://localhost:" << initConfig.port.value() << std::endl;
-  server.listen("0.0.0.0", stoi(initConfig.port.value()));
+  server.listen_after_bind();
+  spdlog::shutdown();
 
   return 0;
 }
@@ -395,6 +1810,14 @@ void printUsage(char *argv[]) {
   cerr << "options:" << endl;
   cerr << "   -h        --help              show this message and exit" << endl;
   cerr << "   -p  PORT  --port       PORT  port to use for the server (default: 8080)" << endl;
+  cerr << "   --max-queue N                 maximum requests waiting for synthesis (default: 64, uses N + 9 HTTP threads)" << endl;
+  cerr << "   --jobs-dir DIR                directory for audio of background jobs (default: jobs)" << endl;
+  cerr << "   --unix-socket PATH            listen on a Unix domain socket instead of TCP" << endl;
+  cerr << "   --reuse-port                  let other processes listen on the same port (SO_REUSEPORT)" << endl;
+  cerr << "   --processes N                 number of worker processes sharing the socket (default: 1)" << endl;
+  cerr << "                                 (only .ort voices share model weights between processes, .onnx voices are copied into each)" << endl;
+  cerr << "   --phonemizer-workers N        number of eSpeak processes phonemizing sentences in parallel (default: 1, max: 64)" << endl;
+  cerr << "   --no-quantized                ignore .int8.onnx/.fp16.onnx model variants" << endl;
   cerr << "   -q       --quiet              disable logging" << endl;
   cerr << "   --debug                       print DEBUG messages to the console" << endl;
   cerr << endl;
@@ -416,13 +1839,39 @@ void parseStartupArgs(int argc, char *argv[], InitConfig &initConfig) {
       ensureArg(argc, argv, i);
       initConfig.port = argv[++i];
     }
+    else if (arg == "--jobs-dir") {
+      ensureArg(argc, argv, i);
+      initConfig.jobsPath = argv[++i];
+    }
+    else if (arg == "--max-queue") {
+      ensureArg(argc, argv, i);
+      initConfig.maxQueueLength = (std::size_t)stoul(argv[++i]);
+    }
+    else if (arg == "--unix-socket") {
+      ensureArg(argc, argv, i);
+      initConfig.unixSocketPath = argv[++i];
+    }
+    else if (arg == "--reuse-port") {
+      initConfig.reusePort = true;
+    }
+    else if (arg == "--processes") {
+      ensureArg(argc, argv, i);
+      initConfig.numProcesses = std::max(1, stoi(argv[++i]));
+    }
+    else if (arg == "--phonemizer-workers") {
+      ensureArg(argc, argv, i);
+      initConfig.numPhonemizerWorkers = std::max(1, stoi(argv[++i]));
+    }
+    else if (arg == "--no_quantized" || arg == "--no-quantized") {
+      initConfig.useQuantizedModel = false;
+    }
     else if (arg == "--debug") {
       // Set DEBUG logging
-      spdlog::set_level(spdlog::level::debug);
+      initConfig.logLevel = spdlog::level::debug;
     }
     else if (arg == "-q" || arg == "--quiet") {
       // diable logging
-      spdlog::set_level(spdlog::level::off);
+      initConfig.logLevel = spdlog::level::off;
     }
     else if (arg == "-h" || arg == "--help") {
       printUsage(argv);
@@ -470,13 +1919,19 @@ void parseArgsFromJson(const json &inputJson, RunConfig &runConfig, piper::Audio
   //   std::cout << "Model config path exists: " << runConfig.modelConfigPath.string() << std::endl;
   // }
 
+  if (inputJson.contains("outputFormat"))
+  {
+    runConfig.outputFormat = piper::parseOutputFormat(inputJson["outputFormat"].get<std::string>());
+  }
+
+  std::string outputExtension = piper::createEncoder(runConfig.outputFormat)->fileExtension();
   if (inputJson.contains("output_file"))
   {
-    runConfig.outputFile = inputJson["output_file"].get<std::string>() + ".wav";
+    runConfig.outputFile = inputJson["output_file"].get<std::string>() + "." + outputExtension;
   }
   else {
     //TODO: generate random uuid for output file 
-    runConfig.outputFile = "output.wav";
+    runConfig.outputFile = "output." + outputExtension;
   }
 
   if (inputJson.contains("outputType"))
@@ -499,6 +1954,10 @@ void parseArgsFromJson(const json &inputJson, RunConfig &runConfig, piper::Audio
       runConfig.outputType = OUTPUT_RAW;
     }
   }
+  if (inputJson.contains("stream"))
+  {
+    runConfig.stream = inputJson["stream"].get<bool>();
+  }
   if (inputJson.contains("outputPath"))
   {
     runConfig.outputPath = inputJson["outputPath"].get<std::string>();
@@ -559,6 +2018,24 @@ void parseArgsFromJson(const json &inputJson, RunConfig &runConfig, piper::Audio
   {
     runConfig.useCuda = inputJson["useCuda"].get<bool>();
   }
+  if (inputJson.contains("priority"))
+  {
+    // "interactive", "normal", "bulk", or a number (higher runs first)
+    const json &priorityJson = inputJson["priority"];
+    runConfig.priority = priorityJson.is_number()
+                             ? priorityJson.get<int>()
+                             : piper::parsePriority(priorityJson.get<std::string>());
+  }
+  if (inputJson.contains("requestId"))
+  {
+    runConfig.requestId = inputJson["requestId"].get<std::string>();
+  }
+  if (inputJson.contains("deadline_ms"))
+  {
+    // Relative to when the request arrived
+    runConfig.deadline = runConfig.arrivalTime +
+                         chrono::milliseconds(inputJson["deadline_ms"].get<int64_t>());
+  }
   if (inputJson.contains("semitones"))
   {
     effects.semitones = inputJson["semitones"].get<float>();
@@ -615,4 +2092,28 @@ void parseArgsFromJson(const json &inputJson, RunConfig &runConfig, piper::Audio
   {
     effects.stereo = inputJson["stereo"].get<bool>();
   }
+  if (inputJson.contains("channels"))
+  {
+    effects.channels = inputJson["channels"].get<int>();
+    if ((effects.channels < 1) || (effects.channels > 8))
+    {
+      throw std::invalid_argument("channels should be within the range of 1 to 8");
+    }
+  }
+  if (inputJson.contains("pan"))
+  {
+    effects.pan = inputJson["pan"].get<float>();
+    if ((effects.pan < -1.0f) || (effects.pan > 1.0f))
+    {
+      throw std::invalid_argument("pan should be within the range of -1 to 1");
+    }
+  }
+  if (inputJson.contains("haasDelayMs"))
+  {
+    effects.haasDelayMs = inputJson["haasDelayMs"].get<float>();
+    if ((effects.haasDelayMs < 0.0f) || (effects.haasDelayMs > 40.0f))
+    {
+      throw std::invalid_argument("haasDelayMs should be within the range of 0 to 40");
+    }
+  }
 }
\ No newline at end of file
@@ -1,17 +1,537 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
+#include <ogg/ogg.h>
+#include <opus/opus.h>
+
+#include "encoder.hpp"
 #include "json.hpp"
 #include "piper.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
+// ----------------------------------------------------------------------------
+// Encoder round trips
+// ----------------------------------------------------------------------------
+
+// Sine sweep, then noise, then silence (exercises FLAC's predictors, Rice
+// coding, and CONSTANT subframes)
+static std::vector<int16_t> makeTestSignal(int sampleRate, int channels) {
+  std::vector<int16_t> signal;
+  uint32_t noiseState = 12345;
+  for (int i = 0; i < sampleRate; i++) {
+    double t = static_cast<double>(i) / sampleRate;
+    for (int channel = 0; channel < channels; channel++) {
+      int32_t value = 0;
+      if (i < (sampleRate / 2)) {
+        value = static_cast<int32_t>(
+            12000 * std::sin(2 * M_PI * (220 + (200 * t) + (110 * channel)) * t));
+      } else if (i < ((3 * sampleRate) / 4)) {
+        noiseState = (noiseState * 1103515245) + 12345;
+        value = static_cast<int32_t>((noiseState >> 16) & 0x3FFF) - 0x2000;
+      }
+
+      signal.push_back(static_cast<int16_t>(value));
+    }
+  }
+
+  return signal;
+}
+
+// Encode in uneven chunks, like sentences arriving one at a time
+static std::string encodeSignal(piper::OutputFormat format,
+                                const std::vector<int16_t> &signal,
+                                int sampleRate, int channels) {
+  std::stringstream out(std::ios::in | std::ios::out | std::ios::binary);
+  auto encoder = piper::createEncoder(format);
+  encoder->begin(sampleRate, channels, out);
+
+  const std::size_t chunkSize = 1237 * channels;
+  for (std::size_t offset = 0; offset < signal.size(); offset += chunkSize) {
+    encoder->encode(signal.data() + offset,
+                    std::min(chunkSize, signal.size() - offset), out);
+  }
+
+  encoder->end(out);
+  return out.str();
+}
+
+static uint32_t readLittleEndian(const std::string &bytes, std::size_t offset,
+                                 int numBytes) {
+  uint32_t value = 0;
+  for (int i = numBytes - 1; i >= 0; i--) {
+    value = (value << 8) | static_cast<uint8_t>(bytes[offset + i]);
+  }
+
+  return value;
+}
+
+static bool fail(const std::string &message) {
+  std::cerr << "ERROR: " << message << std::endl;
+  return false;
+}
+
+// G.711 decoders (see Sun Microsystems g711.c)
+static int16_t muLawToLinear(uint8_t value) {
+  value = ~value;
+  int magnitude = (((value & 0x0F) << 3) + 0x84) << ((value & 0x70) >> 4);
+  return static_cast<int16_t>((value & 0x80) ? (0x84 - magnitude)
+                                             : (magnitude - 0x84));
+}
+
+static int16_t aLawToLinear(uint8_t value) {
+  value ^= 0x55;
+  int magnitude = (value & 0x0F) << 4;
+  int segment = (value & 0x70) >> 4;
+  if (segment == 0) {
+    magnitude += 8;
+  } else {
+    magnitude = (magnitude + 0x108) << (segment - 1);
+  }
+
+  return static_cast<int16_t>((value & 0x80) ? magnitude : -magnitude);
+}
+
+static bool testG711(piper::OutputFormat format) {
+  const int sampleRate = 8000;
+  bool isMuLaw = (format == piper::OUTPUT_FORMAT_MULAW);
+  auto signal = makeTestSignal(sampleRate, 1);
+  auto wav = encodeSignal(format, signal, sampleRate, 1);
+
+  // RIFF header, 18-byte fmt chunk, fact chunk, data chunk
+  const std::size_t headerSize = 58;
+  if (wav.size() != (headerSize + signal.size())) {
+    return fail("G.711 WAV has unexpected size");
+  }
+
+  if ((wav.compare(0, 4, "RIFF") != 0) ||
+      (readLittleEndian(wav, 4, 4) != (wav.size() - 8)) ||
+      (wav.compare(8, 8, "WAVEfmt ") != 0) ||
+      (readLittleEndian(wav, 16, 4) != 18) ||
+      (readLittleEndian(wav, 20, 2) != (isMuLaw ? 7u : 6u)) ||
+      (readLittleEndian(wav, 22, 2) != 1) ||
+      (readLittleEndian(wav, 24, 4) != sampleRate) ||
+      (readLittleEndian(wav, 34, 2) != 8) ||
+      (readLittleEndian(wav, 36, 2) != 0) ||
+      (wav.compare(38, 4, "fact") != 0) ||
+      (readLittleEndian(wav, 42, 4) != 4) ||
+      (readLittleEndian(wav, 46, 4) != signal.size()) ||
+      (wav.compare(50, 4, "data") != 0) ||
+      (readLittleEndian(wav, 54, 4) != signal.size())) {
+    return fail("G.711 WAV header is malformed");
+  }
+
+  for (std::size_t i = 0; i < signal.size(); i++) {
+    uint8_t encoded = static_cast<uint8_t>(wav[headerSize + i]);
+    int decoded = isMuLaw ? muLawToLinear(encoded) : aLawToLinear(encoded);
+
+    // Logarithmic quantization: error grows with magnitude
+    int tolerance = 32 + (std::abs(signal[i]) / 16);
+    if (std::abs(decoded - signal[i]) > tolerance) {
+      return fail("G.711 sample " + std::to_string(i) + " decoded as " +
+                  std::to_string(decoded) + ", expected " +
+                  std::to_string(signal[i]));
+    }
+  }
+
+  return true;
+}
+
+// Reads bits MSB first
+class BitReader {
+public:
+  BitReader(const std::string &bytes, std::size_t bytePos)
+      : bytes(bytes), bitPos(bytePos * 8) {}
+
+  uint32_t readBits(int numBits) {
+    uint32_t value = 0;
+    for (int i = 0; i < numBits; i++) {
+      if ((bitPos / 8) >= bytes.size()) {
+        throw std::runtime_error("Read past end of FLAC stream");
+      }
+
+      uint8_t byte = static_cast<uint8_t>(bytes[bitPos / 8]);
+      value = (value << 1) | ((byte >> (7 - (bitPos % 8))) & 1);
+      bitPos++;
+    }
+
+    return value;
+  }
+
+  int32_t readSigned(int numBits) {
+    uint32_t value = readBits(numBits);
+    uint32_t signBit = 1u << (numBits - 1);
+    return static_cast<int32_t>((value ^ signBit) - signBit);
+  }
+
+  uint32_t readUnary() {
+    uint32_t value = 0;
+    while (readBits(1) == 0) {
+      value++;
+    }
+
+    return value;
+  }
+
+  void alignToByte() { bitPos = (bitPos + 7) & ~static_cast<std::size_t>(7); }
+
+  std::size_t bytePos() const { return bitPos / 8; }
+
+  bool atEnd() const { return (bitPos / 8) >= bytes.size(); }
+
+private:
+  const std::string &bytes;
+  std::size_t bitPos;
+};
+
+static uint32_t flacCrc(const std::string &bytes, std::size_t begin,
+                        std::size_t end, int width, uint32_t polynomial) {
+  uint32_t topBit = 1u << (width - 1);
+  uint32_t mask = (width == 32) ? 0xFFFFFFFF : ((1u << width) - 1);
+  uint32_t crc = 0;
+  for (std::size_t i = begin; i < end; i++) {
+    crc ^= static_cast<uint32_t>(static_cast<uint8_t>(bytes[i])) << (width - 8);
+    for (int bit = 0; bit < 8; bit++) {
+      crc = ((crc & topBit) ? ((crc << 1) ^ polynomial) : (crc << 1)) & mask;
+    }
+  }
+
+  return crc;
+}
+
+// Decodes the subset of FLAC written by the encoder (fixed block size,
+// independent channels, CONSTANT/VERBATIM/FIXED subframes)
+static bool decodeFlac(const std::string &flac, int &sampleRate,
+                       int &channels, std::vector<int16_t> &samples) {
+  if (flac.compare(0, 4, "fLaC") != 0) {
+    return fail("FLAC marker missing");
+  }
+
+  BitReader reader(flac, 4);
+  if ((reader.readBits(1) != 1) || (reader.readBits(7) != 0) ||
+      (reader.readBits(24) != 34)) {
+    return fail("FLAC STREAMINFO missing");
+  }
+
+  reader.readBits(16); // min block size
+  reader.readBits(16); // max block size
+  reader.readBits(24); // min frame size
+  reader.readBits(24); // max frame size
+  sampleRate = static_cast<int>(reader.readBits(20));
+  channels = static_cast<int>(reader.readBits(3)) + 1;
+  if (reader.readBits(5) != 15) {
+    return fail("FLAC is not 16-bit");
+  }
+
+  uint64_t totalFrames = static_cast<uint64_t>(reader.readBits(4)) << 32;
+  totalFrames |= reader.readBits(32);
+  for (int i = 0; i < 4; i++) {
+    reader.readBits(32); // MD5
+  }
+
+  std::vector<std::vector<int32_t>> channelSignals(channels);
+  uint32_t expectedFrameNumber = 0;
+  while (!reader.atEnd()) {
+    std::size_t frameStart = reader.bytePos();
+    if (reader.readBits(14) != 0x3FFE) {
+      return fail("FLAC frame sync missing");
+    }
+
+    reader.readBits(2);
+    uint32_t blockSizeCode = reader.readBits(4);
+    reader.readBits(4); // sample rate from STREAMINFO
+    if (reader.readBits(4) != static_cast<uint32_t>(channels - 1)) {
+      return fail("FLAC channel assignment mismatch");
+    }
+
+    reader.readBits(4); // sample size and reserved bit
+
+    // UTF-8 coded frame number
+    uint32_t firstByte = reader.readBits(8);
+    int extraBytes = 0;
+    while ((extraBytes < 6) && (firstByte & (0x80 >> (extraBytes + 1))) &&
+           (firstByte & 0x80)) {
+      extraBytes++;
+    }
+
+    uint32_t frameNumber = firstByte & (0x7F >> extraBytes);
+    for (int i = 0; i < extraBytes; i++) {
+      frameNumber = (frameNumber << 6) | (reader.readBits(8) & 0x3F);
+    }
+
+    if (frameNumber != expectedFrameNumber++) {
+      return fail("FLAC frame number out of order");
+    }
+
+    uint32_t blockSize = 0;
+    if (blockSizeCode == 6) {
+      blockSize = reader.readBits(8) + 1;
+    } else if (blockSizeCode == 7) {
+      blockSize = reader.readBits(16) + 1;
+    } else if (blockSizeCode >= 8) {
+      blockSize = 256u << (blockSizeCode - 8);
+    } else {
+      return fail("Unexpected FLAC block size code");
+    }
+
+    uint32_t headerCrc = flacCrc(flac, frameStart, reader.bytePos(), 8, 0x07);
+    if (reader.readBits(8) != headerCrc) {
+      return fail("FLAC frame header CRC mismatch");
+    }
+
+    for (int channel = 0; channel < channels; channel++) {
+      std::vector<int32_t> &signal = channelSignals[channel];
+      std::size_t start = signal.size();
+      reader.readBits(1);
+      uint32_t type = reader.readBits(6);
+      if (reader.readBits(1) != 0) {
+        return fail("Unexpected FLAC wasted bits");
+      }
+
+      if (type == 0) {
+        signal.insert(signal.end(), blockSize, reader.readSigned(16));
+        continue;
+      }
+
+      if (type == 1) {
+        for (uint32_t i = 0; i < blockSize; i++) {
+          signal.push_back(reader.readSigned(16));
+        }
+        continue;
+      }
+
+      if ((type < 8) || (type > 12)) {
+        return fail("Unexpected FLAC subframe type");
+      }
+
+      uint32_t order = type & 0x07;
+      for (uint32_t i = 0; i < order; i++) {
+        signal.push_back(reader.readSigned(16));
+      }
+
+      if (reader.readBits(2) != 0) {
+        return fail("Unexpected FLAC residual coding");
+      }
+
+      uint32_t partitionOrder = reader.readBits(4);
+      uint32_t numPartitions = 1u << partitionOrder;
+      for (uint32_t partition = 0; partition < numPartitions; partition++) {
+        uint32_t riceParameter = reader.readBits(4);
+        if (riceParameter == 15) {
+          return fail("Unexpected FLAC escaped partition");
+        }
+
+        uint32_t numResiduals = blockSize >> partitionOrder;
+        if (partition == 0) {
+          numResiduals -= order;
+        }
+
+        for (uint32_t i = 0; i < numResiduals; i++) {
+          uint32_t value =
+              (reader.readUnary() << riceParameter) | reader.readBits(riceParameter);
+          int32_t residual =
+              static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+
+          const int32_t *s = signal.data() + signal.size();
+          int32_t prediction = 0;
+          switch (order) {
+          case 1:
+            prediction = s[-1];
+            break;
+          case 2:
+            prediction = (2 * s[-1]) - s[-2];
+            break;
+          case 3:
+            prediction = (3 * s[-1]) - (3 * s[-2]) + s[-3];
+            break;
+          case 4:
+            prediction = (4 * s[-1]) - (6 * s[-2]) + (4 * s[-3]) - s[-4];
+            break;
+          }
+
+          signal.push_back(prediction + residual);
+        }
+      }
+
+      if ((signal.size() - start) != blockSize) {
+        return fail("FLAC subframe has wrong length");
+      }
+    }
+
+    reader.alignToByte();
+    uint32_t frameCrc = flacCrc(flac, frameStart, reader.bytePos(), 16, 0x8005);
+    if (reader.readBits(16) != frameCrc) {
+      return fail("FLAC frame CRC mismatch");
+    }
+  }
+
+  if (channelSignals[0].size() != totalFrames) {
+    return fail("FLAC total samples in STREAMINFO is wrong");
+  }
+
+  samples.clear();
+  for (std::size_t i = 0; i < totalFrames; i++) {
+    for (int channel = 0; channel < channels; channel++) {
+      samples.push_back(static_cast<int16_t>(channelSignals[channel][i]));
+    }
+  }
+
+  return true;
+}
+
+static bool testFlac(int channels) {
+  const int sampleRate = 22050;
+  auto signal = makeTestSignal(sampleRate, channels);
+  auto flac = encodeSignal(piper::OUTPUT_FORMAT_FLAC, signal, sampleRate,
+                           channels);
+
+  int decodedRate = 0;
+  int decodedChannels = 0;
+  std::vector<int16_t> decoded;
+  if (!decodeFlac(flac, decodedRate, decodedChannels, decoded)) {
+    return false;
+  }
+
+  if ((decodedRate != sampleRate) || (decodedChannels != channels)) {
+    return fail("FLAC stream format mismatch");
+  }
+
+  if (decoded != signal) {
+    return fail("FLAC round trip is not lossless");
+  }
+
+  return true;
+}
+
+static double rms(const int16_t *samples, std::size_t numSamples) {
+  double sum = 0;
+  for (std::size_t i = 0; i < numSamples; i++) {
+    sum += static_cast<double>(samples[i]) * samples[i];
+  }
+
+  return (numSamples > 0) ? std::sqrt(sum / numSamples) : 0;
+}
+
+static bool testOpus() {
+  const int sampleRate = 22050;
+  const int opusRate = 48000;
+  auto signal = makeTestSignal(sampleRate, 1);
+  auto ogg = encodeSignal(piper::OUTPUT_FORMAT_OPUS, signal, sampleRate, 1);
+
+  ogg_sync_state sync;
+  ogg_sync_init(&sync);
+  char *buffer = ogg_sync_buffer(&sync, static_cast<long>(ogg.size()));
+  std::memcpy(buffer, ogg.data(), ogg.size());
+  ogg_sync_wrote(&sync, static_cast<long>(ogg.size()));
+
+  ogg_stream_state stream;
+  bool streamStarted = false;
+  OpusDecoder *decoder = nullptr;
+  uint32_t preSkip = 0;
+  int64_t endGranule = -1;
+  int numPackets = 0;
+  std::vector<opus_int16> pcm(opusRate * 120 / 1000); // max packet duration
+  std::vector<int16_t> decoded;
+  std::string error;
+
+  ogg_page page;
+  while (error.empty() && (ogg_sync_pageout(&sync, &page) == 1)) {
+    if (!streamStarted) {
+      ogg_stream_init(&stream, ogg_page_serialno(&page));
+      streamStarted = true;
+    }
+
+    ogg_stream_pagein(&stream, &page);
+
+    ogg_packet packet;
+    while (error.empty() && (ogg_stream_packetout(&stream, &packet) == 1)) {
+      std::string bytes(reinterpret_cast<const char *>(packet.packet),
+                        packet.bytes);
+      if (numPackets == 0) {
+        if ((bytes.size() != 19) || (bytes.compare(0, 8, "OpusHead") != 0) ||
+            (bytes[9] != 1) || (readLittleEndian(bytes, 12, 4) != sampleRate)) {
+          error = "OpusHead is malformed";
+        } else {
+          preSkip = readLittleEndian(bytes, 10, 2);
+          int opusError = OPUS_OK;
+          decoder = opus_decoder_create(opusRate, 1, &opusError);
+          if (opusError != OPUS_OK) {
+            error = "Failed to create Opus decoder";
+          }
+        }
+      } else if (numPackets == 1) {
+        if (bytes.compare(0, 8, "OpusTags") != 0) {
+          error = "OpusTags is missing";
+        }
+      } else {
+        int numFrames = opus_decode(decoder, packet.packet,
+                                    static_cast<opus_int32>(packet.bytes),
+                                    pcm.data(), static_cast<int>(pcm.size()), 0);
+        if (numFrames < 0) {
+          error = std::string("Opus decoding failed: ") +
+                  opus_strerror(numFrames);
+        } else {
+          decoded.insert(decoded.end(), pcm.begin(), pcm.begin() + numFrames);
+          if (packet.e_o_s) {
+            endGranule = packet.granulepos;
+          }
+        }
+      }
+
+      numPackets++;
+    }
+  }
+
+  if (decoder) {
+    opus_decoder_destroy(decoder);
+  }
+
+  if (streamStarted) {
+    ogg_stream_clear(&stream);
+  }
+
+  ogg_sync_clear(&sync);
+
+  if (!error.empty()) {
+    return fail(error);
+  }
+
+  if ((endGranule < preSkip) ||
+      (decoded.size() < static_cast<std::size_t>(endGranule))) {
+    return fail("Opus end granule position is wrong");
+  }
+
+  // Duration survives resampling to within a millisecond
+  double expectedFrames =
+      static_cast<double>(signal.size()) * opusRate / sampleRate;
+  if (std::abs((endGranule - preSkip) - expectedFrames) > (opusRate / 1000)) {
+    return fail("Opus duration is wrong");
+  }
+
+  // Lossy, so only compare loudness of the sine section
+  std::size_t numSineFrames = (opusRate / 2) - (opusRate / 20);
+  double expectedRms = rms(signal.data(), sampleRate / 2);
+  double decodedRms = rms(decoded.data() + preSkip, numSineFrames);
+  if ((decodedRms < (0.7 * expectedRms)) || (decodedRms > (1.3 * expectedRms))) {
+    return fail("Opus decoded audio does not match the input");
+  }
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+
 int main(int argc, char *argv[]) {
   piper::PiperConfig piperConfig;
   piper::Voice voice;
@@ -31,6 +551,12 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (!testG711(piper::OUTPUT_FORMAT_MULAW) ||
+      !testG711(piper::OUTPUT_FORMAT_ALAW) || !testFlac(1) || !testFlac(2) ||
+      !testOpus()) {
+    return EXIT_FAILURE;
+  }
+
   auto modelPath = std::string(argv[1]);
   piperConfig.eSpeakDataPath = std::string(argv[2]);
   auto outputPath = std::string(argv[3]);
@@ -1,8 +1,12 @@
 #ifndef WAVFILE_H_
 #define WAVFILE_H_
 
+#include <cstdint>
 #include <iostream>
 
+// Length used in header when the final size is not known (streaming)
+const uint32_t WAV_STREAMING_SIZE = 0xFFFFFFFF;
+
 struct WavHeader {
   uint8_t RIFF[4] = {'R', 'I', 'F', 'F'};
   uint32_t chunkSize;
@@ -23,9 +27,39 @@ struct WavHeader {
   uint32_t dataSize;
 };
 
+// Header for non-PCM formats (G.711 mu-law/A-law), which need the 18-byte fmt
+// chunk (with cbSize) and a fact chunk holding the number of sample frames.
+#pragma pack(push, 1)
+struct WavNonPcmHeader {
+  uint8_t RIFF[4] = {'R', 'I', 'F', 'F'};
+  uint32_t chunkSize;
+  uint8_t WAVE[4] = {'W', 'A', 'V', 'E'};
+
+  // fmt
+  uint8_t fmt[4] = {'f', 'm', 't', ' '};
+  uint32_t fmtSize = 18; // bytes
+  uint16_t audioFormat;
+  uint16_t numChannels;
+  uint32_t sampleRate;
+  uint32_t bytesPerSec;
+  uint16_t blockAlign;
+  uint16_t bitsPerSample;
+  uint16_t cbSize = 0; // no extra format bytes
+
+  // fact
+  uint8_t fact[4] = {'f', 'a', 'c', 't'};
+  uint32_t factSize = 4;
+  uint32_t sampleLength; // sample frames (per channel)
+
+  // data
+  uint8_t data[4] = {'d', 'a', 't', 'a'};
+  uint32_t dataSize;
+};
+#pragma pack(pop)
+
 // Write WAV file header only
-void writeWavHeader(int sampleRate, int sampleWidth, int channels,
-                    uint32_t numSamples, std::ostream &audioFile) {
+inline void writeWavHeader(int sampleRate, int sampleWidth, int channels,
+                           uint32_t numSamples, std::ostream &audioFile) {
   WavHeader header;
   header.dataSize = numSamples * sampleWidth * channels;
   header.chunkSize = header.dataSize + sizeof(WavHeader) - 8;
@@ -37,4 +71,102 @@ void writeWavHeader(int sampleRate, int sampleWidth, int channels,
 
 } /* writeWavHeader */
 
+// Writes a WAV file incrementally without knowing its length up front.
+//
+// A provisional header is written first. On close, the sizes are patched if
+// the stream is seekable (files, string streams). Otherwise (stdout, pipes,
+// sockets) they are left as 0xFFFFFFFF, which players treat as "read until
+// end of stream".
+class WavWriter {
+public:
+  WavWriter(std::ostream &audioFile, int sampleRate, int sampleWidth,
+            int channels, uint16_t audioFormat = 1)
+      : audioFile(audioFile) {
+    header.audioFormat = audioFormat;
+    header.numChannels = channels;
+    header.sampleRate = sampleRate;
+    header.bytesPerSec = sampleRate * sampleWidth * channels;
+    header.blockAlign = sampleWidth * channels;
+    header.bitsPerSample = sampleWidth * 8;
+    header.chunkSize = WAV_STREAMING_SIZE;
+    header.dataSize = WAV_STREAMING_SIZE;
+
+    headerPos = audioFile.tellp();
+    writeHeader(WAV_STREAMING_SIZE);
+  }
+
+  ~WavWriter() { close(); }
+
+  WavWriter(const WavWriter &) = delete;
+  WavWriter &operator=(const WavWriter &) = delete;
+
+  // Append 16-bit samples (all channels, interleaved)
+  void writeSamples(const int16_t *samples, std::size_t numSamples) {
+    writeBytes(reinterpret_cast<const char *>(samples),
+               sizeof(int16_t) * numSamples);
+  }
+
+  // Append already encoded sample data
+  void writeBytes(const char *bytes, std::size_t numBytes) {
+    audioFile.write(bytes, numBytes);
+    dataSize += numBytes;
+  }
+
+  // Number of bytes in data chunk so far
+  std::size_t getDataSize() const { return dataSize; }
+
+  // Patch header sizes if possible
+  void close() {
+    if (closed) {
+      return;
+    }
+
+    closed = true;
+    if (headerPos == std::streampos(-1)) {
+      // Not seekable, keep streaming sizes
+      return;
+    }
+
+    header.dataSize = static_cast<uint32_t>(dataSize);
+
+    auto endPos = audioFile.tellp();
+    audioFile.seekp(headerPos);
+    writeHeader(header.dataSize / header.blockAlign);
+    audioFile.seekp(endPos);
+  }
+
+private:
+  // PCM uses the canonical 44-byte header, other formats the extended one
+  void writeHeader(uint32_t sampleLength) {
+    if (header.audioFormat == 1) {
+      header.chunkSize = (header.dataSize == WAV_STREAMING_SIZE)
+                             ? WAV_STREAMING_SIZE
+                             : header.dataSize + sizeof(WavHeader) - 8;
+      audioFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      return;
+    }
+
+    WavNonPcmHeader nonPcmHeader;
+    nonPcmHeader.audioFormat = header.audioFormat;
+    nonPcmHeader.numChannels = header.numChannels;
+    nonPcmHeader.sampleRate = header.sampleRate;
+    nonPcmHeader.bytesPerSec = header.bytesPerSec;
+    nonPcmHeader.blockAlign = header.blockAlign;
+    nonPcmHeader.bitsPerSample = header.bitsPerSample;
+    nonPcmHeader.sampleLength = sampleLength;
+    nonPcmHeader.dataSize = header.dataSize;
+    nonPcmHeader.chunkSize = (header.dataSize == WAV_STREAMING_SIZE)
+                                 ? WAV_STREAMING_SIZE
+                                 : header.dataSize + sizeof(WavNonPcmHeader) - 8;
+    audioFile.write(reinterpret_cast<const char *>(&nonPcmHeader),
+                    sizeof(nonPcmHeader));
+  }
+
+  std::ostream &audioFile;
+  WavHeader header;
+  std::streampos headerPos = -1;
+  std::size_t dataSize = 0;
+  bool closed = false;
+};
+
 #endif // WAVFILE_H_
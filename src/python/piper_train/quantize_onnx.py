@@ -0,0 +1,310 @@
+#!/usr/bin/env python3
+"""Create INT8 and fp16 variants of an exported voice.
+
+Variants are written next to the model as <model>.int8.onnx and
+<model>.fp16.onnx, where Piper picks them up automatically.
+"""
+import argparse
+import json
+import logging
+from pathlib import Path
+from typing import Any, Dict, Iterable, List, Optional
+
+import numpy as np
+import onnx
+import onnxruntime
+from onnxruntime.quantization import (
+    CalibrationDataReader,
+    QuantFormat,
+    QuantType,
+    quantize_dynamic,
+    quantize_static,
+)
+
+_LOGGER = logging.getLogger("piper_train.quantize_onnx")
+
+_DIR = Path(__file__).parent
+_TEST_SENTENCES_DIR = _DIR.parent.parent.parent / "etc" / "test_sentences"
+
+# Deterministic scales so fp32 and quantized output can be compared
+_CALIBRATION_SCALES = [0.0, 1.0, 0.0]
+
+# Weight-heavy ops; normalizing flows and duration math stay in fp32
+_DYNAMIC_OP_TYPES = ["MatMul", "Conv", "ConvTranspose"]
+
+
+class PhonemeIdsDataReader(CalibrationDataReader):
+    """Feeds phoneme ids from test sentences into the model"""
+
+    def __init__(self, utterances: List[Dict[str, Any]], num_speakers: int):
+        self.utterances = utterances
+        self.num_speakers = num_speakers
+        self._iter: Optional[Iterable[Dict[str, np.ndarray]]] = None
+
+    def get_next(self) -> Optional[Dict[str, np.ndarray]]:
+        if self._iter is None:
+            self._iter = iter(
+                [
+                    make_inputs(utt["phoneme_ids"], 0, self.num_speakers)
+                    for utt in self.utterances
+                ]
+            )
+
+        return next(self._iter, None)
+
+    def rewind(self) -> None:
+        self._iter = None
+
+
+def main() -> None:
+    """Main entry point"""
+    parser = argparse.ArgumentParser()
+    parser.add_argument("model", help="Path to exported model (.onnx)")
+    parser.add_argument("-c", "--config", help="Path to model config (.onnx.json)")
+    parser.add_argument(
+        "--test-sentences",
+        action="append",
+        help="JSONL file with phoneme_ids for calibration (default: etc/test_sentences)",
+    )
+    parser.add_argument(
+        "--int8", action="store_true", help="Create INT8 variant (.int8.onnx)"
+    )
+    parser.add_argument(
+        "--fp16", action="store_true", help="Create fp16-weight variant (.fp16.onnx)"
+    )
+    parser.add_argument(
+        "--static",
+        action="store_true",
+        help="Calibrate activations too (static INT8 instead of dynamic)",
+    )
+    parser.add_argument(
+        "--max-distance",
+        type=float,
+        default=6.0,
+        help="Remove variants whose mean mel-cepstral distance (dB) exceeds this",
+    )
+    parser.add_argument(
+        "--debug", action="store_true", help="Print DEBUG messages to the console"
+    )
+    args = parser.parse_args()
+
+    if args.debug:
+        logging.basicConfig(level=logging.DEBUG)
+    else:
+        logging.basicConfig(level=logging.INFO)
+
+    _LOGGER.debug(args)
+
+    if not (args.int8 or args.fp16):
+        args.int8 = True
+        args.fp16 = True
+
+    # -------------------------------------------------------------------------
+
+    args.model = Path(args.model)
+    if not args.config:
+        args.config = f"{args.model}.json"
+
+    with open(args.config, "r", encoding="utf-8") as config_file:
+        config = json.load(config_file)
+
+    sample_rate = config["audio"]["sample_rate"]
+    num_speakers = config.get("num_speakers", 1)
+    utterances = load_test_sentences(config, args.test_sentences)
+    _LOGGER.info("Loaded %s calibration sentence(s)", len(utterances))
+
+    variants: List[Path] = []
+
+    if args.int8:
+        int8_path = args.model.with_suffix(".int8.onnx")
+        if args.static:
+            quantize_static(
+                str(args.model),
+                str(int8_path),
+                PhonemeIdsDataReader(utterances, num_speakers),
+                quant_format=QuantFormat.QDQ,
+                op_types_to_quantize=_DYNAMIC_OP_TYPES,
+                weight_type=QuantType.QInt8,
+                activation_type=QuantType.QUInt8,
+            )
+        else:
+            quantize_dynamic(
+                str(args.model),
+                str(int8_path),
+                op_types_to_quantize=_DYNAMIC_OP_TYPES,
+                weight_type=QuantType.QInt8,
+            )
+
+        _LOGGER.info("Wrote INT8 model to %s", int8_path)
+        variants.append(int8_path)
+
+    if args.fp16:
+        from onnxconverter_common import float16
+
+        fp16_path = args.model.with_suffix(".fp16.onnx")
+        model_fp16 = float16.convert_float_to_float16(
+            onnx.load(str(args.model)), keep_io_types=True
+        )
+        onnx.save(model_fp16, str(fp16_path))
+
+        _LOGGER.info("Wrote fp16 model to %s", fp16_path)
+        variants.append(fp16_path)
+
+    # -------------------------------------------------------------------------
+    # Compare against fp32
+    # -------------------------------------------------------------------------
+
+    reference = onnxruntime.InferenceSession(str(args.model))
+    reference_audio = [
+        run_model(reference, utt["phoneme_ids"], num_speakers)
+        for utt in utterances
+    ]
+
+    for variant_path in variants:
+        session = onnxruntime.InferenceSession(str(variant_path))
+        distances = [
+            mel_cepstral_distance(
+                ref_audio,
+                run_model(session, utt["phoneme_ids"], num_speakers),
+                sample_rate,
+            )
+            for ref_audio, utt in zip(reference_audio, utterances)
+        ]
+        mean_distance = float(np.mean(distances))
+        _LOGGER.info(
+            "%s: mel-cepstral distance %.2f dB (max %.2f dB)",
+            variant_path.name,
+            mean_distance,
+            float(np.max(distances)),
+        )
+
+        if mean_distance > args.max_distance:
+            _LOGGER.warning(
+                "Removing %s: distance is above %.2f dB",
+                variant_path,
+                args.max_distance,
+            )
+            variant_path.unlink()
+
+
+# -----------------------------------------------------------------------------
+
+
+def load_test_sentences(
+    config: Dict[str, Any], paths: Optional[List[str]]
+) -> List[Dict[str, Any]]:
+    """Load utterances with phoneme_ids from test sentence JSONL files"""
+    if not paths:
+        voice = config.get("espeak", {}).get("voice", "en-us")
+        language = voice.split("-")[0]
+        candidates = [
+            _TEST_SENTENCES_DIR / f"test_{voice}.jsonl",
+            _TEST_SENTENCES_DIR / f"test_{language}.jsonl",
+        ]
+        paths = [str(p) for p in candidates if p.exists()][:1]
+
+    if not paths:
+        raise ValueError("No test sentences found (use --test-sentences)")
+
+    utterances: List[Dict[str, Any]] = []
+    for path in paths:
+        with open(path, "r", encoding="utf-8") as test_file:
+            for line in test_file:
+                line = line.strip()
+                if line:
+                    utterance = json.loads(line)
+                    if "phoneme_ids" in utterance:
+                        utterances.append(utterance)
+
+    return utterances
+
+
+def make_inputs(
+    phoneme_ids: List[int], speaker_id: int, num_speakers: int
+) -> Dict[str, np.ndarray]:
+    inputs = {
+        "input": np.expand_dims(np.array(phoneme_ids, dtype=np.int64), 0),
+        "input_lengths": np.array([len(phoneme_ids)], dtype=np.int64),
+        "scales": np.array(_CALIBRATION_SCALES, dtype=np.float32),
+    }
+
+    if num_speakers > 1:
+        inputs["sid"] = np.array([speaker_id], dtype=np.int64)
+
+    return inputs
+
+
+def run_model(
+    session: onnxruntime.InferenceSession, phoneme_ids: List[int], num_speakers: int
+) -> np.ndarray:
+    return session.run(None, make_inputs(phoneme_ids, 0, num_speakers))[0].squeeze()
+
+
+def mel_cepstral_distance(
+    reference: np.ndarray,
+    audio: np.ndarray,
+    sample_rate: int,
+    num_mels: int = 40,
+    num_ceps: int = 13,
+) -> float:
+    """Mean mel-cepstral distance (dB) over frames, excluding c0.
+
+    Audio is truncated to the shorter length since quantization may shift
+    predicted durations slightly.
+    """
+    n_fft = 1024
+    hop = 256
+    num_samples = min(len(reference), len(audio))
+    if num_samples < n_fft:
+        return 0.0
+
+    ref_ceps = _mel_cepstrum(reference[:num_samples], sample_rate, n_fft, hop, num_mels)
+    ceps = _mel_cepstrum(audio[:num_samples], sample_rate, n_fft, hop, num_mels)
+    diff = ref_ceps[:, 1:num_ceps] - ceps[:, 1:num_ceps]
+
+    return float(
+        np.mean((10.0 / np.log(10.0)) * np.sqrt(2.0 * np.sum(diff**2, axis=1)))
+    )
+
+
+def _mel_cepstrum(
+    audio: np.ndarray, sample_rate: int, n_fft: int, hop: int, num_mels: int
+) -> np.ndarray:
+    num_frames = 1 + (len(audio) - n_fft) // hop
+    window = np.hanning(n_fft)
+    frames = np.stack(
+        [audio[i * hop : (i * hop) + n_fft] * window for i in range(num_frames)]
+    )
+    power = np.abs(np.fft.rfft(frames, n=n_fft)) ** 2
+
+    # Triangular mel filterbank
+    def hz_to_mel(hz):
+        return 2595.0 * np.log10(1.0 + (hz / 700.0))
+
+    def mel_to_hz(mel):
+        return 700.0 * ((10.0 ** (mel / 2595.0)) - 1.0)
+
+    mel_points = np.linspace(hz_to_mel(0), hz_to_mel(sample_rate / 2), num_mels + 2)
+    bins = np.floor((n_fft + 1) * mel_to_hz(mel_points) / sample_rate).astype(int)
+    filters = np.zeros((num_mels, (n_fft // 2) + 1))
+    for m in range(1, num_mels + 1):
+        left, center, right = bins[m - 1], bins[m], bins[m + 1]
+        for k in range(left, center):
+            filters[m - 1, k] = (k - left) / max(1, center - left)
+        for k in range(center, right):
+            filters[m - 1, k] = (right - k) / max(1, right - center)
+
+    log_mel = np.log(np.maximum(power @ filters.T, 1e-10))
+
+    # DCT-II
+    n = np.arange(num_mels)
+    dct = np.cos(np.pi / num_mels * (n[:, None] + 0.5) * n[None, :])
+    dct *= np.sqrt(2.0 / num_mels)
+
+    return log_mel @ dct
+
+
+# -----------------------------------------------------------------------------
+
+if __name__ == "__main__":
+    main()